@@ -0,0 +1,579 @@
+/* cbr.c/h - Constant bitrate output with null packet stuffing           */
+/*=======================================================================*/
+/* Copyright (C)2026 The tsmerge contributors                            */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "ts.h"
+#include "merger.h"
+#include "cbr.h"
+
+/* PCR values wrap at 2^33 * 300 (27MHz) */
+#define _PCR_WRAP ((uint64_t) 300 << 33)
+
+/* Length of one packet slot at 1 bit/s (27MHz) */
+#define _SLOT_TICKS ((uint64_t) TS_PACKET_SIZE * 8 * 27000000)
+
+/* After this long, exactly bitrate slots have been due (us) */
+#define _REBASE_US ((int64_t) TS_PACKET_SIZE * 8 * 1000000)
+
+/* The longest gap between PCRs, beyond which the PCR is treated as
+ * discontinuous, and how late a packet can be sent before the output
+ * is restarted at the latest random access point (27MHz) */
+#define _MAX_PCR_GAP (27000000)
+#define _MAX_LATE    (27000000 / 2)
+
+/* Time the stream is held back, to absorb gaps in the output (27MHz) */
+#define _DELAY (27000000 / 10)
+
+/* How far the sender can fall behind the output clock before it
+ * skips ahead, rather than sending a burst to catch up (ms) */
+#define _MAX_BEHIND_MS 100
+
+/* The shortest time between timer wakeups (us) */
+#define _MIN_INTERVAL_US 1000
+
+static int64_t _clock_us(void)
+{
+	struct timespec tp;
+	
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	
+	return((int64_t) tp.tv_sec * 1000000 + tp.tv_nsec / 1000);
+}
+
+static uint64_t _read_pcr(uint8_t *p)
+{
+	uint64_t base;
+	
+	base = ((uint64_t) p[6] << 25)
+	     | ((uint64_t) p[7] << 17)
+	     | ((uint64_t) p[8] << 9)
+	     | ((uint64_t) p[9] << 1)
+	     | ((uint64_t) p[10] >> 7);
+	
+	return(base * 300 + (((p[10] & 0x01) << 8) | p[11]));
+}
+
+static void _write_pcr(uint8_t *p, uint64_t pcr)
+{
+	uint64_t base = pcr / 300;
+	int ext = pcr % 300;
+	
+	p[6] = base >> 25;
+	p[7] = base >> 17;
+	p[8] = base >> 9;
+	p[9] = base >> 1;
+	p[10] = ((base & 0x01) << 7) | 0x7E | (ext >> 8);
+	p[11] = ext & 0xFF;
+}
+
+static int _open_udp(cbr_t *c, const char *output)
+{
+	char host[CBR_PATH_LEN];
+	char *port;
+	struct addrinfo hints;
+	struct addrinfo *re, *rp;
+	int r, sock;
+	
+	/* Open a socket to host:port. Returns -1 on error */
+	strcpy(host, output);
+	port = strrchr(host, ':');
+	*port++ = '\0';
+	
+	/* IPv6 addresses can be given in brackets */
+	r = strlen(host);
+	if(r >= 2 && host[0] == '[' && host[r - 1] == ']')
+	{
+		host[r - 1] = '\0';
+		memmove(host, host + 1, r - 1);
+	}
+	
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	
+	r = getaddrinfo(host, port, &hints, &re);
+	if(r != 0)
+	{
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(r));
+		return(-1);
+	}
+	
+	for(sock = -1, rp = re; sock == -1 && rp != NULL; rp = rp->ai_next)
+	{
+		sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+		if(sock == -1)
+		{
+			perror("socket");
+			continue;
+		}
+		
+		if(connect(sock, rp->ai_addr, rp->ai_addrlen) == -1)
+		{
+			perror("connect");
+			close(sock);
+			sock = -1;
+		}
+	}
+	
+	freeaddrinfo(re);
+	
+	if(sock == -1) return(-1);
+	
+	c->fd = sock;
+	c->udp = 1;
+	
+	return(0);
+}
+
+static void _start(cbr_t *c)
+{
+	uint64_t seq;
+	
+	/* Start from the latest random access point, with the PSI in
+	 * effect there. Any packets skipped over are counted as dropped */
+	seq = mx_join(c->s, c->psi, &c->psi_len);
+	
+	if(seq > c->seq)
+	{
+		__atomic_add_fetch(&c->dropped, seq - c->seq, __ATOMIC_RELAXED);
+	}
+	
+	c->seq = seq;
+	c->psi_sent = 0;
+	c->sync = 0;
+}
+
+static int _find_pcr(cbr_t *c)
+{
+	mx_output_t *o;
+	uint8_t *data;
+	uint64_t delta;
+	
+	/* Look for the PCR after the one at a. Returns 1 once found, or
+	 * 0 if it hasn't been output yet. The PCR is dropped if it is too
+	 * far from the last or runs backwards, and is tied to the output
+	 * clock again when it is reached */
+	for(; c->scan < mx_seq(c->s); c->scan++)
+	{
+		o = mx_info(c->s, c->scan);
+		if(o == NULL || mx_read(c->s, c->scan, &data) <= 0) return(0);
+		
+		if(o->pid != c->s->pcr_pid || (o->flags & MX_OUTPUT_PCR) == 0) continue;
+		
+		delta = (_read_pcr(data) + _PCR_WRAP - (uint64_t) c->pcr_a % _PCR_WRAP) % _PCR_WRAP;
+		
+		if(delta == 0 || delta > _MAX_PCR_GAP)
+		{
+			c->sync = 0;
+			__atomic_add_fetch(&c->resyncs, 1, __ATOMIC_RELAXED);
+			return(1);
+		}
+		
+		c->b = c->scan;
+		c->pcr_b = c->pcr_a + delta;
+		c->wait = -1;
+		
+		return(1);
+	}
+	
+	return(0);
+}
+
+static int _next(cbr_t *c, uint8_t *out)
+{
+	mx_output_t *o;
+	uint8_t *data;
+	int64_t due;
+	int n;
+	
+	/* Copy the stream packet due in the next slot to out. Returns
+	 * 1 if there is one, or 0 if a null packet should be sent */
+	
+	/* The PSI from joining goes first */
+	if(c->psi_sent < c->psi_len)
+	{
+		memcpy(out, c->psi + c->psi_sent, TS_PACKET_SIZE);
+		c->psi_sent += TS_PACKET_SIZE;
+		return(1);
+	}
+	
+	while(1)
+	{
+		n = mx_read(c->s, c->seq, &data);
+		o = mx_info(c->s, c->seq);
+		
+		if(n < 0 || (n > 0 && o == NULL))
+		{
+			/* The output has been overwritten */
+			_start(c);
+			continue;
+		}
+		
+		if(n == 0) return(0);
+		
+		/* Null packets are replaced by the stuffing */
+		if(o->pid == TS_NULL_PID)
+		{
+			c->seq++;
+			continue;
+		}
+		
+		if(o->pid == c->s->pcr_pid && (o->flags & MX_OUTPUT_PCR))
+		{
+			if(!c->sync)
+			{
+				/* Tie the stream PCR to the output clock here,
+				 * sending the packet _DELAY from now */
+				c->sync = 1;
+				c->a = c->seq;
+				c->b = c->seq;
+				c->scan = c->seq + 1;
+				c->pcr_a = _read_pcr(data);
+				c->offset = (int64_t) c->clock + _DELAY - c->pcr_a;
+				c->wait = -1;
+				
+				/* Any time after the first, the restamped PCR jumps */
+				c->discontinuity = c->anchored;
+				c->anchored = 1;
+			}
+			else if(c->seq == c->b && c->b != c->a)
+			{
+				c->a = c->b;
+				c->pcr_a = c->pcr_b;
+				c->scan = c->b + 1;
+			}
+		}
+		
+		if(c->sync)
+		{
+			/* The time of the packets after a PCR can't be
+			 * known until the next PCR has been output */
+			if(c->seq != c->a && c->b == c->a && !_find_pcr(c))
+			{
+				if(c->wait < 0) c->wait = c->clock;
+				if(c->clock - c->wait < _MAX_PCR_GAP) return(0);
+				
+				/* Give up on it, and send the stream as it comes */
+				c->sync = 0;
+				__atomic_add_fetch(&c->resyncs, 1, __ATOMIC_RELAXED);
+			}
+		}
+		
+		if(c->sync)
+		{
+			due = c->pcr_a + c->offset;
+			
+			if(c->seq != c->a)
+			{
+				due += (c->pcr_b - c->pcr_a) * (int64_t) (c->seq - c->a) / (int64_t) (c->b - c->a);
+			}
+			
+			if((int64_t) c->clock < due) return(0);
+			
+			if((int64_t) c->clock - due > _MAX_LATE)
+			{
+				/* The stream is more than the bitrate can carry */
+				__atomic_add_fetch(&c->resyncs, 1, __ATOMIC_RELAXED);
+				_start(c);
+				continue;
+			}
+		}
+		
+		memcpy(out, data, TS_PACKET_SIZE);
+		
+		/* The packet may have been overwritten meanwhile */
+		if(mx_seq(c->s) + 1 - c->seq > _OUTPUT_PACKETS)
+		{
+			_start(c);
+			continue;
+		}
+		
+		/* The PCR becomes the time the packet is actually sent */
+		if(c->sync && c->seq == c->a)
+		{
+			_write_pcr(out, ((int64_t) c->clock - c->offset) % _PCR_WRAP);
+			
+			if(c->discontinuity)
+			{
+				out[5] |= 0x80;
+				c->discontinuity = 0;
+			}
+		}
+		
+		c->seq++;
+		
+		return(1);
+	}
+}
+
+static int _send(cbr_t *c, int n)
+{
+	uint8_t *data = c->buffer[0];
+	int i, r, len;
+	
+	/* Send n packets from the buffer. Returns the number dropped */
+	if(c->fd < 0) return(n);
+	
+	if(c->udp)
+	{
+		for(i = r = 0; i < n; i += CBR_GROUP)
+		{
+			/* Errors such as nobody listening are not fatal */
+			if(send(c->fd, c->buffer[i], CBR_GROUP * TS_PACKET_SIZE, 0) < 0) r += CBR_GROUP;
+		}
+		
+		return(r);
+	}
+	
+	for(len = n * TS_PACKET_SIZE; len > 0; )
+	{
+		r = write(c->fd, data, len);
+		if(r < 0)
+		{
+			if(errno == EINTR) continue;
+			
+			/* Stop writing after an error, but keep the output clock */
+			perror(c->name);
+			if(c->fd != STDOUT_FILENO) close(c->fd);
+			c->fd = -1;
+			
+			return(n);
+		}
+		
+		data += r;
+		len -= r;
+	}
+	
+	return(0);
+}
+
+static void _tick(cbr_t *c)
+{
+	int64_t now, due, behind;
+	uint64_t packets = 0;
+	uint64_t nulls = 0;
+	uint64_t dropped = 0;
+	int i, n;
+	
+	/* Send the packets due by now, in whole groups */
+	
+	now = _clock_us();
+	
+	/* Keep the product below in range */
+	while(now - c->start >= _REBASE_US)
+	{
+		c->start += _REBASE_US;
+		c->base += c->bitrate;
+	}
+	
+	due = c->base + (now - c->start) * c->bitrate / _REBASE_US;
+	
+	/* Skip ahead if the sender fell too far behind */
+	behind = c->bitrate * _MAX_BEHIND_MS / (TS_PACKET_SIZE * 8 * 1000) + CBR_GROUP;
+	
+	if(due - (int64_t) c->slots > behind)
+	{
+		c->base -= due - (int64_t) c->slots;
+		due = c->slots;
+		__atomic_add_fetch(&c->stalls, 1, __ATOMIC_RELAXED);
+	}
+	
+	while(due - (int64_t) c->slots >= CBR_GROUP)
+	{
+		n = (due - c->slots) / CBR_GROUP;
+		if(n > CBR_BUFFER_GROUPS) n = CBR_BUFFER_GROUPS;
+		n *= CBR_GROUP;
+		
+		for(i = 0; i < n; i++)
+		{
+			if(_next(c, c->buffer[i])) packets++;
+			else
+			{
+				memcpy(c->buffer[i], c->null, TS_PACKET_SIZE);
+				nulls++;
+			}
+			
+			/* Advance the output clock by one slot */
+			c->slots++;
+			c->clock += c->clock_step;
+			c->clock_frac += c->clock_rem;
+			if(c->clock_frac >= c->bitrate)
+			{
+				c->clock_frac -= c->bitrate;
+				c->clock++;
+			}
+		}
+		
+		dropped += _send(c, n);
+	}
+	
+	__atomic_add_fetch(&c->packets, packets, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&c->nulls, nulls, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&c->dropped, dropped, __ATOMIC_RELAXED);
+}
+
+static void *_thread(void *arg)
+{
+	cbr_t *c = arg;
+	uint64_t expired;
+	
+	/* The merger never waits for the sender, and the
+	 * sender doesn't wait for the merger's output */
+	while(!__atomic_load_n(&c->quit, __ATOMIC_RELAXED))
+	{
+		if(read(c->timer, &expired, sizeof(expired)) < 0 && errno != EINTR)
+		{
+			perror("read");
+			break;
+		}
+		
+		_tick(c);
+	}
+	
+	return(NULL);
+}
+
+int cbr_open(cbr_t *c, mx_t *s, int64_t bitrate, const char *output)
+{
+	struct itimerspec its;
+	sigset_t set, old;
+	int64_t interval;
+	int e;
+	
+	memset(c, 0, sizeof(cbr_t));
+	c->s = s;
+	c->bitrate = bitrate;
+	c->fd = -1;
+	c->seq = mx_seq(s);
+	
+	c->clock_step = _SLOT_TICKS / bitrate;
+	c->clock_rem = _SLOT_TICKS % bitrate;
+	
+	/* Null packets carry no payload, their continuity counter is ignored */
+	memset(c->null, 0xFF, TS_PACKET_SIZE);
+	c->null[0] = 0x47;
+	c->null[1] = TS_NULL_PID >> 8;
+	c->null[2] = TS_NULL_PID & 0xFF;
+	c->null[3] = 0x10;
+	
+	if(strlen(output) >= CBR_PATH_LEN)
+	{
+		fprintf(stderr, "CBR output name is too long\n");
+		return(-1);
+	}
+	
+	strcpy(c->name, output);
+	
+	if(strcmp(output, "-") == 0)
+	{
+		/* Sending to stdout. Messages are moved to stderr */
+		fflush(stdout);
+		c->fd = dup(STDOUT_FILENO);
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+		strcpy(c->name, "stdout");
+	}
+	else if(strchr(output, ':') != NULL && strchr(output, '/') == NULL)
+	{
+		if(_open_udp(c, output) != 0) return(-1);
+	}
+	else
+	{
+		c->fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(c->fd < 0)
+		{
+			perror(output);
+			return(-1);
+		}
+	}
+	
+	/* Wake for each group of packets, or every _MIN_INTERVAL_US */
+	interval = (int64_t) CBR_GROUP * _REBASE_US / bitrate;
+	if(interval < _MIN_INTERVAL_US) interval = _MIN_INTERVAL_US;
+	
+	c->timer = timerfd_create(CLOCK_MONOTONIC, 0);
+	if(c->timer < 0)
+	{
+		perror("timerfd_create");
+		close(c->fd);
+		return(-1);
+	}
+	
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = its.it_interval.tv_sec = interval / 1000000;
+	its.it_value.tv_nsec = its.it_interval.tv_nsec = (interval % 1000000) * 1000;
+	
+	if(timerfd_settime(c->timer, 0, &its, NULL) != 0)
+	{
+		perror("timerfd_settime");
+		close(c->timer);
+		close(c->fd);
+		return(-1);
+	}
+	
+	_start(c);
+	c->start = _clock_us();
+	
+	printf("Sending the output to %s at %lld bits/s\n", c->name, (long long) bitrate);
+	
+	/* SIGINT and SIGTERM are left to the main thread */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	
+	e = pthread_create(&c->thread, NULL, _thread, c);
+	
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	
+	if(e != 0)
+	{
+		fprintf(stderr, "Error starting the CBR thread\n");
+		close(c->timer);
+		close(c->fd);
+		return(-1);
+	}
+	
+	return(0);
+}
+
+void cbr_close(cbr_t *c)
+{
+	/* Stop the thread, at its next timer wakeup */
+	__atomic_store_n(&c->quit, 1, __ATOMIC_RELAXED);
+	pthread_join(c->thread, NULL);
+	
+	close(c->timer);
+	if(c->fd >= 0 && c->fd != STDOUT_FILENO) close(c->fd);
+}
+
+void cbr_print_stats(cbr_t *c)
+{
+	printf("CBR output: %llu packets, %llu null packets, %llu packets dropped, %llu resyncs, %llu stalls\n",
+		(unsigned long long) __atomic_load_n(&c->packets, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&c->nulls, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&c->dropped, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&c->resyncs, __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&c->stalls, __ATOMIC_RELAXED)
+	);
+}
+
@@ -0,0 +1,104 @@
+/* cbr.c/h - Constant bitrate output with null packet stuffing           */
+/*=======================================================================*/
+/* Copyright (C)2026 The tsmerge contributors                            */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+
+#ifndef _CBR_H
+#define _CBR_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "ts.h"
+#include "merger.h"
+
+/* Packets sent in each UDP datagram, or file write */
+#define CBR_GROUP 7
+
+/* Size of the send buffer, in groups */
+#define CBR_BUFFER_GROUPS 32
+
+/* Maximum length of an output name */
+#define CBR_PATH_LEN 1024
+
+typedef struct {
+	
+	/* The merger whose output is sent */
+	mx_t *s;
+	
+	/* The output bitrate (bits/s), and where the output goes */
+	int64_t bitrate;
+	char name[CBR_PATH_LEN];
+	int fd;
+	int udp;
+	
+	/* Timer that paces the sender */
+	int timer;
+	
+	/* The output clock. Packet slots are due at bitrate from start
+	 * (us), less any time skipped after the sender fell behind.
+	 * clock is the time of the next slot (27MHz) */
+	int64_t start;
+	int64_t base;
+	uint64_t slots;
+	uint64_t clock;
+	uint64_t clock_step;
+	uint64_t clock_rem;
+	uint64_t clock_frac;
+	
+	/* The next output packet to send, and the PSI to send before it */
+	uint64_t seq;
+	uint8_t psi[MX_JOIN_PSI_LEN];
+	int psi_len;
+	int psi_sent;
+	
+	/* Set once the stream PCR is tied to the output clock. Packets are
+	 * due between the PCRs at a and b, at times interpolated between
+	 * pcr_a and pcr_b (27MHz, unwrapped) plus offset. b is the same as
+	 * a until the next PCR is found, scan is where the search for it
+	 * continues, and wait is the clock when the search started (-1 if
+	 * not searching). Without a usable PCR packets are sent as soon as
+	 * they are output */
+	int sync;
+	int64_t offset;
+	uint64_t a;
+	uint64_t b;
+	uint64_t scan;
+	int64_t pcr_a;
+	int64_t pcr_b;
+	int64_t wait;
+	
+	/* Set once the PCR has been tied to the output clock, and
+	 * when the next PCR sent needs the discontinuity indicator */
+	int anchored;
+	int discontinuity;
+	
+	/* The send buffer, and a null packet */
+	uint8_t buffer[CBR_BUFFER_GROUPS * CBR_GROUP][TS_PACKET_SIZE];
+	uint8_t null[TS_PACKET_SIZE];
+	
+	/* Stream and null packets sent, packets dropped because they fell
+	 * too far behind or failed to send, the times the stream PCR was
+	 * tied to the output clock again, and the times the sender fell
+	 * behind the output clock and skipped ahead */
+	uint64_t packets;
+	uint64_t nulls;
+	uint64_t dropped;
+	uint64_t resyncs;
+	uint64_t stalls;
+	
+	/* The sender thread */
+	pthread_t thread;
+	int quit;
+	
+} cbr_t;
+
+extern int cbr_open(cbr_t *c, mx_t *s, int64_t bitrate, const char *output);
+extern void cbr_close(cbr_t *c);
+extern void cbr_print_stats(cbr_t *c);
+
+#endif
+
@@ -0,0 +1,185 @@
+/* filter.c/h - Per-viewer PID filtering of the merged output            */
+/*=======================================================================*/
+/* Copyright (C)2026 The tsmerge contributors                            */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ts.h"
+#include "psi.h"
+#include "filter.h"
+
+static int _parse_pids(filter_t *f, const char *s)
+{
+	char *e;
+	long pid;
+	
+	/* A comma separated list of PIDs, in decimal or 0x hex */
+	while(1)
+	{
+		pid = strtol(s, &e, 0);
+		if(e == s || pid < 0 || pid >= TS_NULL_PID) return(-1);
+		
+		TS_PIDS_SET(f->want, pid);
+		TS_PIDS_SET(f->pass, pid);
+		
+		if(*e != ',') break;
+		s = e + 1;
+	}
+	
+	return(*e == '\0' || *e == '&' ? 0 : -1);
+}
+
+int filter_init(filter_t *f, const char *query)
+{
+	const char *s;
+	char *e;
+	long program;
+	int r = 0;
+	
+	/* Set up a filter from an HTTP query string, either pids=<list>
+	 * or program=<number>. Returns 1 if the query asked for one,
+	 * 0 if it didn't, or -1 if it is invalid */
+	
+	memset(f, 0, sizeof(filter_t));
+	
+	/* The PAT is always sent */
+	TS_PIDS_SET(f->pass, PSI_PAT_PID);
+	
+	for(s = query; s != NULL && *s != '\0'; s = strchr(s, '&'))
+	{
+		if(*s == '&') s++;
+		
+		if(strncmp(s, "pids=", 5) == 0)
+		{
+			if(r != 0 || _parse_pids(f, s + 5) != 0) return(-1);
+			r = 1;
+		}
+		else if(strncmp(s, "program=", 8) == 0)
+		{
+			program = strtol(s + 8, &e, 0);
+			if(r != 0 || e == s + 8 || (*e != '\0' && *e != '&')) return(-1);
+			if(program < 1 || program > 0xFFFF) return(-1);
+			
+			f->program = program;
+			r = 1;
+		}
+	}
+	
+	return(r);
+}
+
+static int _pat(filter_t *f, ts_header_t *ts, uint8_t *data, uint8_t *out)
+{
+	psi_pat_t pat;
+	int i;
+	
+	/* PATs that can't be parsed are sent unchanged */
+	if(psi_parse_pat(&pat, ts, data) != TS_OK) return(FILTER_PASS);
+	
+	memset(f->pmt, 0, TS_PIDS_LEN);
+	
+	for(i = 0; i < pat.programs; i++)
+	{
+		TS_PIDS_SET(f->pmt, pat.program[i].pid);
+		
+		if(f->program != 0)
+		{
+			/* Only the requested program */
+			if(pat.program[i].program_number == f->program)
+			{
+				TS_PIDS_SET(f->pass, pat.program[i].pid);
+			}
+		}
+		else if(TS_PIDS_TEST(f->empty, pat.program[i].pid))
+		{
+			TS_PIDS_CLEAR(f->pass, pat.program[i].pid);
+		}
+		else
+		{
+			/* Programs are listed until their PMT shows
+			 * none of the requested PIDs */
+			TS_PIDS_SET(f->pass, pat.program[i].pid);
+		}
+	}
+	
+	if(psi_filter_pat(out, ts, data, f->pass) < 0) return(FILTER_PASS);
+	
+	return(FILTER_REWRITE);
+}
+
+static int _pmt(filter_t *f, ts_header_t *ts, uint8_t *data, uint8_t *out, uint16_t pid)
+{
+	psi_pmt_t pmt;
+	int i;
+	
+	if(psi_parse_pmt(&pmt, ts, data) != TS_OK)
+	{
+		return(TS_PIDS_TEST(f->pass, pid) ? FILTER_PASS : FILTER_DROP);
+	}
+	
+	if(f->program != 0)
+	{
+		if(pmt.program_number != f->program) return(FILTER_DROP);
+		
+		/* The whole program is sent, the PMT is unchanged */
+		TS_PIDS_SET(f->pass, pid);
+		TS_PIDS_SET(f->pass, pmt.pcr_pid);
+		
+		for(i = 0; i < pmt.streams; i++)
+		{
+			TS_PIDS_SET(f->pass, pmt.stream[i].pid);
+		}
+		
+		return(FILTER_PASS);
+	}
+	
+	/* List only the requested streams. The PCR PID is only sent if it
+	 * was requested. Programs with none are dropped, from the next PAT */
+	if(psi_filter_pmt(out, ts, data, f->want) <= 0)
+	{
+		TS_PIDS_SET(f->empty, pid);
+		TS_PIDS_CLEAR(f->pass, pid);
+		return(FILTER_DROP);
+	}
+	
+	TS_PIDS_CLEAR(f->empty, pid);
+	TS_PIDS_SET(f->pass, pid);
+	
+	return(FILTER_REWRITE);
+}
+
+int filter_psi(filter_t *f, uint16_t pid)
+{
+	/* Test if a packet on pid is a PAT or PMT, which
+	 * filter_packet() uses to update the filter */
+	return(pid == PSI_PAT_PID || TS_PIDS_TEST(f->pmt, pid));
+}
+
+int filter_packet(filter_t *f, uint16_t pid, uint8_t *data, uint8_t *out)
+{
+	ts_header_t ts;
+	
+	/* Decide what to send for a packet on pid. The PAT and PMTs
+	 * are rewritten into out to match the PIDs that are sent */
+	
+	if(filter_psi(f, pid))
+	{
+		if(ts_parse_header(&ts, data) != TS_OK)
+		{
+			return(TS_PIDS_TEST(f->pass, pid) ? FILTER_PASS : FILTER_DROP);
+		}
+		
+		if(pid == PSI_PAT_PID) return(_pat(f, &ts, data, out));
+		
+		return(_pmt(f, &ts, data, out, pid));
+	}
+	
+	return(TS_PIDS_TEST(f->pass, pid) ? FILTER_PASS : FILTER_DROP);
+}
+
@@ -0,0 +1,43 @@
+/* filter.c/h - Per-viewer PID filtering of the merged output            */
+/*=======================================================================*/
+/* Copyright (C)2026 The tsmerge contributors                            */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+
+#ifndef _FILTER_H
+#define _FILTER_H
+
+#include <stdint.h>
+#include "ts.h"
+
+/* Results of filter_packet() */
+#define FILTER_DROP    0 /* Don't send the packet */
+#define FILTER_PASS    1 /* Send the packet unchanged */
+#define FILTER_REWRITE 2 /* Send the rewritten copy instead */
+
+typedef struct {
+	
+	/* The program requested, or 0 if a set of PIDs was requested */
+	int program;
+	
+	/* The PIDs requested, and the PIDs that are sent. The PMT PIDs,
+	 * and for a program its streams, are added to pass from the PSI */
+	uint8_t want[TS_PIDS_LEN];
+	uint8_t pass[TS_PIDS_LEN];
+	
+	/* PMT PIDs listed in the last PAT, and those with a PMT
+	 * that lists none of the requested PIDs */
+	uint8_t pmt[TS_PIDS_LEN];
+	uint8_t empty[TS_PIDS_LEN];
+	
+} filter_t;
+
+extern int filter_init(filter_t *f, const char *query);
+extern int filter_psi(filter_t *f, uint16_t pid);
+extern int filter_packet(filter_t *f, uint16_t pid, uint8_t *data, uint8_t *out);
+
+#endif
+
@@ -0,0 +1,94 @@
+/* hist.c/h - Log-linear latency histograms                              */
+/*=======================================================================*/
+/* Copyright (C)2026 The tsmerge contributors                            */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "hist.h"
+
+static int _index(int64_t value)
+{
+	int shift;
+	
+	/* Small values have a bucket each */
+	if(value < (1 << HIST_SUB_BITS)) return(value);
+	
+	/* Larger values are shifted down to keep HIST_SUB_BITS bits. The
+	 * top bit is always set, leaving HIST_SUB_COUNT buckets per power */
+	shift = 63 - __builtin_clzll(value) - (HIST_SUB_BITS - 1);
+	
+	return(shift * HIST_SUB_COUNT + (value >> shift));
+}
+
+static int64_t _value(int i)
+{
+	int shift;
+	
+	/* The highest value counted in bucket i */
+	if(i < (1 << HIST_SUB_BITS)) return(i);
+	
+	shift = i / HIST_SUB_COUNT - 1;
+	
+	return((((int64_t) (i % HIST_SUB_COUNT + HIST_SUB_COUNT) + 1) << shift) - 1);
+}
+
+void hist_reset(hist_t *h)
+{
+	memset(h, 0, sizeof(hist_t));
+}
+
+void hist_add(hist_t *h, int64_t value)
+{
+	/* Negative values (a clock step) are counted as 0 */
+	if(value < 0) value = 0;
+	
+	h->bucket[_index(value)]++;
+	h->count++;
+	
+	if(value > h->max) h->max = value;
+}
+
+int64_t hist_percentile(hist_t *h, double percentile)
+{
+	uint64_t target, n;
+	int i;
+	
+	/* Returns the value that percentile % of the recorded values are
+	 * at or below, rounded up to the end of its bucket */
+	
+	if(h->count == 0) return(0);
+	
+	target = (uint64_t) (h->count * percentile / 100.0);
+	if(target < 1) target = 1;
+	if(target > h->count) target = h->count;
+	
+	for(i = 0, n = 0; i < HIST_BUCKETS; i++)
+	{
+		n += h->bucket[i];
+		if(n >= target) break;
+	}
+	
+	/* The bucket end can be past the largest value seen */
+	return(_value(i) < h->max ? _value(i) : h->max);
+}
+
+void hist_print(hist_t *h, const char *name)
+{
+	/* Values are recorded in us, and printed in ms */
+	printf("%s: %llu packets, p50 %.3f, p90 %.3f, p99 %.3f, p99.9 %.3f, max %.3f ms\n",
+		name,
+		(unsigned long long) h->count,
+		hist_percentile(h, 50.0) / 1000.0,
+		hist_percentile(h, 90.0) / 1000.0,
+		hist_percentile(h, 99.0) / 1000.0,
+		hist_percentile(h, 99.9) / 1000.0,
+		h->max / 1000.0
+	);
+}
+
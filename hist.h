@@ -0,0 +1,40 @@
+/* hist.c/h - Log-linear latency histograms                              */
+/*=======================================================================*/
+/* Copyright (C)2026 The tsmerge contributors                            */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+
+#ifndef _HIST_H
+#define _HIST_H
+
+#include <stdint.h>
+
+/* Values below 2^HIST_SUB_BITS are counted exactly. Above that each
+ * power of 2 is split into 2^(HIST_SUB_BITS - 1) equal buckets, so a
+ * value is known to within about 1.6% */
+#define HIST_SUB_BITS 7
+#define HIST_SUB_COUNT (1 << (HIST_SUB_BITS - 1))
+
+/* Enough buckets for any positive int64_t */
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT + HIST_SUB_COUNT)
+
+typedef struct {
+	
+	/* Number of values recorded, and the largest */
+	uint64_t count;
+	int64_t max;
+	
+	uint64_t bucket[HIST_BUCKETS];
+	
+} hist_t;
+
+extern void hist_reset(hist_t *h);
+extern void hist_add(hist_t *h, int64_t value);
+extern int64_t hist_percentile(hist_t *h, double percentile);
+extern void hist_print(hist_t *h, const char *name);
+
+#endif
+
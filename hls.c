@@ -0,0 +1,286 @@
+/* hls.c/h - In-memory HLS segmenter for the merged output               */
+/*=======================================================================*/
+/* Copyright (C)2026 The tsmerge contributors                            */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ts.h"
+#include "psi.h"
+#include "merger.h"
+#include "hls.h"
+
+/* The PCR is a 33-bit counter */
+#define _PCR_MASK ((UINT64_C(1) << 33) - 1)
+
+static int _listed(hls_t *h, hls_segment_t *seg)
+{
+	/* Segments are only listed while the store can hold them and
+	 * the segments after them, so they are not overwritten while
+	 * a client is still downloading them */
+	return(h->head - seg->start <= h->packets / 2);
+}
+
+static void _update_playlist(hls_t *h)
+{
+	hls_segment_t *seg;
+	uint64_t first, i, target;
+	int l;
+	
+	first = (h->segments > HLS_PLAYLIST_SEGMENTS ? h->segments - HLS_PLAYLIST_SEGMENTS : 0);
+	
+	/* Drop segments that may be overwritten soon */
+	while(first < h->segments && !_listed(h, &h->segment[first % HLS_SEGMENTS]))
+	{
+		first++;
+	}
+	
+	/* The target duration must be at least the longest segment */
+	target = (h->target + 89999) / 90000;
+	
+	for(i = first; i < h->segments; i++)
+	{
+		seg = &h->segment[i % HLS_SEGMENTS];
+		
+		if((seg->duration + 89999) / 90000 > target)
+		{
+			target = (seg->duration + 89999) / 90000;
+		}
+	}
+	
+	l = snprintf(h->playlist, HLS_PLAYLIST_LEN,
+		"#EXTM3U\n"
+		"#EXT-X-VERSION:3\n"
+		"#EXT-X-TARGETDURATION:%llu\n"
+		"#EXT-X-MEDIA-SEQUENCE:%llu\n",
+		(unsigned long long) target,
+		(unsigned long long) first
+	);
+	
+	for(i = first; i < h->segments && l < HLS_PLAYLIST_LEN; i++)
+	{
+		seg = &h->segment[i % HLS_SEGMENTS];
+		
+		l += snprintf(h->playlist + l, HLS_PLAYLIST_LEN - l,
+			"%s"
+			"#EXTINF:%.3f,\n"
+			"stream%llu.ts\n",
+			(seg->discontinuity ? "#EXT-X-DISCONTINUITY\n" : ""),
+			seg->duration / 90000.0,
+			(unsigned long long) seg->sequence
+		);
+	}
+	
+	h->playlist_len = (l < HLS_PLAYLIST_LEN ? l : HLS_PLAYLIST_LEN - 1);
+}
+
+static void _store(hls_t *h, uint8_t *data)
+{
+	memcpy(h->data[h->head % h->packets], data, TS_PACKET_SIZE);
+	h->head++;
+}
+
+static void _start_segment(hls_t *h)
+{
+	h->open = 1;
+	h->start = h->head;
+	h->start_pcr = h->pcr;
+	
+	/* Begin each segment with the PAT and PMT, so players can
+	 * start decoding from any segment */
+	if(h->have_pat && h->have_pmt)
+	{
+		_store(h, h->pat);
+		_store(h, h->pmt);
+	}
+}
+
+static void _end_segment(hls_t *h)
+{
+	hls_segment_t *seg;
+	
+	seg = &h->segment[h->segments % HLS_SEGMENTS];
+	
+	seg->sequence = h->segments;
+	seg->start = h->start;
+	seg->end = h->head;
+	seg->duration = (h->pcr - h->start_pcr) & _PCR_MASK;
+	seg->discontinuity = h->discontinuity;
+	
+	h->segments++;
+	h->open = 0;
+	h->discontinuity = 0;
+	
+	_update_playlist(h);
+}
+
+static void _process(hls_t *h, mx_output_t *o, uint8_t *data)
+{
+	ts_header_t ts;
+	psi_pat_t pat;
+	psi_pmt_t pmt;
+	int cut;
+	
+	/* Keep copies of the latest PAT and PMT for the first program */
+	if(o->pid == PSI_PAT_PID)
+	{
+		if(ts_parse_header(&ts, data) == TS_OK &&
+		   psi_parse_pat(&pat, &ts, data) == TS_OK &&
+		   pat.programs > 0)
+		{
+			if(pat.program[0].pid != h->pmt_pid) h->have_pmt = 0;
+			
+			h->pmt_pid = pat.program[0].pid;
+			memcpy(h->pat, data, TS_PACKET_SIZE);
+			h->have_pat = 1;
+		}
+	}
+	else if(o->pid == h->pmt_pid && h->have_pat)
+	{
+		if(ts_parse_header(&ts, data) == TS_OK &&
+		   psi_parse_pmt(&pmt, &ts, data) == TS_OK)
+		{
+			memcpy(h->pmt, data, TS_PACKET_SIZE);
+			h->have_pmt = 1;
+		}
+	}
+	
+	if(o->pid == h->pid)
+	{
+		if(o->flags & MX_OUTPUT_RAI) h->rai_seen = 1;
+		
+		if(o->flags & MX_OUTPUT_PCR)
+		{
+			if(h->have_pcr && ((o->pcr_base - h->pcr) & _PCR_MASK) > HLS_PCR_JUMP)
+			{
+				/* The clock has jumped. End the segment here and
+				 * wait for the next random access point */
+				if(h->open) _end_segment(h);
+				h->discontinuity = 1;
+			}
+			
+			h->pcr = o->pcr_base;
+			h->have_pcr = 1;
+		}
+		
+		/* Segments start on random access points */
+		cut = (h->rai_seen ? o->flags & MX_OUTPUT_RAI : o->flags & MX_OUTPUT_PUSI);
+		
+		if(cut && h->have_pcr)
+		{
+			if(h->open == 0)
+			{
+				_start_segment(h);
+			}
+			else if(((h->pcr - h->start_pcr) & _PCR_MASK) >= h->target)
+			{
+				_end_segment(h);
+				_start_segment(h);
+			}
+		}
+	}
+	
+	if(h->open == 0) return;
+	
+	/* Don't let a segment outgrow the store */
+	if(h->head - h->start >= h->packets / 2)
+	{
+		_end_segment(h);
+		_start_segment(h);
+	}
+	
+	_store(h, data);
+}
+
+int hls_init(hls_t *h, mx_t *s, int duration, int megabytes)
+{
+	memset(h, 0, sizeof(hls_t));
+	
+	h->target = (uint64_t) duration * 90000;
+	h->pid = s->pcr_pid;
+	h->pmt_pid = TS_NULL_PID;
+	h->seq = s->seq;
+	
+	/* The segment store is allocated once and reused */
+	h->packets = (uint64_t) megabytes * 1024 * 1024 / TS_PACKET_SIZE;
+	h->data = malloc(h->packets * TS_PACKET_SIZE);
+	if(h->data == NULL)
+	{
+		perror("malloc");
+		return(-1);
+	}
+	
+	_update_playlist(h);
+	
+	return(0);
+}
+
+void hls_update(hls_t *h, mx_t *s)
+{
+	uint8_t *data;
+	int i, n;
+	
+	/* Segment any new output */
+	
+	if(s->seq - h->seq > _OUTPUT_PACKETS)
+	{
+		/* Output was missed, start again at the next random access point */
+		h->seq = s->seq - _OUTPUT_PACKETS;
+		h->open = 0;
+		h->discontinuity = 1;
+	}
+	
+	while((n = mx_read(s, h->seq, &data)) > 0)
+	{
+		for(i = 0; i < n; i++, h->seq++, data += TS_PACKET_SIZE)
+		{
+			_process(h, mx_info(s, h->seq), data);
+		}
+	}
+}
+
+hls_segment_t *hls_segment(hls_t *h, uint64_t sequence)
+{
+	hls_segment_t *seg;
+	
+	/* Returns a completed segment, or NULL if it
+	 * doesn't exist or has been overwritten */
+	
+	if(sequence >= h->segments || h->segments - sequence > HLS_SEGMENTS) return(NULL);
+	
+	seg = &h->segment[sequence % HLS_SEGMENTS];
+	if(h->head - seg->start > h->packets) return(NULL);
+	
+	return(seg);
+}
+
+int hls_read(hls_t *h, uint64_t pos, uint64_t end, uint8_t **data)
+{
+	uint64_t n;
+	
+	/* Returns the number of stored packets available in one contiguous
+	 * block from pos, up to end, and a pointer to them. Returns -1 if
+	 * pos has already been overwritten */
+	
+	if(pos >= end) return(0);
+	if(h->head - pos > h->packets) return(-1);
+	
+	n = end - pos;
+	
+	/* Stop at the end of the store */
+	if(n > h->packets - pos % h->packets)
+	{
+		n = h->packets - pos % h->packets;
+	}
+	
+	*data = h->data[pos % h->packets];
+	
+	return(n);
+}
+
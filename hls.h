@@ -0,0 +1,96 @@
+/* hls.c/h - In-memory HLS segmenter for the merged output               */
+/*=======================================================================*/
+/* Copyright (C)2026 The tsmerge contributors                            */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+
+#ifndef _HLS_H
+#define _HLS_H
+
+#include <stdint.h>
+#include "merger.h"
+
+/* Number of segments remembered, and the number listed in the playlist */
+#define HLS_SEGMENTS 16
+#define HLS_PLAYLIST_SEGMENTS 5
+
+/* Maximum length of the playlist */
+#define HLS_PLAYLIST_LEN 2048
+
+/* PCR jumps larger than this start a new segment with a discontinuity */
+#define HLS_PCR_JUMP (10 * 90000)
+
+typedef struct {
+	
+	/* Media sequence number */
+	uint64_t sequence;
+	
+	/* Position of the first and one past the last packet in the store */
+	uint64_t start;
+	uint64_t end;
+	
+	/* Duration (90kHz clock) */
+	uint64_t duration;
+	
+	/* Set if the segment follows a break in the stream */
+	int discontinuity;
+	
+} hls_segment_t;
+
+typedef struct {
+	
+	/* Target segment duration (90kHz clock) */
+	uint64_t target;
+	
+	/* The PID segments are cut on, normally the video PID */
+	uint16_t pid;
+	
+	/* The next output packet to be processed */
+	uint64_t seq;
+	
+	/* The segment store. Packet n is stored at data[n % packets] */
+	uint8_t (*data)[TS_PACKET_SIZE];
+	uint64_t packets;
+	uint64_t head;
+	
+	/* State of the segment being built. Nothing is
+	 * stored until the first random access point */
+	int open;
+	uint64_t start;
+	uint64_t start_pcr;
+	int discontinuity;
+	
+	/* The last PCR seen */
+	int have_pcr;
+	uint64_t pcr;
+	
+	/* Cut at RAI packets, or PUSI packets if the stream has no RAI flags */
+	int rai_seen;
+	
+	/* Latest PAT and PMT packets, repeated at the start of each segment */
+	uint16_t pmt_pid;
+	int have_pat;
+	int have_pmt;
+	uint8_t pat[TS_PACKET_SIZE];
+	uint8_t pmt[TS_PACKET_SIZE];
+	
+	/* Completed segments */
+	hls_segment_t segment[HLS_SEGMENTS];
+	uint64_t segments;
+	
+	/* The current playlist */
+	char playlist[HLS_PLAYLIST_LEN];
+	int playlist_len;
+	
+} hls_t;
+
+extern int hls_init(hls_t *h, mx_t *s, int duration, int megabytes);
+extern void hls_update(hls_t *h, mx_t *s);
+extern hls_segment_t *hls_segment(hls_t *h, uint64_t sequence);
+extern int hls_read(hls_t *h, uint64_t pos, uint64_t end, uint8_t **data);
+
+#endif
+
@@ -1,69 +1,403 @@
 
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <getopt.h>
 #include <time.h>
 #include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/poll.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <linux/filter.h>
 #include "merger.h"
+#include "hls.h"
+#include "uring.h"
+#include "hist.h"
+#include "rec.h"
+#include "filter.h"
+#include "cbr.h"
 
-/* The maximum number of viewers */
-#define _VIEWERS 10
+/* The maximum number of viewers served by each thread */
+#define _VIEWERS 64
+
+/* The maximum number of viewer threads */
+#define _MAX_WORKERS 64
+
+/* How long a viewer thread waits for new output before
+ * checking its viewers for timeouts anyway (ms) */
+#define _WORKER_POLL_MS 100
 
 /* Timeout for clients (ms) */
 #define _VIEWER_TIMEOUT (60 * 1000)
 
-/* Number of sockets for poll() */
-#define _NFDS (_VIEWERS + 2)
+/* The maximum number of incoming UDP sockets */
+#define _MAX_INGEST 8
+
+/* Number of sockets for poll(). The first _FDS_VIEWERS entries are the
+ * incoming UDP sockets, the TCP and HTTP listeners and the merger timer */
+#define _FDS_TCP (_MAX_INGEST)
+#define _FDS_HTTP (_MAX_INGEST + 1)
+#define _FDS_TIMER (_MAX_INGEST + 2)
+#define _FDS_VIEWERS (_MAX_INGEST + 3)
+#define _NFDS (_VIEWERS + _FDS_VIEWERS)
+
+/* Default TCP ports for raw TS and HTTP viewers */
+#define _VIEWER_PORT 5679
+#define _HTTP_PORT 5680
+
+/* Maximum length of an HTTP request header, and the time allowed to receive it (ms) */
+#define _HTTP_REQUEST_LEN 2048
+#define _HTTP_REQUEST_TIMEOUT (10 * 1000)
+
+/* Maximum length of an HTTP response header and any body sent with it */
+#define _HTTP_RESPONSE_LEN (512 + HLS_PLAYLIST_LEN)
+
+/* Default size of the HLS segment store (MB) */
+#define _HLS_MEMORY 64
 
 /* The size of the incoming UDP buffer */
 #define _BUFFER 65536
 
+/* Largest UDP datagram accepted from a station, enough for any UDP
+ * datagram, and the number of datagrams read by each call to recvmmsg().
+ * Only the part of each buffer that is received into is touched */
+#define _DATAGRAM_LEN 65536
+#define _DATAGRAMS 64
+
+/* Space for the control messages received with each datagram,
+ * the drop counter and the receive time */
+#define _CONTROL_LEN (CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(struct timespec)))
+
+/* Kernel receive times older than this are not used. The
+ * realtime clock has probably been stepped (ms) */
+#define _MAX_RX_AGE 1000
+
+/* Interval between printing station statistics (ms) */
+#define _STATS_INTERVAL (10 * 1000)
+
+/* The longest the main loop waits with nothing to do. Viewer
+ * timeouts are only checked when it wakes (ms) */
+#define _IDLE_MS 1000
+
+/* io_uring queue size, and the number and size of the buffers
+ * used to receive UDP packets (the buffer count must be a power of 2).
+ * Each buffer holds a header, the source address and the control
+ * messages ahead of the datagram */
+#define _URING_ENTRIES 256
+#define _URING_BUFFERS 256
+#define _URING_BUFFER_LEN (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) + _CONTROL_LEN + _DATAGRAM_LEN)
+
+/* The most packets sent to a viewer in one batch of io_uring sends.
+ * A quarter of the output ring, so the output the kernel is still
+ * reading is well clear of the packets being overwritten */
+#define _URING_SEND_PACKETS (_OUTPUT_PACKETS / 4)
+
+/* io_uring request types, stored in the low byte of user_data */
+#define _URING_RECV   1
+#define _URING_POLL   2
+#define _URING_SEND   3
+#define _URING_CANCEL 4
+
+/* Most iovecs in each writev() to a filtered viewer */
+#define _FILTER_IOV 64
+
+/* Default limits on how far a viewer can fall behind the output. The
+ * packet limit is kept well inside the output ring, so a viewer's
+ * position is not overwritten before the limit is reached */
+#define _MAX_LAG_MS (5 * 1000)
+#define _MAX_LAG_PACKETS (_OUTPUT_PACKETS / 2)
+
+typedef enum {
+	LAG_SKIP,
+	LAG_DISCONNECT,
+} _lag_policy_t;
+
+typedef enum {
+	IO_POLL,
+	IO_URING,
+} _io_backend_t;
+
+typedef enum {
+	INGEST_HASH_ADDRESS, /* Pick the socket by the source address */
+	INGEST_HASH_KERNEL,  /* Leave it to the kernel's hash of the 4-tuple */
+} _ingest_hash_t;
+
+typedef enum {
+	VIEWER_REQUEST,  /* Waiting for an HTTP request */
+	VIEWER_RESPONSE, /* Sending the HTTP response header */
+	VIEWER_CLOSE,    /* Nothing follows the response, close the connection */
+	VIEWER_STREAM,   /* Sending the TS */
+	VIEWER_SEGMENT,  /* Sending an HLS segment, then closing */
+} _viewer_state_t;
+
 typedef struct {
 	
 	/* Socket for this viewer */
 	int sock;
 	
-	/* The last packet sent to viewer */
-	int last_station;
-	uint32_t last_counter;
+	/* HTTP viewer flag and connection state. Raw TS viewers skip VIEWER_REQUEST */
+	int http;
+	_viewer_state_t state;
+	
+	/* The HTTP request received so far */
+	char request[_HTTP_REQUEST_LEN];
+	int request_len;
+	
+	/* The HTTP response, the number of bytes already sent,
+	 * and the state to move to once it has been sent */
+	char response[_HTTP_RESPONSE_LEN];
+	int response_len;
+	int response_offset;
+	_viewer_state_t next;
+	
+	/* The next output packet to send to the viewer, and the
+	 * number of bytes of it already sent. HLS segments are
+	 * sent from the segment store up to end */
+	uint64_t seq;
+	int offset;
+	uint64_t end;
 	
 	/* Timestamp of when the last packet was sent */
 	int64_t timestamp;
 	
+	/* How far the viewer is behind the output, in packets and ms */
+	int64_t lag_packets;
+	int64_t lag_ms;
+	
+	/* Set when the viewer should skip ahead to the latest random access point */
+	int resync;
+	
+	/* Number of times the viewer has skipped ahead */
+	int skips;
+	
+	/* Time from packet arrival to being sent to this viewer */
+	hist_t latency;
+	
+	/* The PIDs the viewer asked for, or NULL for the whole stream */
+	filter_t *filter;
+	
+	/* A PAT or PMT that was partly sent to a filtered viewer, as sent.
+	 * The rest of it is sent from here rather than filtering it again */
+	uint8_t partial[TS_PACKET_SIZE];
+	int partial_psi;
+	
+	/* Set if sends are queued on the io_uring. Only viewers served by
+	 * the main thread use it. Sends in flight, zero-copy notifications
+	 * still to come, the first packet of the output they hold, and a
+	 * counter used to ignore completions for an earlier viewer in the
+	 * same slot */
+	int uring;
+	int pending;
+	int notifs;
+	uint64_t held;
+	uint32_t gen;
+	int error;
+	
 } viewer_t;
 
+typedef struct {
+	
+	/* The poll request armed for an fds entry */
+	int armed;
+	int fd;
+	short events;
+	uint32_t gen;
+	
+} _uring_poll_t;
+
+typedef struct {
+	
+	/* Datagrams received on the socket, and the kernel's count of
+	 * those dropped because its receive buffer was full */
+	uint64_t received;
+	uint32_t dropped;
+	
+} _ingest_t;
+
+typedef struct {
+	
+	pthread_t thread;
+	int index;
+	
+	/* The main thread writes accepted sockets (sock << 1 | http) to the
+	 * pipe, and -1 to wake the thread when there is new output */
+	int pipe[2];
+	
+	/* Set while the thread may be about to sleep in poll() */
+	int waiting;
+	
+	/* Number of viewers handed to the thread and not yet closed */
+	int viewers_count;
+	
+	/* The thread's viewers. The first fds entry is the pipe */
+	viewer_t viewers[_VIEWERS];
+	struct pollfd fds[1 + _VIEWERS];
+	
+} _worker_t;
+
+/* What to do with viewers that fall too far behind */
+static _lag_policy_t _lag_policy = LAG_SKIP;
+static int64_t _max_lag_ms = _MAX_LAG_MS;
+static int64_t _max_lag_packets = _MAX_LAG_PACKETS;
+
 /* the TS merger state */
-static mx_t _merger;
+static mx_t *_merger;
 
-/* state for each client / viewer */
+/* Latency tracing. Times from packet arrival to being added to the
+ * output, and from being added to the output to the first send to
+ * any viewer. _traced_seq and _first_sent_seq are the next output
+ * packets to be counted in each */
+static int _latency = 0;
+static hist_t _output_latency;
+static __thread hist_t _first_send_latency;
+static uint64_t _traced_seq;
+static uint64_t _first_sent_seq;
+
+/* Offset from CLOCK_MONOTONIC to the timebase. The kernel gives datagram
+ * receive times on CLOCK_REALTIME, the time the last datagrams were read
+ * and the offset from CLOCK_REALTIME then are used to convert them */
+static int64_t _clock_offset;
+static int64_t _rx_timestamp;
+static int64_t _rx_offset;
+
+/* Set by SIGINT / SIGTERM to shut down cleanly */
+static volatile sig_atomic_t _quit = 0;
+
+/* HLS segmenter state */
+static int _hls_enabled = 0;
+static hls_t _hls;
+
+/* state for each client / viewer served by the main thread */
 static viewer_t _viewers[_VIEWERS];
 
-/* pollfd array for each client + 2 for incoming sockets */
-static struct pollfd _fds[2 + _VIEWERS];
+/* Viewer threads. When there are any, every viewer is handed to the
+ * least loaded of them and the main thread only ingests and merges */
+static int _workers = 0;
+static _worker_t *_worker;
+
+/* Recording of the output to disk, written by its own thread */
+static int _recording = 0;
+static rec_t _rec;
+
+/* Constant bitrate output */
+static int _cbr_enabled = 0;
+static cbr_t _cbr;
+
+/* Held while the HLS segment store or playlist is used */
+static pthread_mutex_t _hls_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Incoming UDP sockets. All are bound to the same port, a station's
+ * packets always arrive on the same socket so their order is kept */
+static int _ingest_count = 1;
+static _ingest_hash_t _ingest_hash = INGEST_HASH_ADDRESS;
+static _ingest_t _ingest[_MAX_INGEST];
+
+/* The last source address of each station, for NACKs */
+static struct sockaddr_in _station_addr[_STATIONS];
+
+/* Received MX packets waiting to be fed to the merger together, and
+ * the receive time and source address of each. With io_uring the receive buffers
+ * holding them are recycled once the batch has been fed */
+static uint8_t *_batch_data[MX_BATCH];
+static int64_t _batch_arrival[MX_BATCH];
+static struct sockaddr_in _batch_addr[MX_BATCH];
+static int _batch_count = 0;
+static int _batch_bid[MX_BATCH];
+static int _batch_bids = 0;
+
+/* pollfd array for each client + the incoming sockets */
+static struct pollfd _fds[_NFDS];
+
+/* io_uring backend state. The UDP socket has a multishot receive
+ * armed, the other fds entries are polled with one-shot requests */
+static _io_backend_t _io = IO_POLL;
+static uring_t _uring;
+static uring_bufs_t _uring_bufs;
+static struct msghdr _uring_msg;
+static _uring_poll_t _uring_poll[_NFDS];
+static int _uring_fixed = 0;
+
+/* HTTP responses */
+static const char _http_ok[] =
+	"HTTP/1.1 200 OK\r\n"
+	"Content-Type: video/mp2t\r\n"
+	"Cache-Control: no-cache\r\n"
+	"Connection: close\r\n"
+	"\r\n";
+
+static const char _http_playlist[] =
+	"HTTP/1.1 200 OK\r\n"
+	"Content-Type: application/vnd.apple.mpegurl\r\n"
+	"Content-Length: %d\r\n"
+	"Cache-Control: max-age=1\r\n"
+	"Connection: close\r\n"
+	"\r\n";
+
+static const char _http_segment[] =
+	"HTTP/1.1 200 OK\r\n"
+	"Content-Type: video/mp2t\r\n"
+	"Content-Length: %llu\r\n"
+	"Cache-Control: max-age=3600\r\n"
+	"Connection: close\r\n"
+	"\r\n";
+
+static const char _http_bad_request[] =
+	"HTTP/1.1 400 Bad Request\r\n"
+	"Content-Length: 0\r\n"
+	"Connection: close\r\n"
+	"\r\n";
 
-/* Returns the current unix timestamp in ms, or 0 if error */
-static int64_t _timestamp_ms(void)
+static const char _http_not_found[] =
+	"HTTP/1.1 404 Not Found\r\n"
+	"Content-Length: 0\r\n"
+	"Connection: close\r\n"
+	"\r\n";
+
+static const char _http_not_allowed[] =
+	"HTTP/1.1 405 Method Not Allowed\r\n"
+	"Allow: GET, HEAD\r\n"
+	"Content-Length: 0\r\n"
+	"Connection: close\r\n"
+	"\r\n";
+
+static void _signal_quit(int sig)
+{
+	_quit = 1;
+}
+
+/* Returns the time on the given clock in us, or 0 if error */
+static int64_t _clock_us(clockid_t clock)
 {
 	struct timespec tp;
 	
-	if(clock_gettime(CLOCK_REALTIME, &tp) != 0)
+	if(clock_gettime(clock, &tp) != 0)
 	{
 		return(0);
 	}
 	
-	return((int64_t) tp.tv_sec * 1000 + tp.tv_nsec / 1000000);
+	return((int64_t) tp.tv_sec * 1000000 + tp.tv_nsec / 1000);
+}
+
+/* Returns the current timestamp in us. This is the monotonic clock,
+ * offset to match the unix time when tsmerge started. It doesn't step
+ * with NTP, and stays close to the times in a resumed state file */
+static int64_t _timestamp_us(void)
+{
+	return(_clock_us(CLOCK_MONOTONIC) + _clock_offset);
 }
 
-static int _open_viewer_socket(void)
+static int _open_viewer_socket(int port)
 {
 	int sock;
 	int sarg;
@@ -89,11 +423,11 @@ static int _open_viewer_socket(void)
 		return(-1);
 	}
 	
-	/* Bind to TCP port 5679 */
+	/* Bind to the TCP port */
 	memset(&addr, 0, sizeof(addr));
 	addr.sin_family = AF_INET;
 	addr.sin_addr.s_addr = INADDR_ANY;
-	addr.sin_port = htons(5679);
+	addr.sin_port = htons(port);
 	
 	r = bind(sock, (struct sockaddr *) &addr, sizeof(addr));
 	if(r < 0)
@@ -114,7 +448,7 @@ static int _open_viewer_socket(void)
 	return(sock);
 }
 
-static int _open_incoming_socket(void)
+static int _open_incoming_socket(int reuseport)
 {
 	int sock;
 	struct sockaddr_in addr;
@@ -143,6 +477,38 @@ static int _open_incoming_socket(void)
 		return(-1);
 	}
 	
+	/* Receive the socket's drop counter and the
+	 * kernel's receive time with each datagram */
+	optarg = 1;
+	
+	r = setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &optarg, sizeof(optarg));
+	if(r < 0)
+	{
+		perror("setsockopt");
+		/* This is not a fatal error */
+	}
+	
+	r = setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &optarg, sizeof(optarg));
+	if(r < 0)
+	{
+		perror("setsockopt");
+		/* This is not a fatal error, the time of reading is used */
+	}
+	
+	/* Several sockets share the port when there is more than one */
+	if(reuseport)
+	{
+		optarg = 1;
+		
+		r = setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &optarg, sizeof(optarg));
+		if(r < 0)
+		{
+			perror("setsockopt");
+			close(sock);
+			return(-1);
+		}
+	}
+	
 	/* Bind to UDP port 5678 */
 	memset(&addr, 0, sizeof(addr));
 	addr.sin_family = AF_INET;
@@ -160,244 +526,2336 @@ static int _open_incoming_socket(void)
 	return(sock);
 }
 
-static int _incoming_packet(struct pollfd *fds, int64_t timestamp, mx_t *merger)
+static int _attach_ingest_hash(int sock, int count)
 {
-	int i, r;
-	static uint8_t data[_BUFFER];
+	struct sock_fprog prog;
+	int r;
 	
-	if(fds->revents != POLLIN)
+	/* Pick the socket for each datagram by its IPv4 source address,
+	 * folded down and taken modulo the number of sockets. The kernel
+	 * numbers the sockets in the order they were bound */
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS, SKF_NET_OFF + 12),
+		BPF_STMT(BPF_MISC | BPF_TAX, 0),
+		BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+		BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+		BPF_STMT(BPF_MISC | BPF_TAX, 0),
+		BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 8),
+		BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, count),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	
+	prog.len = sizeof(code) / sizeof(code[0]);
+	prog.filter = code;
+	
+	r = setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+	if(r < 0)
 	{
-		fprintf(stderr, "Unexpected revents for incoming UDP socket (%d)\n", fds->revents);
+		perror("setsockopt");
 		return(-1);
 	}
 	
-	/* New UDP packet */
-	r = recv(fds->fd, data, _BUFFER, 0);
-	if(r < 0)
+	return(0);
+}
+
+static int _open_ingest(void)
+{
+	int i;
+	
+	/* Open the incoming UDP sockets, in _fds[0] onwards */
+	for(i = 0; i < _ingest_count; i++)
 	{
-		if(errno == EAGAIN || errno == EWOULDBLOCK)
+		_fds[i].fd = _open_incoming_socket(_ingest_count > 1);
+		_fds[i].events = POLLIN;
+		
+		if(_fds[i].fd < 0) return(-1);
+	}
+	
+	if(_ingest_count > 1 && _ingest_hash == INGEST_HASH_ADDRESS)
+	{
+		if(_attach_ingest_hash(_fds[0].fd, _ingest_count) != 0)
 		{
-			return(0);
+			printf("Unable to attach the source address hash, stations will be spread by the kernel\n");
 		}
+	}
+	
+	return(0);
+}
+
+static void _rx_clock(void)
+{
+	/* Sample the clocks, just after receiving datagrams */
+	_rx_timestamp = _timestamp_us();
+	_rx_offset = _rx_timestamp - _clock_us(CLOCK_REALTIME);
+}
+
+static int64_t _ingest_control(int i, struct msghdr *msg, int64_t timestamp)
+{
+	struct cmsghdr *cmsg;
+	struct timespec tp;
+	int64_t arrival = timestamp;
+	
+	/* Read the control messages received with a datagram on socket i.
+	 * Returns the datagram's receive time, or timestamp if unknown */
+	for(cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+	{
+		if(cmsg->cmsg_level != SOL_SOCKET) continue;
 		
-		fprintf(stderr, "Error receiving packet: %d\n", r);
-		perror("recv");
-		return(-1);
+		if(cmsg->cmsg_type == SO_RXQ_OVFL)
+		{
+			memcpy(&_ingest[i].dropped, CMSG_DATA(cmsg), sizeof(uint32_t));
+		}
+		else if(cmsg->cmsg_type == SCM_TIMESTAMPNS)
+		{
+			memcpy(&tp, CMSG_DATA(cmsg), sizeof(tp));
+			arrival = (int64_t) tp.tv_sec * 1000000 + tp.tv_nsec / 1000 + _rx_offset;
+		}
 	}
 	
-	if(r % (0x10 + TS_PACKET_SIZE) != 0)
+	if(arrival > _rx_timestamp || arrival < _rx_timestamp - MX_MS(_MAX_RX_AGE))
 	{
-		fprintf(stderr, "Incoming packet invalid size, expected a multiple of 204 bytes, got %d\n", r);
-		return(0);
+		arrival = timestamp;
+	}
+	
+	return(arrival);
+}
+
+static void _print_ingest_stats(void)
+{
+	int i;
+	
+	for(i = 0; i < _ingest_count; i++)
+	{
+		printf("Ingest socket %d: %llu datagrams received, %u dropped\n",
+			i,
+			(unsigned long long) _ingest[i].received,
+			_ingest[i].dropped
+		);
 	}
+}
+
+static void _feed_batch(int64_t timestamp, mx_t *merger)
+{
+	int i, station[MX_BATCH];
 	
-	/* Feed in the packet(s) */
-	for(i = 0; i < r; i += (0x10 + TS_PACKET_SIZE))
+	mx_feed_batch(merger, timestamp, _batch_data, _batch_arrival, _batch_count, station);
+	
+	/* Remember where to send NACKs for each station */
+	for(i = 0; i < _batch_count; i++)
 	{
-		mx_feed(merger, timestamp, &data[i]);
+		if(station[i] >= 0)
+		{
+			_station_addr[station[i]] = _batch_addr[i];
+		}
 	}
 	
-	return(0);
+	_batch_count = 0;
+	
+	/* The receive buffers can now be reused */
+	for(i = 0; i < _batch_bids; i++)
+	{
+		uring_recycle_buf(&_uring_bufs, _batch_bid[i]);
+	}
+	
+	_batch_bids = 0;
+}
+
+static void _feed_datagram(uint8_t *data, int len, struct sockaddr_in *addr, int64_t arrival, int64_t timestamp, mx_t *merger)
+{
+	int i;
+	
+	if(len % MX_PACKET_LEN != 0)
+	{
+		fprintf(stderr, "Incoming packet invalid size, expected a multiple of 204 bytes, got %d\n", len);
+		return;
+	}
+	
+	/* Queue the packet(s), feeding the batch whenever it is full. With
+	 * io_uring the datagram's buffer is only added to the batch after
+	 * this, so it is not recycled while packets in it are still queued */
+	for(i = 0; i < len; i += MX_PACKET_LEN)
+	{
+		if(_batch_count == MX_BATCH)
+		{
+			_feed_batch(timestamp, merger);
+		}
+		
+		_batch_data[_batch_count] = &data[i];
+		_batch_arrival[_batch_count] = arrival;
+		_batch_addr[_batch_count] = *addr;
+		_batch_count++;
+	}
 }
 
-static int _accept_connection(struct pollfd *fds, int64_t timestamp, viewer_t *viewers)
+static int _incoming_packet(struct pollfd *fds, int socket, int64_t timestamp, mx_t *merger)
 {
+	static uint8_t data[_DATAGRAMS][_DATAGRAM_LEN];
+	static uint8_t control[_DATAGRAMS][_CONTROL_LEN];
+	static struct sockaddr_in addr[_DATAGRAMS];
+	static struct iovec iov[_DATAGRAMS];
+	static struct mmsghdr msg[_DATAGRAMS];
+	int64_t arrival;
 	int i, r;
-	int sock;
-	struct sockaddr_in addr;
-	socklen_t addr_len;
-	char ipaddr[INET_ADDRSTRLEN];
 	
 	if(fds->revents != POLLIN)
 	{
-		fprintf(stderr, "Unexpected revents for incoming TCP socket (%d)\n", fds->revents);
+		fprintf(stderr, "Unexpected revents for incoming UDP socket (%d)\n", fds->revents);
 		return(-1);
 	}
 	
-	addr_len = sizeof(addr);
-	sock = accept(fds->fd, (struct sockaddr *) &addr, &addr_len);
-	if(sock < 0)
+	for(i = 0; i < _DATAGRAMS; i++)
+	{
+		iov[i].iov_base = data[i];
+		iov[i].iov_len = _DATAGRAM_LEN;
+		
+		memset(&msg[i], 0, sizeof(struct mmsghdr));
+		msg[i].msg_hdr.msg_name = &addr[i];
+		msg[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		msg[i].msg_hdr.msg_iov = &iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+		msg[i].msg_hdr.msg_control = control[i];
+		msg[i].msg_hdr.msg_controllen = _CONTROL_LEN;
+	}
+	
+	/* New UDP packets, read as many as are waiting */
+	r = recvmmsg(fds->fd, msg, _DATAGRAMS, 0, NULL);
+	if(r < 0)
 	{
 		if(errno == EAGAIN || errno == EWOULDBLOCK)
 		{
 			return(0);
 		}
 		
-		perror("accept");
+		fprintf(stderr, "Error receiving packet: %d\n", r);
+		perror("recvmmsg");
 		return(-1);
 	}
 	
-	ipaddr[0] = '\0';
-	inet_ntop(AF_INET, &addr.sin_addr, ipaddr, INET_ADDRSTRLEN);
-	
-	printf("New viewer connection from %s\n", ipaddr);
-	
-	i = 1;
-	r = setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &i, sizeof(int));
-	if(r < 0)
-	{
-		fprintf(stderr, "%d: Error setting TCP_NODELAY on client socket\n", sock);
-		perror("setsockopt");
-		/* This is not a fatal error */
-	}
+	_ingest[socket].received += r;
+	_rx_clock();
 	
-	for(i = 0; i < _VIEWERS; i++)
+	for(i = 0; i < r; i++)
 	{
-		if(viewers[i].sock > 0) continue;
-		
-		viewers[i].sock = sock;
-		viewers[i].last_station = -1;
-		viewers[i].last_counter = 0;
-		viewers[i].timestamp = timestamp;
+		arrival = _ingest_control(socket, &msg[i].msg_hdr, timestamp);
 		
-		_fds[2 + i].fd = sock;
-		_fds[2 + i].events = POLLIN;
+		if(msg[i].msg_hdr.msg_flags & MSG_TRUNC)
+		{
+			fprintf(stderr, "Incoming packet too large for the receive buffer\n");
+			continue;
+		}
 		
-		return(0);
+		_feed_datagram(data[i], msg[i].msg_len, &addr[i], arrival, timestamp, merger);
 	}
 	
-	/* No free slots, disconnect */
-	//r = send(sock, "BUSY\n", 5, 0);
-	close(sock);
+	_feed_batch(timestamp, merger);
 	
 	return(0);
 }
 
-static void _close_connection(viewer_t *viewers, int i)
+static void _send_nacks(int sock, int64_t timestamp, mx_t *merger)
 {
-	printf("Closing TCP socket %d\n", i);
+	int i, r;
+	uint8_t data[MX_NACK_LEN];
 	
-	close(viewers[i].sock);
+	/* Request any missing packets from each station */
+	for(i = 0; i < _STATIONS; i++)
+	{
+		r = mx_nack(merger, i, timestamp, data);
+		if(r <= 0) continue;
+		
+		r = sendto(sock, data, r, 0, (struct sockaddr *) &_station_addr[i], sizeof(struct sockaddr_in));
+		if(r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			perror("sendto");
+		}
+	}
+}
+
+static uint64_t _uring_data(int type, int slot, uint32_t gen)
+{
+	return(((uint64_t) gen << 16) | ((uint64_t) slot << 8) | type);
+}
+
+static int _uring_arm_recv(int i)
+{
+	struct io_uring_sqe *sqe;
 	
-	viewers[i].sock = 0;
-	viewers[i].last_station = -1;
-	viewers[i].last_counter = 0;
-	viewers[i].timestamp = 0;
+	/* A multishot receive stays armed, taking a new buffer
+	 * from the buffer ring for each UDP packet */
 	
-	_fds[2 + i].fd = -1;
-	_fds[2 + i].events = 0;
+	sqe = uring_get_sqe(&_uring);
+	if(sqe == NULL) return(-1);
+	
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = _fds[i].fd;
+	sqe->addr = (uint64_t) (uintptr_t) &_uring_msg;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = _uring_bufs.group;
+	sqe->user_data = _uring_data(_URING_RECV, i, 0);
+	
+	return(0);
 }
 
-int main(int argc, char *argv[])
+static int _open_uring(void)
 {
-	int i, r;
-	int64_t timestamp;
+	struct iovec iov[2];
+	int i, n;
 	
-	/* Initialise the merger */
-	/* In my example file, PID 256 contains the PCR clock */
-	mx_init(&_merger, 256);
+	/* Set up the io_uring backend. Returns -1 if it is not available */
 	
-	/* Prepare the network - ignore SIGPIPE on viewer disconnection */
-	signal(SIGPIPE, SIG_IGN);
+	if(uring_init(&_uring, _URING_ENTRIES) != 0) return(-1);
 	
-	/* The first two entries in the fds array are for the listening sockets */
-	memset(&_fds, 0, sizeof(_fds));
+	if(uring_init_bufs(&_uring, &_uring_bufs, 0, _URING_BUFFERS, _URING_BUFFER_LEN) != 0)
+	{
+		uring_free(&_uring);
+		return(-1);
+	}
 	
-	_fds[0].fd = _open_incoming_socket();
-	_fds[0].events = POLLIN;
+	/* The source address and control messages are needed from recvmsg */
+	memset(&_uring_msg, 0, sizeof(_uring_msg));
+	_uring_msg.msg_namelen = sizeof(struct sockaddr_in);
+	_uring_msg.msg_controllen = _CONTROL_LEN;
 	
-	_fds[1].fd = _open_viewer_socket();
-	_fds[1].events = POLLIN;
+	/* Register the output ring, and the HLS segment store, so viewer
+	 * sends can use them directly. This is optional */
+	iov[0].iov_base = _merger->out;
+	iov[0].iov_len = sizeof(_merger->out);
+	n = 1;
 	
-	for(i = 2; i < _NFDS; i++)
+	if(_hls_enabled)
 	{
-		_fds[i].fd = -1;
-		_fds[i].events = 0;
+		iov[1].iov_base = _hls.data;
+		iov[1].iov_len = _hls.packets * TS_PACKET_SIZE;
+		n = 2;
 	}
 	
-	/* Clear the viewers array */
-	memset(&_viewers, 0, sizeof(_viewers));
+	if(uring_register_buffers(&_uring, iov, n) == 0)
+	{
+		_uring_fixed = 1;
+	}
+	else
+	{
+		printf("Unable to register buffers, viewer sends will be copied\n");
+	}
 	
-	/* The main network loop */
-	while(1)
+	memset(_uring_poll, 0, sizeof(_uring_poll));
+	
+	for(i = 0; i < _ingest_count; i++)
 	{
-		/* Wait for network activity, or 10ms */
-		i = poll(_fds, _NFDS, 10);
-		if(i < 0)
-		{
-			perror("poll");
-			break;
-		}
-		
-		timestamp = _timestamp_ms();
-		
-		/* Incoming UDP packet? */
-		if(_fds[0].revents != 0)
-		{
-			r = _incoming_packet(&_fds[0], timestamp, &_merger);
-			if(r < 0) break;
-		}
-		
-		/* Incoming client connection? */
-		if(_fds[1].revents != 0)
+		if(_uring_arm_recv(i) != 0)
 		{
-			r = _accept_connection(&_fds[1], timestamp, _viewers);
-			if(r < 0) break;
+			uring_free(&_uring);
+			return(-1);
 		}
-		
-		/* Check if there is data to send to each client */
-		while(mx_update(&_merger, timestamp) > 0);
-		
-		for(i = 0; i < _VIEWERS; i++)
-		{
-			mx_packet_t *p;
-			
-			if(_viewers[i].sock <= 0) continue;
-			
-			/* First test if this socket was closed by the client */
-			if(_fds[2 + i].fd > 0 && _fds[2 + i].revents == POLLIN)
-			{
-				/* The client has sent us data, or closed the socket */
-				/* Either way, close the socket on this end */
-				_close_connection(_viewers, i);
-				continue;
+	}
+	
+	return(0);
+}
+
+static void _uring_cancel_poll(int i)
+{
+	_uring_poll_t *p = &_uring_poll[i];
+	struct io_uring_sqe *sqe;
+	
+	if(p->armed == 0) return;
+	
+	sqe = uring_get_sqe(&_uring);
+	if(sqe == NULL) return;
+	
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->addr = _uring_data(_URING_POLL, i, p->gen);
+	sqe->user_data = _uring_data(_URING_CANCEL, i, 0);
+	
+	/* Any completion for the old request is ignored */
+	p->armed = 0;
+	p->gen++;
+}
+
+static void _uring_arm_poll(int i)
+{
+	_uring_poll_t *p = &_uring_poll[i];
+	struct io_uring_sqe *sqe;
+	
+	/* One-shot polls are re-armed after each completion, which gives
+	 * the same level-triggered behaviour as poll() */
+	
+	if(p->armed && (p->fd != _fds[i].fd || p->events != _fds[i].events))
+	{
+		_uring_cancel_poll(i);
+	}
+	
+	if(p->armed || _fds[i].fd < 0 || _fds[i].events == 0) return;
+	
+	sqe = uring_get_sqe(&_uring);
+	if(sqe == NULL) return;
+	
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = _fds[i].fd;
+	sqe->poll32_events = _fds[i].events;
+	sqe->user_data = _uring_data(_URING_POLL, i, p->gen);
+	
+	p->armed = 1;
+	p->fd = _fds[i].fd;
+	p->events = _fds[i].events;
+}
+
+static void _uring_recv(struct io_uring_cqe *cqe, int i, int64_t timestamp)
+{
+	struct io_uring_recvmsg_out *out;
+	struct sockaddr_in addr;
+	struct msghdr msg;
+	int64_t arrival;
+	uint8_t *buf;
+	int bid;
+	
+	if(cqe->res < 0)
+	{
+		/* Out of buffers is expected under load, anything else isn't */
+		if(cqe->res != -ENOBUFS)
+		{
+			fprintf(stderr, "Error receiving packet: %s\n", strerror(-cqe->res));
+		}
+	}
+	else if(cqe->flags & IORING_CQE_F_BUFFER)
+	{
+		/* Make room to hold on to another buffer */
+		if(_batch_bids == MX_BATCH)
+		{
+			_feed_batch(timestamp, _merger);
+		}
+		
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		buf = uring_buf(&_uring_bufs, bid);
+		
+		/* The buffer holds a header, the source address, the
+		 * control messages, then the packet */
+		out = (struct io_uring_recvmsg_out *) buf;
+		buf += sizeof(struct io_uring_recvmsg_out) + _uring_msg.msg_namelen + _uring_msg.msg_controllen;
+		
+		_ingest[i].received++;
+		
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = (uint8_t *) (out + 1) + _uring_msg.msg_namelen;
+		msg.msg_controllen = out->controllen;
+		arrival = _ingest_control(i, &msg, timestamp);
+		
+		if(out->flags & MSG_TRUNC)
+		{
+			fprintf(stderr, "Incoming packet too large for the receive buffer\n");
+		}
+		else if(out->namelen >= sizeof(struct sockaddr_in))
+		{
+			memcpy(&addr, out + 1, sizeof(addr));
+			_feed_datagram(buf, out->payloadlen, &addr, arrival, timestamp, _merger);
+		}
+		
+		/* Recycled once any packets it holds have been fed */
+		_batch_bid[_batch_bids++] = bid;
+	}
+	
+	/* The receive is disarmed on errors, such as running out of buffers */
+	if((cqe->flags & IORING_CQE_F_MORE) == 0)
+	{
+		_uring_arm_recv(i);
+	}
+}
+
+static void _trace_output(void)
+{
+	mx_output_t *o;
+	
+	/* Count the packets added to the output since the last call */
+	for(; _traced_seq < mx_seq(_merger); _traced_seq++)
+	{
+		o = mx_info(_merger, _traced_seq);
+		if(o == NULL) continue;
+		
+		hist_add(&_output_latency, o->output_timestamp - o->timestamp);
+	}
+}
+
+static void _trace_sent(viewer_t *v, uint64_t seq, int64_t timestamp)
+{
+	mx_output_t *o;
+	uint64_t first;
+	
+	/* Count the stream packets sent to a viewer, from seq up to v->seq */
+	if(_latency == 0 || v->state != VIEWER_STREAM) return;
+	
+	/* Claim the packets not yet sent to any viewer, on any thread */
+	first = __atomic_load_n(&_first_sent_seq, __ATOMIC_RELAXED);
+	while(first < v->seq && !__atomic_compare_exchange_n(&_first_sent_seq,
+		&first, v->seq, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	
+	for(; seq < v->seq; seq++)
+	{
+		o = mx_info(_merger, seq);
+		if(o == NULL) continue;
+		
+		hist_add(&v->latency, timestamp - o->timestamp);
+		
+		if(seq >= first)
+		{
+			hist_add(&_first_send_latency, timestamp - o->output_timestamp);
+		}
+	}
+}
+
+static void _print_latency(void)
+{
+	hist_print(&_output_latency, "Latency from arrival to output");
+	
+	/* Viewer threads print their own share of this */
+	if(_workers == 0)
+	{
+		hist_print(&_first_send_latency, "Latency from output to first send");
+	}
+	
+	hist_reset(&_output_latency);
+	hist_reset(&_first_send_latency);
+}
+
+static void _uring_send(struct io_uring_cqe *cqe, int i, uint32_t gen, int64_t timestamp)
+{
+	viewer_t *v = &_viewers[i];
+	uint64_t seq;
+	
+	/* Ignore completions for closed viewers */
+	if(v->sock <= 0 || v->gen != gen) return;
+	
+	/* A zero-copy send holds on to the output until the notification
+	 * that follows it, once the data has been acknowledged */
+	if(cqe->flags & IORING_CQE_F_NOTIF)
+	{
+		v->notifs--;
+		return;
+	}
+	
+	if(cqe->flags & IORING_CQE_F_MORE) v->notifs++;
+	v->pending--;
+	
+	if(cqe->res > 0)
+	{
+		/* Update viewer state. Partial sends are continued next time */
+		seq = v->seq;
+		v->offset += cqe->res;
+		v->seq += v->offset / TS_PACKET_SIZE;
+		v->offset %= TS_PACKET_SIZE;
+		v->timestamp = timestamp;
+		
+		_trace_sent(v, seq, timestamp);
+	}
+	else if(cqe->res < 0 && cqe->res != -ECANCELED)
+	{
+		/* A linked send is cancelled if the one before it failed */
+		fprintf(stderr, "send: %s\n", strerror(-cqe->res));
+		v->error = 1;
+	}
+}
+
+static int _uring_wait(int timeout_ms)
+{
+	struct io_uring_cqe *cqe;
+	int64_t timestamp;
+	uint32_t gen;
+	int i, type;
+	
+	/* The io_uring equivalent of poll(). Waits up to timeout_ms,
+	 * receives any UDP packets and completes viewer sends, then
+	 * fills in revents for the other fds entries */
+	
+	for(i = 0; i < _NFDS; i++)
+	{
+		_fds[i].revents = 0;
+		if(i >= _MAX_INGEST) _uring_arm_poll(i);
+	}
+	
+	if(uring_submit(&_uring, timeout_ms) != 0) return(-1);
+	
+	timestamp = _timestamp_us();
+	_rx_clock();
+	
+	while((cqe = uring_peek_cqe(&_uring)) != NULL)
+	{
+		type = cqe->user_data & 0xFF;
+		i = (cqe->user_data >> 8) & 0xFF;
+		gen = cqe->user_data >> 16;
+		
+		switch(type)
+		{
+		case _URING_RECV:
+			_uring_recv(cqe, i, timestamp);
+			break;
+		
+		case _URING_POLL:
+			if(gen != _uring_poll[i].gen) break;
+			_uring_poll[i].armed = 0;
+			if(cqe->res > 0) _fds[i].revents |= cqe->res;
+			break;
+		
+		case _URING_SEND:
+			_uring_send(cqe, i, gen, timestamp);
+			break;
+		}
+		
+		uring_cqe_seen(&_uring);
+	}
+	
+	_feed_batch(timestamp, _merger);
+	
+	return(0);
+}
+
+static int _lag(uint64_t seq, int64_t timestamp, int64_t *packets, int64_t *ms)
+{
+	mx_output_t *o;
+	
+	/* Measure how far output position seq is behind the output, in
+	 * packets and in ms since it was output. The merger's own delay is
+	 * not counted. Returns 1 if it is beyond either limit */
+	*packets = mx_seq(_merger) - seq;
+	
+	o = mx_info(_merger, seq);
+	*ms = (o != NULL ? (timestamp - o->output_timestamp) / 1000 : 0);
+	
+	return(*packets > _max_lag_packets || *ms > _max_lag_ms);
+}
+
+static uint64_t _skip_seq(uint64_t seq, int64_t timestamp)
+{
+	int64_t packets, ms;
+	uint64_t rap;
+	
+	/* Returns where a viewer at seq that is too far behind continues
+	 * from. That is the latest random access point if it is ahead of
+	 * the viewer and within the lag limits itself, or else the end of
+	 * the output, so a skip never goes backwards or lands behind */
+	rap = mx_rap(_merger);
+	
+	if(rap > seq && _lag(rap, timestamp, &packets, &ms) == 0) return(rap);
+	
+	return(mx_seq(_merger));
+}
+
+static int _uring_send_viewer(viewer_t *viewers, int i)
+{
+	viewer_t *v = &viewers[i];
+	struct io_uring_sqe *sqe, *prev = NULL;
+	uint8_t *data;
+	uint64_t seq;
+	int offset, n, j, max;
+	
+	/* Queue sends for the output available to the viewer, up to
+	 * _URING_SEND_PACKETS. When the output ring wraps a second send
+	 * is linked to the first, so it only starts once the first has
+	 * been sent in full. Only one batch is in flight per viewer, and
+	 * the next waits until the kernel has let go of the output the
+	 * last one was sent from. Returns -1 on error */
+	
+	if(v->error) return(-1);
+	if(v->pending > 0 || v->notifs > 0) return(0);
+	
+	/* Skip ahead, only at the start of a packet */
+	if(v->resync && v->offset == 0)
+	{
+		v->seq = _skip_seq(v->seq, _timestamp_us());
+		v->resync = 0;
+	}
+	
+	/* A batch must not be split by uring_get_sqe() submitting early */
+	if(uring_sq_space(&_uring) < 2) return(0);
+	
+	seq = v->seq;
+	offset = v->offset;
+	
+	/* The HLS store is kept to the same fraction */
+	max = _URING_SEND_PACKETS;
+	if(v->state == VIEWER_SEGMENT && max > _hls.packets / 4) max = _hls.packets / 4;
+	
+	for(j = 0; j < 2 && max > 0; j++)
+	{
+		if(v->state == VIEWER_SEGMENT)
+		{
+			n = hls_read(&_hls, seq, v->end, &data);
+		}
+		else
+		{
+			n = mx_read(_merger, seq, &data);
+		}
+		
+		if(n < 0) return(-1);
+		if(n == 0) break;
+		if(n > max) n = max;
+		
+		sqe = uring_get_sqe(&_uring);
+		
+		/* MSG_WAITALL makes the kernel retry partial sends, and
+		 * treat any short send as a failure that breaks the link */
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = v->sock;
+		sqe->addr = (uint64_t) (uintptr_t) (data + offset);
+		sqe->len = n * TS_PACKET_SIZE - offset;
+		sqe->msg_flags = MSG_WAITALL;
+		sqe->user_data = _uring_data(_URING_SEND, i, v->gen);
+		
+		if(_uring_fixed)
+		{
+			/* Send straight from the registered buffers. The kernel
+			 * reads them again for any retransmission, until the
+			 * data is acknowledged. See _uring_overrun() */
+			sqe->opcode = IORING_OP_SEND_ZC;
+			sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+			sqe->buf_index = (v->state == VIEWER_SEGMENT ? 1 : 0);
+		}
+		
+		if(prev != NULL) prev->flags |= IOSQE_IO_LINK;
+		prev = sqe;
+		
+		seq += n;
+		offset = 0;
+		max -= n;
+	}
+	
+	v->pending = j;
+	v->held = v->seq;
+	
+	return(0);
+}
+
+static int _uring_overrun(viewer_t *v)
+{
+	uint64_t head, size;
+	
+	/* Returns 1 if the output still held by the viewer's sends is half
+	 * way to being overwritten. It can't be skipped over like the rest
+	 * of the output, so the viewer must be disconnected before then */
+	if(v->pending == 0 && v->notifs == 0) return(0);
+	
+	if(v->state == VIEWER_SEGMENT)
+	{
+		head = _hls.head;
+		size = _hls.packets;
+	}
+	else
+	{
+		head = mx_seq(_merger);
+		size = _OUTPUT_PACKETS;
+	}
+	
+	return(head - v->held > size / 2);
+}
+
+static void _set_response(viewer_t *v, const char *response, _viewer_state_t next)
+{
+	v->response_len = snprintf(v->response, _HTTP_RESPONSE_LEN, "%s", response);
+	v->response_offset = 0;
+	v->state = VIEWER_RESPONSE;
+	v->next = next;
+}
+
+static void _start_stream(viewer_t *v, const char *header)
+{
+	uint8_t psi[MX_JOIN_PSI_LEN];
+	uint8_t *p;
+	int64_t packets, ms;
+	int i, len;
+	
+	/* Start the viewer at the latest random access point. The header
+	 * is followed by the PAT and PMT in effect there, so the viewer
+	 * can start decoding from the first packet of the stream */
+	v->seq = mx_join(_merger, psi, &len);
+	v->offset = 0;
+	
+	/* A random access point that is already beyond the lag limits would
+	 * have the viewer skipping ahead straight away, back to the same
+	 * point. Start at the end of the output instead */
+	if(_lag(v->seq, _timestamp_us(), &packets, &ms) != 0)
+	{
+		v->seq = mx_seq(_merger);
+	}
+	
+	_set_response(v, header, VIEWER_STREAM);
+	
+	for(i = 0; i < len; i += TS_PACKET_SIZE)
+	{
+		p = &psi[i];
+		
+		/* Filtered viewers get the PSI rewritten to match */
+		if(v->filter != NULL)
+		{
+			switch(filter_packet(v->filter, ((p[1] & 0x1F) << 8) | p[2], p, (uint8_t *) v->response + v->response_len))
+			{
+			case FILTER_DROP: continue;
+			case FILTER_REWRITE: v->response_len += TS_PACKET_SIZE; continue;
+			}
+		}
+		
+		memcpy(v->response + v->response_len, p, TS_PACKET_SIZE);
+		v->response_len += TS_PACKET_SIZE;
+	}
+}
+
+static int _set_filter(viewer_t *v, const char *query)
+{
+	int r;
+	
+	/* Set up any PID filter asked for in the query string.
+	 * Returns -1 if the query is invalid */
+	
+	v->filter = malloc(sizeof(filter_t));
+	if(v->filter == NULL)
+	{
+		perror("malloc");
+		return(-1);
+	}
+	
+	r = filter_init(v->filter, query);
+	
+	if(r != 1)
+	{
+		free(v->filter);
+		v->filter = NULL;
+	}
+	
+	return(r < 0 ? -1 : 0);
+}
+
+static int _add_viewer(viewer_t *viewers, struct pollfd *fds, int sock, int http, int64_t timestamp, int uring)
+{
+	int i;
+	
+	/* Take a free viewer slot for the socket, with its poll entry
+	 * in fds[i]. Returns -1 if there are none free */
+	
+	for(i = 0; i < _VIEWERS; i++)
+	{
+		if(viewers[i].sock > 0) continue;
+		
+		viewers[i].sock = sock;
+		viewers[i].http = http;
+		viewers[i].state = VIEWER_REQUEST;
+		viewers[i].request_len = 0;
+		viewers[i].response_len = 0;
+		viewers[i].response_offset = 0;
+		viewers[i].next = VIEWER_CLOSE;
+		viewers[i].seq = mx_seq(_merger);
+		viewers[i].offset = 0;
+		viewers[i].end = 0;
+		viewers[i].timestamp = timestamp;
+		viewers[i].lag_packets = 0;
+		viewers[i].lag_ms = 0;
+		viewers[i].resync = 0;
+		viewers[i].skips = 0;
+		hist_reset(&viewers[i].latency);
+		viewers[i].filter = NULL;
+		viewers[i].partial_psi = 0;
+		viewers[i].uring = uring;
+		viewers[i].pending = 0;
+		viewers[i].notifs = 0;
+		viewers[i].gen++;
+		viewers[i].error = 0;
+		
+		/* Raw TS viewers start streaming straight away */
+		if(!http) _start_stream(&viewers[i], "");
+		
+		fds[i].fd = sock;
+		fds[i].events = POLLIN;
+		
+		return(0);
+	}
+	
+	return(-1);
+}
+
+static int _hand_off(int sock, int http)
+{
+	_worker_t *w = &_worker[0];
+	int i, msg;
+	
+	/* Pass a new viewer to the thread with the fewest */
+	for(i = 1; i < _workers; i++)
+	{
+		if(__atomic_load_n(&_worker[i].viewers_count, __ATOMIC_RELAXED) <
+		   __atomic_load_n(&w->viewers_count, __ATOMIC_RELAXED))
+		{
+			w = &_worker[i];
+		}
+	}
+	
+	msg = (sock << 1) | http;
+	
+	if(write(w->pipe[1], &msg, sizeof(msg)) != sizeof(msg))
+	{
+		perror("write");
+		return(-1);
+	}
+	
+	__atomic_add_fetch(&w->viewers_count, 1, __ATOMIC_RELAXED);
+	
+	return(0);
+}
+
+static int _accept_connection(struct pollfd *fds, int64_t timestamp, viewer_t *viewers, int http)
+{
+	int i, r;
+	int sock;
+	struct sockaddr_in addr;
+	socklen_t addr_len;
+	char ipaddr[INET_ADDRSTRLEN];
+	
+	if(fds->revents != POLLIN)
+	{
+		fprintf(stderr, "Unexpected revents for incoming TCP socket (%d)\n", fds->revents);
+		return(-1);
+	}
+	
+	addr_len = sizeof(addr);
+	sock = accept(fds->fd, (struct sockaddr *) &addr, &addr_len);
+	if(sock < 0)
+	{
+		if(errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			return(0);
+		}
+		
+		perror("accept");
+		return(-1);
+	}
+	
+	ipaddr[0] = '\0';
+	inet_ntop(AF_INET, &addr.sin_addr, ipaddr, INET_ADDRSTRLEN);
+	
+	printf("New %s viewer connection from %s\n", (http ? "HTTP" : "TCP"), ipaddr);
+	
+	/* Accepted sockets do not inherit O_NONBLOCK. Without it
+	 * a slow viewer would stall the whole loop in send() */
+	fcntl(sock, F_SETFL, O_NONBLOCK);
+	
+	i = 1;
+	r = setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &i, sizeof(int));
+	if(r < 0)
+	{
+		fprintf(stderr, "%d: Error setting TCP_NODELAY on client socket\n", sock);
+		perror("setsockopt");
+		/* This is not a fatal error */
+	}
+	
+	if(_workers > 0)
+	{
+		r = _hand_off(sock, http);
+	}
+	else
+	{
+		r = _add_viewer(viewers, &_fds[_FDS_VIEWERS], sock, http, timestamp, _io == IO_URING);
+	}
+	
+	if(r != 0)
+	{
+		/* No free slots, disconnect */
+		//r = send(sock, "BUSY\n", 5, 0);
+		close(sock);
+	}
+	
+	return(0);
+}
+
+static void _close_connection(viewer_t *viewers, struct pollfd *fds, int i)
+{
+	struct linger linger = { 1, 0 };
+	
+	printf("Closing TCP socket %d\n", i);
+	
+	if(viewers[i].uring)
+	{
+		/* A viewer still holding output is reset rather than closed, so
+		 * the kernel drops the data queued from it instead of sending it
+		 * after it has been overwritten */
+		if(viewers[i].pending > 0 || viewers[i].notifs > 0)
+		{
+			setsockopt(viewers[i].sock, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+		}
+		
+		/* Fail any sends still in flight, and stop polling the socket */
+		shutdown(viewers[i].sock, SHUT_RDWR);
+		_uring_cancel_poll(_FDS_VIEWERS + i);
+		viewers[i].gen++;
+	}
+	
+	close(viewers[i].sock);
+	
+	free(viewers[i].filter);
+	viewers[i].filter = NULL;
+	
+	viewers[i].sock = 0;
+	viewers[i].seq = 0;
+	viewers[i].offset = 0;
+	viewers[i].timestamp = 0;
+	viewers[i].resync = 0;
+	
+	fds[i].fd = -1;
+	fds[i].events = 0;
+}
+
+static void _hls_request(viewer_t *v, const char *target, int head)
+{
+	hls_segment_t *seg;
+	unsigned long long sequence;
+	char *e;
+	int l;
+	
+	if(strcmp(target, "/stream.m3u8") == 0)
+	{
+		/* The playlist is sent with the header */
+		l = snprintf(v->response, _HTTP_RESPONSE_LEN, _http_playlist, _hls.playlist_len);
+		
+		if(!head)
+		{
+			memcpy(v->response + l, _hls.playlist, _hls.playlist_len);
+			l += _hls.playlist_len;
+		}
+		
+		v->response_len = l;
+		v->response_offset = 0;
+		v->state = VIEWER_RESPONSE;
+		v->next = VIEWER_CLOSE;
+		
+		return;
+	}
+	
+	/* Segments are named stream<sequence>.ts */
+	seg = NULL;
+	
+	if(strncmp(target, "/stream", 7) == 0 && target[7] >= '0' && target[7] <= '9')
+	{
+		sequence = strtoull(target + 7, &e, 10);
+		if(strcmp(e, ".ts") == 0) seg = hls_segment(&_hls, sequence);
+	}
+	
+	if(seg == NULL)
+	{
+		_set_response(v, _http_not_found, VIEWER_CLOSE);
+		return;
+	}
+	
+	v->response_len = snprintf(v->response, _HTTP_RESPONSE_LEN, _http_segment,
+		(unsigned long long) (seg->end - seg->start) * TS_PACKET_SIZE);
+	v->response_offset = 0;
+	v->state = VIEWER_RESPONSE;
+	v->next = (head ? VIEWER_CLOSE : VIEWER_SEGMENT);
+	v->seq = seg->start;
+	v->end = seg->end;
+}
+
+static void _parse_request(viewer_t *v)
+{
+	char *method, *target, *version, *query, *e;
+	int head;
+	
+	/* Parse the request line. Header fields are not used */
+	method = v->request;
+	
+	target = strchr(method, ' ');
+	if(target == NULL) goto bad_request;
+	*(target++) = '\0';
+	
+	version = strchr(target, ' ');
+	if(version == NULL) goto bad_request;
+	*(version++) = '\0';
+	
+	e = strpbrk(version, "\r\n");
+	if(e == NULL) goto bad_request;
+	*e = '\0';
+	
+	if(strncmp(version, "HTTP/1.", 7) != 0) goto bad_request;
+	
+	/* The query string is only used by /stream.ts */
+	query = strchr(target, '?');
+	if(query != NULL) *(query++) = '\0';
+	
+	if(strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0)
+	{
+		_set_response(v, _http_not_allowed, VIEWER_CLOSE);
+		return;
+	}
+	
+	/* HEAD requests only get the response header */
+	head = (strcmp(method, "HEAD") == 0);
+	
+	if(strcmp(target, "/stream.ts") == 0)
+	{
+		if(query != NULL && _set_filter(v, query) != 0) goto bad_request;
+		
+		if(head) _set_response(v, _http_ok, VIEWER_CLOSE);
+		else _start_stream(v, _http_ok);
+		return;
+	}
+	
+	if(_hls_enabled)
+	{
+		pthread_mutex_lock(&_hls_lock);
+		_hls_request(v, target, head);
+		pthread_mutex_unlock(&_hls_lock);
+		return;
+	}
+	
+	_set_response(v, _http_not_found, VIEWER_CLOSE);
+	
+	return;
+	
+bad_request:
+	_set_response(v, _http_bad_request, VIEWER_CLOSE);
+}
+
+static int _read_request(viewer_t *viewers, int i)
+{
+	viewer_t *v = &viewers[i];
+	int r;
+	
+	/* Read more of the HTTP request into the viewer's buffer.
+	 * Returns -1 if the connection was closed or failed */
+	
+	r = recv(v->sock, v->request + v->request_len, _HTTP_REQUEST_LEN - 1 - v->request_len, 0);
+	if(r < 0)
+	{
+		if(errno == EAGAIN || errno == EWOULDBLOCK) return(0);
+		
+		perror("recv");
+		return(-1);
+	}
+	
+	/* The client closed the connection */
+	if(r == 0) return(-1);
+	
+	v->request_len += r;
+	v->request[v->request_len] = '\0';
+	
+	/* Wait for the end of the header */
+	if(strstr(v->request, "\r\n\r\n") == NULL &&
+	   strstr(v->request, "\n\n") == NULL)
+	{
+		if(v->request_len == _HTTP_REQUEST_LEN - 1)
+		{
+			/* The request is too long */
+			_set_response(v, _http_bad_request, VIEWER_CLOSE);
+		}
+		
+		return(0);
+	}
+	
+	_parse_request(v);
+	
+	return(0);
+}
+
+static int _send_response(viewer_t *viewers, int i)
+{
+	viewer_t *v = &viewers[i];
+	int r;
+	
+	/* Send the rest of the HTTP response. Returns 0 when
+	 * complete, 1 if the socket is full, or -1 on error */
+	
+	while(v->response_offset < v->response_len)
+	{
+		r = send(v->sock, v->response + v->response_offset, v->response_len - v->response_offset, 0);
+		if(r < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK) return(1);
+			
+			perror("send");
+			return(-1);
+		}
+		
+		v->response_offset += r;
+	}
+	
+	return(0);
+}
+
+static int _check_lag(viewer_t *viewers, int i, int64_t timestamp)
+{
+	viewer_t *v = &viewers[i];
+	uint8_t *data;
+	int lost;
+	
+	/* Measure how far behind the output the viewer is. Returns
+	 * -1 if the viewer should be disconnected */
+	
+	/* Already waiting to skip ahead */
+	if(v->resync) return(0);
+	
+	/* Has the viewer's position been overwritten? */
+	lost = (mx_read(_merger, v->seq, &data) < 0);
+	
+	if(_lag(v->seq, timestamp, &v->lag_packets, &v->lag_ms) == 0 && lost == 0) return(0);
+	
+	/* A partly sent packet can't be completed if it has been overwritten */
+	if(_lag_policy == LAG_DISCONNECT || (lost && v->offset > 0))
+	{
+		printf("Viewer %d is too far behind (%lld packets, %lld ms), disconnecting\n",
+			i, (long long) v->lag_packets, (long long) v->lag_ms);
+		return(-1);
+	}
+	
+	printf("Viewer %d is too far behind (%lld packets, %lld ms), skipping ahead\n",
+		i, (long long) v->lag_packets, (long long) v->lag_ms);
+	
+	/* Skip ahead once any partly sent packet is complete */
+	v->resync = 1;
+	v->skips++;
+	
+	return(0);
+}
+
+static int _send_data(viewer_t *v, int64_t timestamp)
+{
+	uint8_t *data;
+	int n, r;
+	
+	/* Send as much of the output as the viewer's socket will take.
+	 * Returns 1 if the socket is full, or -1 on error */
+	
+	while(1)
+	{
+		/* Skip ahead, only at the start of a packet */
+		if(v->resync && v->offset == 0)
+		{
+			v->seq = _skip_seq(v->seq, _timestamp_us());
+			v->resync = 0;
+		}
+		
+		/* Fetch the next block of contiguous output, or of the segment */
+		if(v->state == VIEWER_SEGMENT)
+		{
+			n = hls_read(&_hls, v->seq, v->end, &data);
+		}
+		else
+		{
+			n = mx_read(_merger, v->seq, &data);
+		}
+		
+		if(n < 0) return(-1);
+		if(n == 0) return(0);
+		
+		r = send(v->sock, data + v->offset, n * TS_PACKET_SIZE - v->offset, 0);
+		if(r < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				/* The socket is busy, try again in the next loop */
+				return(1);
+			}
+			
+			/* An error has occured */
+			perror("send");
+			return(-1);
+		}
+		
+		/* The main thread may have overwritten the block while it was
+		 * being sent. The viewer has been sent corrupt data, so drop it */
+		if(v->state != VIEWER_SEGMENT &&
+		   mx_seq(_merger) + 1 - v->seq > _OUTPUT_PACKETS)
+		{
+			return(-1);
+		}
+		
+		/* Update viewer state. Partial sends are continued next time */
+		r += v->offset;
+		v->seq += r / TS_PACKET_SIZE;
+		v->offset = r % TS_PACKET_SIZE;
+		v->timestamp = timestamp;
+		
+		_trace_sent(v, v->seq - r / TS_PACKET_SIZE, timestamp);
+	}
+}
+
+static int _send_filtered(viewer_t *v, int64_t timestamp)
+{
+	struct iovec iov[_FILTER_IOV];
+	uint64_t first[_FILTER_IOV];
+	uint8_t psi[TS_PACKET_SIZE];
+	filter_t saved;
+	mx_output_t *o;
+	uint8_t *data, *p, *psi_p;
+	uint64_t seq, psi_seq;
+	int n, k, j, r, iovs;
+	
+	/* Send the viewer's PIDs from the output, with the PAT and PMT
+	 * rewritten to match. Each block of output is gathered into a
+	 * single writev(), joining runs of packets that are sent. Returns
+	 * 1 if the socket is full, or -1 on error */
+	
+	while(1)
+	{
+		/* Finish a partly sent PAT or PMT from the copy that was sent */
+		if(v->partial_psi)
+		{
+			r = send(v->sock, v->partial + v->offset, TS_PACKET_SIZE - v->offset, 0);
+			if(r < 0)
+			{
+				if(errno == EAGAIN || errno == EWOULDBLOCK)
+				{
+					/* The socket is busy, try again in the next loop */
+					return(1);
+				}
+				
+				/* An error has occured */
+				perror("send");
+				return(-1);
+			}
+			
+			v->offset += r;
+			v->timestamp = timestamp;
+			
+			if(v->offset < TS_PACKET_SIZE) return(1);
+			
+			v->seq++;
+			v->offset = 0;
+			v->partial_psi = 0;
+		}
+		
+		/* Skip ahead, only at the start of a packet */
+		if(v->resync && v->offset == 0)
+		{
+			v->seq = _skip_seq(v->seq, _timestamp_us());
+			v->resync = 0;
+		}
+		
+		n = mx_read(_merger, v->seq, &data);
+		if(n < 0) return(-1);
+		if(n == 0) return(0);
+		
+		iovs = 0;
+		psi_seq = UINT64_MAX;
+		psi_p = NULL;
+		
+		for(k = 0; k < n && iovs < _FILTER_IOV; k++)
+		{
+			o = mx_info(_merger, v->seq + k);
+			if(o == NULL) return(-1);
+			
+			p = data + k * TS_PACKET_SIZE;
+			
+			/* A PAT or PMT changes the filter for the packets after it,
+			 * so it ends the block. The filter is wound back if the
+			 * send doesn't reach it */
+			if(filter_psi(v->filter, o->pid))
+			{
+				memcpy(&saved, v->filter, sizeof(filter_t));
+				psi_seq = v->seq + k;
+				n = k + 1;
+			}
+			
+			switch(filter_packet(v->filter, o->pid, p, psi))
+			{
+			case FILTER_DROP:
+				continue;
+			
+			case FILTER_REWRITE:
+				p = psi_p = psi;
+				break;
+			
+			default:
+				if(psi_seq == v->seq + k) psi_p = p;
+				
+				/* Extend the last run of output packets */
+				if(iovs > 0 && (uint8_t *) iov[iovs - 1].iov_base + iov[iovs - 1].iov_len == p)
+				{
+					iov[iovs - 1].iov_len += TS_PACKET_SIZE;
+					continue;
+				}
+			}
+			
+			iov[iovs].iov_base = p;
+			iov[iovs].iov_len = TS_PACKET_SIZE;
+			first[iovs++] = v->seq + k;
+		}
+		
+		seq = v->seq;
+		
+		/* Nothing in this block is for the viewer */
+		if(iovs == 0)
+		{
+			v->seq += k;
+			v->timestamp = timestamp;
+			continue;
+		}
+		
+		/* A partly sent packet is always the first one kept */
+		iov[0].iov_base = (uint8_t *) iov[0].iov_base + v->offset;
+		iov[0].iov_len -= v->offset;
+		
+		r = writev(v->sock, iov, iovs);
+		if(r < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				/* The socket is busy, try again in the next loop. The
+				 * PAT or PMT will be filtered again */
+				if(psi_seq != UINT64_MAX) memcpy(v->filter, &saved, sizeof(filter_t));
+				return(1);
+			}
+			
+			/* An error has occured */
+			perror("writev");
+			return(-1);
+		}
+		
+		/* As with _send_data(), the block may have been overwritten */
+		if(mx_seq(_merger) + 1 - seq > _OUTPUT_PACKETS) return(-1);
+		
+		/* Find where the send stopped. Partial sends are continued next time */
+		for(j = 0; j < iovs && r >= iov[j].iov_len; j++)
+		{
+			r -= iov[j].iov_len;
+		}
+		
+		if(j == iovs)
+		{
+			v->seq += k;
+			v->offset = 0;
+		}
+		else
+		{
+			if(j == 0) r += v->offset;
+			v->seq = first[j] + r / TS_PACKET_SIZE;
+			v->offset = r % TS_PACKET_SIZE;
+		}
+		
+		/* Keep the filter changes only if the PAT or PMT was sent, or
+		 * dropped. If it was partly sent the rest comes from a copy */
+		if(psi_seq != UINT64_MAX && v->seq <= psi_seq)
+		{
+			if(v->seq == psi_seq && v->offset > 0)
+			{
+				memcpy(v->partial, psi_p, TS_PACKET_SIZE);
+				v->partial_psi = 1;
+			}
+			else
+			{
+				memcpy(v->filter, &saved, sizeof(filter_t));
+			}
+		}
+		
+		v->timestamp = timestamp;
+		
+		_trace_sent(v, seq, timestamp);
+		
+		if(j < iovs) return(1);
+	}
+}
+
+static int _send_viewer(viewer_t *viewers, int i, int64_t timestamp)
+{
+	viewer_t *v = &viewers[i];
+	int r;
+	
+	/* Filtered viewers are always sent to directly */
+	if(v->filter != NULL)
+	{
+		return(_send_filtered(v, timestamp));
+	}
+	
+	if(v->uring)
+	{
+		return(_uring_send_viewer(viewers, i));
+	}
+	
+	if(v->state != VIEWER_SEGMENT)
+	{
+		return(_send_data(v, timestamp));
+	}
+	
+	/* The main thread may be updating the segment store */
+	pthread_mutex_lock(&_hls_lock);
+	r = _send_data(v, timestamp);
+	pthread_mutex_unlock(&_hls_lock);
+	
+	return(r);
+}
+
+static int _service_viewer(viewer_t *viewers, int i, int64_t timestamp, short revents)
+{
+	viewer_t *v = &viewers[i];
+	char buf[256];
+	int r;
+	
+	/* Handle any input and send what we can to a viewer. Returns -1
+	 * if the connection should be closed, 1 if waiting for the socket
+	 * to become writable, or 0 otherwise */
+	
+	/* Has the client sent us data, or closed the socket? */
+	if(revents & (POLLIN | POLLERR | POLLHUP))
+	{
+		if(v->state == VIEWER_REQUEST)
+		{
+			/* Read the HTTP request */
+			if(_read_request(viewers, i) < 0) return(-1);
+		}
+		else if(v->http)
+		{
+			/* Anything after the request is ignored */
+			r = recv(v->sock, buf, sizeof(buf), 0);
+			if(r == 0) return(-1);
+			if(r < 0 && errno != EAGAIN && errno != EWOULDBLOCK) return(-1);
+		}
+		else
+		{
+			/* The client has sent us data, or closed the socket */
+			/* Either way, close the socket on this end */
+			return(-1);
+		}
+	}
+	
+	if(v->state == VIEWER_REQUEST)
+	{
+		/* Give up on clients that don't send a complete request */
+		if(timestamp - v->timestamp > MX_MS(_HTTP_REQUEST_TIMEOUT)) return(-1);
+		
+		return(0);
+	}
+	
+	/* Test if the client has timed out */
+	if(timestamp - v->timestamp > MX_MS(_VIEWER_TIMEOUT))
+	{
+		//send(v->sock, "TIMEOUT\n", 8, 0);
+		return(-1);
+	}
+	
+	/* Send any HTTP response */
+	if(v->state == VIEWER_RESPONSE)
+	{
+		r = _send_response(viewers, i);
+		if(r != 0) return(r);
+		
+		v->state = v->next;
+		v->timestamp = timestamp;
+	}
+	
+	if(v->state == VIEWER_CLOSE) return(-1);
+	
+	/* Output still held by the kernel is not skipped over, whatever the lag policy */
+	if(v->uring && _uring_overrun(v))
+	{
+		printf("Viewer %d is too far behind with sends in flight, disconnecting\n", i);
+		return(-1);
+	}
+	
+	/* Apply the lag policy */
+	if(v->state == VIEWER_STREAM && _check_lag(viewers, i, timestamp) != 0) return(-1);
+	
+	/* See if there is any data still to send to this viewer */
+	r = _send_viewer(viewers, i, timestamp);
+	
+	/* Close once the whole segment has been sent, and acknowledged
+	 * if it was sent with zero-copy */
+	if(v->state == VIEWER_SEGMENT && v->seq == v->end && v->notifs == 0) return(-1);
+	
+	return(r);
+}
+
+static int _service_viewers(viewer_t *viewers, struct pollfd *fds, int64_t timestamp)
+{
+	int i, r, closed = 0;
+	
+	/* Service each viewer, with its poll entry in fds[i].
+	 * Returns the number of viewers closed */
+	
+	for(i = 0; i < _VIEWERS; i++)
+	{
+		if(viewers[i].sock <= 0) continue;
+		
+		r = _service_viewer(viewers, i, timestamp, fds[i].revents);
+		if(r < 0)
+		{
+			_close_connection(viewers, fds, i);
+			closed++;
+			continue;
+		}
+		
+		/* Update the viewer entry in the fds array */
+		fds[i].fd = viewers[i].sock;
+		fds[i].events = POLLIN | (r > 0 ? POLLOUT : 0);
+	}
+	
+	return(closed);
+}
+
+static void _print_viewer_stats(viewer_t *viewers, int base)
+{
+	char name[64];
+	int i;
+	
+	for(i = 0; i < _VIEWERS; i++)
+	{
+		if(viewers[i].sock <= 0) continue;
+		
+		printf("Viewer %d: %lld packets, %lld ms behind, skipped ahead %d times\n",
+			base + i,
+			(long long) viewers[i].lag_packets,
+			(long long) viewers[i].lag_ms,
+			viewers[i].skips
+		);
+		
+		if(_latency && viewers[i].state == VIEWER_STREAM)
+		{
+			snprintf(name, sizeof(name), "Viewer %d latency from arrival to send", base + i);
+			hist_print(&viewers[i].latency, name);
+			hist_reset(&viewers[i].latency);
+		}
+	}
+}
+
+static void _worker_pipe(_worker_t *w, int64_t timestamp)
+{
+	int msg, sock;
+	
+	/* Take any new viewers from the main thread. Other
+	 * messages only wake the thread for new output */
+	while(read(w->pipe[0], &msg, sizeof(msg)) == sizeof(msg))
+	{
+		if(msg < 0) continue;
+		
+		sock = msg >> 1;
+		
+		if(_add_viewer(w->viewers, &w->fds[1], sock, msg & 1, timestamp, 0) != 0)
+		{
+			close(sock);
+			__atomic_sub_fetch(&w->viewers_count, 1, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static void *_worker_thread(void *arg)
+{
+	_worker_t *w = arg;
+	int64_t timestamp;
+	int64_t next_stats = 0;
+	uint64_t seq = 0;
+	char name[64];
+	int i, r;
+	
+	/* The viewer thread loop. It sleeps in poll() until a viewer
+	 * socket is ready or the main thread adds to the output */
+	while(!_quit)
+	{
+		/* Announce the sleep before checking for new output, so an
+		 * update is either seen here or followed by a wake up */
+		__atomic_store_n(&w->waiting, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		
+		r = poll(w->fds, 1 + _VIEWERS, mx_seq(_merger) != seq ? 0 : _WORKER_POLL_MS);
+		
+		__atomic_store_n(&w->waiting, 0, __ATOMIC_RELAXED);
+		
+		if(r < 0)
+		{
+			if(errno == EINTR) continue;
+			
+			perror("poll");
+			break;
+		}
+		
+		timestamp = _timestamp_us();
+		seq = mx_seq(_merger);
+		
+		if(w->fds[0].revents != 0)
+		{
+			_worker_pipe(w, timestamp);
+		}
+		
+		r = _service_viewers(w->viewers, &w->fds[1], timestamp);
+		if(r > 0) __atomic_sub_fetch(&w->viewers_count, r, __ATOMIC_RELAXED);
+		
+		if(timestamp >= next_stats)
+		{
+			if(next_stats != 0)
+			{
+				_print_viewer_stats(w->viewers, w->index * _VIEWERS);
+				
+				if(_latency)
+				{
+					snprintf(name, sizeof(name), "Thread %d latency from output to first send", w->index);
+					hist_print(&_first_send_latency, name);
+					hist_reset(&_first_send_latency);
+				}
+			}
+			
+			next_stats = timestamp + MX_MS(_STATS_INTERVAL);
+		}
+	}
+	
+	for(i = 0; i < _VIEWERS; i++)
+	{
+		if(w->viewers[i].sock > 0)
+		{
+			close(w->viewers[i].sock);
+		}
+	}
+	
+	return(NULL);
+}
+
+static void _wake_workers(void)
+{
+	int i, msg = -1;
+	
+	/* Wake the viewer threads that are waiting for new output.
+	 * A full pipe means the thread has a wake up pending already */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	
+	for(i = 0; i < _workers; i++)
+	{
+		if(__atomic_exchange_n(&_worker[i].waiting, 0, __ATOMIC_RELAXED) == 0) continue;
+		
+		if(write(_worker[i].pipe[1], &msg, sizeof(msg)) < 0 && errno != EAGAIN)
+		{
+			perror("write");
+		}
+	}
+}
+
+static int _start_workers(void)
+{
+	_worker_t *w;
+	sigset_t set, old;
+	int i, j;
+	
+	_worker = calloc(_workers, sizeof(_worker_t));
+	if(_worker == NULL)
+	{
+		perror("calloc");
+		return(-1);
+	}
+	
+	/* SIGINT and SIGTERM are left to the main thread */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	
+	for(i = 0; i < _workers; i++)
+	{
+		w = &_worker[i];
+		w->index = i;
+		
+		if(pipe2(w->pipe, O_NONBLOCK) != 0)
+		{
+			perror("pipe2");
+			break;
+		}
+		
+		w->fds[0].fd = w->pipe[0];
+		w->fds[0].events = POLLIN;
+		
+		for(j = 1; j <= _VIEWERS; j++)
+		{
+			w->fds[j].fd = -1;
+			w->fds[j].events = 0;
+		}
+		
+		if(pthread_create(&w->thread, NULL, _worker_thread, w) != 0)
+		{
+			fprintf(stderr, "Error starting viewer thread %d\n", i);
+			close(w->pipe[0]);
+			close(w->pipe[1]);
+			break;
+		}
+	}
+	
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	
+	/* Carry on with the threads that did start */
+	_workers = i;
+	
+	return(i > 0 ? 0 : -1);
+}
+
+static void _stop_workers(void)
+{
+	int i;
+	
+	_quit = 1;
+	_wake_workers();
+	
+	for(i = 0; i < _workers; i++)
+	{
+		pthread_join(_worker[i].thread, NULL);
+		close(_worker[i].pipe[0]);
+		close(_worker[i].pipe[1]);
+	}
+	
+	free(_worker);
+}
+
+static int _open_timer(void)
+{
+	int fd;
+	
+	/* The main loop sleeps on this timer until the merger's
+	 * next deadline, when it is not woken sooner by a socket */
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if(fd < 0)
+	{
+		perror("timerfd_create");
+		return(-1);
+	}
+	
+	return(fd);
+}
+
+static void _set_timer(int fd, int64_t deadline)
+{
+	static int64_t armed = INT64_MAX;
+	struct itimerspec its;
+	uint64_t expired;
+	int64_t t;
+	
+	/* Clear the timer if it has fired */
+	if(read(fd, &expired, sizeof(expired)) == sizeof(expired))
+	{
+		armed = INT64_MAX;
+	}
+	
+	if(deadline == armed) return;
+	
+	/* Arm the timer for deadline, or disarm it for INT64_MAX.
+	 * A deadline already passed fires straight away */
+	memset(&its, 0, sizeof(its));
+	
+	if(deadline != INT64_MAX)
+	{
+		t = deadline - _clock_offset;
+		if(t < 1) t = 1;
+		
+		its.it_value.tv_sec = t / 1000000;
+		its.it_value.tv_nsec = (t % 1000000) * 1000;
+	}
+	
+	if(timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL) != 0)
+	{
+		perror("timerfd_settime");
+		return;
+	}
+	
+	armed = deadline;
+}
+
+static void _print_usage(void)
+{
+	printf(
+		"\n"
+		"Usage: tsmerge [options]\n"
+		"\n"
+		"  -H, --http-port <number>\n"
+		"                         TCP port for HTTP viewers (GET /stream.ts).\n"
+		"                         0 disables HTTP. Default: %d\n"
+		"      --hls <seconds>    Enable HLS (GET /stream.m3u8) with the given\n"
+		"                         target segment duration.\n"
+		"      --hls-memory <MB>  Memory used to store HLS segments. Default: %d\n"
+		"  -l, --lag-policy <skip|disconnect>\n"
+		"                         What to do with a viewer that falls too far behind.\n"
+		"                         skip jumps ahead to the latest random access point.\n"
+		"                         io_uring viewers with sends still in flight are\n"
+		"                         disconnected at half the output buffer.\n"
+		"                         Default: skip\n"
+		"  -L, --max-lag <ms>     Maximum viewer lag in ms. Default: %d\n"
+		"      --max-lag-packets <number>\n"
+		"                         Maximum viewer lag in packets. Default: %d\n"
+		"      --retention <ms>   Time each station buffer should hold, at the\n"
+		"                         station's measured rate. Default: %d\n"
+		"      --buffer-memory <MB>\n"
+		"                         Memory budget for all station buffers. Default: %d\n"
+		"      --dedup            Store packets received from more than one station\n"
+		"                         once, shared between the station buffers.\n"
+		"      --state <file>     Keep the merger state in a file, and resume from\n"
+		"                         it on restart.\n"
+		"      --ingest <number>  Receive on this many UDP sockets sharing the port.\n"
+		"                         Default: 1, at most %d\n"
+		"      --ingest-hash <address|kernel>\n"
+		"                         How stations are spread over the sockets, by\n"
+		"                         their source address, or by the kernel's hash\n"
+		"                         of the address and port. Default: address\n"
+		"      --io <poll|uring>  I/O backend. uring falls back to poll if io_uring\n"
+		"                         is not available. Default: poll\n"
+		"      --latency          Trace packet latency, and print percentiles\n"
+		"                         with the statistics.\n"
+		"      --workers <number> Serve viewers from this many threads, leaving\n"
+		"                         the main thread to receive and merge. Each\n"
+		"                         thread takes up to %d viewers. Default: 0\n"
+		"      --record <file>    Record the output to a file, or - for stdout.\n"
+		"                         The name is passed through strftime().\n"
+		"      --record-direct    Write the recording with O_DIRECT, bypassing\n"
+		"                         the page cache.\n"
+		"      --record-size <MB> Start a new file after this many MB. Default: 0\n"
+		"      --record-time <seconds>\n"
+		"                         Start a new file after this many seconds.\n"
+		"                         Default: 0\n"
+		"      --cbr <bits/s>     Send the output at a constant bitrate, stuffed\n"
+		"                         with null packets and with the PCR restamped.\n"
+		"      --cbr-output <host:port|file|->\n"
+		"                         Where the constant bitrate output goes, UDP\n"
+		"                         to host:port, a file, or - for stdout.\n"
+		"\n",
+		_HTTP_PORT,
+		_HLS_MEMORY,
+		_MAX_LAG_MS,
+		_MAX_LAG_PACKETS,
+		MX_RETENTION_MS,
+		MX_BUFFER_MB,
+		_MAX_INGEST,
+		_VIEWERS
+	);
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+	int opt;
+	int i, r;
+	int64_t timestamp;
+	int64_t next_stats = 0;
+	int64_t deadline = 0;
+	uint64_t seq;
+	int http_port = _HTTP_PORT;
+	int hls_duration = 0;
+	int hls_memory = _HLS_MEMORY;
+	const char *state = NULL;
+	int retention = MX_RETENTION_MS;
+	int buffer_mb = MX_BUFFER_MB;
+	int dedup = 0;
+	const char *record = NULL;
+	int record_direct = 0;
+	int record_size = 0;
+	int record_time = 0;
+	int64_t cbr_bitrate = 0;
+	int exit_code = 0;
+	const char *cbr_output = NULL;
+	
+	static const struct option long_options[] = {
+		{ "http-port",       required_argument, 0, 'H' },
+		{ "lag-policy",      required_argument, 0, 'l' },
+		{ "max-lag",         required_argument, 0, 'L' },
+		{ "max-lag-packets", required_argument, 0, 'K' },
+		{ "hls",             required_argument, 0, 'S' },
+		{ "hls-memory",      required_argument, 0, 'M' },
+		{ "io",              required_argument, 0, 'I' },
+		{ "state",           required_argument, 0, 'F' },
+		{ "retention",       required_argument, 0, 'R' },
+		{ "buffer-memory",   required_argument, 0, 'B' },
+		{ "dedup",           no_argument,       0, 'U' },
+		{ "latency",         no_argument,       0, 'T' },
+		{ "workers",         required_argument, 0, 'W' },
+		{ "ingest",          required_argument, 0, 'N' },
+		{ "ingest-hash",     required_argument, 0, 'A' },
+		{ "record",          required_argument, 0, 'O' },
+		{ "record-direct",   no_argument,       0, 'D' },
+		{ "record-size",     required_argument, 0, 'Z' },
+		{ "record-time",     required_argument, 0, 'Y' },
+		{ "cbr",             required_argument, 0, 'C' },
+		{ "cbr-output",      required_argument, 0, 'P' },
+		{ 0,                 0,                 0,  0  }
+	};
+	
+	opterr = 0;
+	while((c = getopt_long(argc, argv, "H:l:L:", long_options, &opt)) != -1)
+	{
+		switch(c)
+		{
+		case 'H': /* --http-port <number> */
+			http_port = atoi(optarg);
+			break;
+		
+		case 'l': /* --lag-policy <skip|disconnect> */
+			if(strcmp(optarg, "skip") == 0)
+			{
+				_lag_policy = LAG_SKIP;
+			}
+			else if(strcmp(optarg, "disconnect") == 0)
+			{
+				_lag_policy = LAG_DISCONNECT;
+			}
+			else
+			{
+				printf("Error: Unrecognised lag policy '%s'\n", optarg);
+				_print_usage();
+				return(-1);
+			}
+			
+			break;
+		
+		case 'L': /* --max-lag <ms> */
+			_max_lag_ms = atoll(optarg);
+			break;
+		
+		case 'K': /* --max-lag-packets <number> */
+			_max_lag_packets = atoll(optarg);
+			break;
+		
+		case 'S': /* --hls <seconds> */
+			hls_duration = atoi(optarg);
+			break;
+		
+		case 'M': /* --hls-memory <MB> */
+			hls_memory = atoi(optarg);
+			break;
+		
+		case 'F': /* --state <file> */
+			state = optarg;
+			break;
+		
+		case 'R': /* --retention <ms> */
+			retention = atoi(optarg);
+			break;
+		
+		case 'B': /* --buffer-memory <MB> */
+			buffer_mb = atoi(optarg);
+			break;
+		
+		case 'U': /* --dedup */
+			dedup = 1;
+			break;
+		
+		case 'T': /* --latency */
+			_latency = 1;
+			break;
+		
+		case 'W': /* --workers <number> */
+			_workers = atoi(optarg);
+			
+			if(_workers < 0 || _workers > _MAX_WORKERS)
+			{
+				printf("Error: Between 0 and %d viewer threads can be used\n", _MAX_WORKERS);
+				return(-1);
 			}
 			
-			/* Clear the viewer entry in the fds array */
-			_fds[2 + i].fd = _viewers[i].sock;
-			_fds[2 + i].events = POLLIN;
+			break;
+		
+		case 'N': /* --ingest <number> */
+			_ingest_count = atoi(optarg);
 			
-			/* See if there is any data still to send to this viewer */
-			while((p = mx_next(&_merger, _viewers[i].last_station, _viewers[i].last_counter)) != NULL)
+			if(_ingest_count < 1 || _ingest_count > _MAX_INGEST)
 			{
-				/* Try to send the new data to the viewer */
-				r = send(_viewers[i].sock, p->raw, TS_PACKET_SIZE, 0);
-				if(r < 0)
-				{
-					if(errno == EAGAIN || errno == EWOULDBLOCK)
-					{
-						/* The socket is busy, try again in the next loop */
-						_fds[2 + i].events |= POLLOUT;
-						break;
-					}
-					
-					/* An error has occured. Drop the connection */
-					perror("send");
-					_close_connection(_viewers, i);
-					break;
-				}
+				printf("Error: Between 1 and %d ingest sockets can be used\n", _MAX_INGEST);
+				return(-1);
+			}
+			
+			break;
+		
+		case 'A': /* --ingest-hash <address|kernel> */
+			if(strcmp(optarg, "address") == 0)
+			{
+				_ingest_hash = INGEST_HASH_ADDRESS;
+			}
+			else if(strcmp(optarg, "kernel") == 0)
+			{
+				_ingest_hash = INGEST_HASH_KERNEL;
+			}
+			else
+			{
+				printf("Error: Unrecognised ingest hash '%s'\n", optarg);
+				_print_usage();
+				return(-1);
+			}
+			
+			break;
+		
+		case 'O': /* --record <file> */
+			record = optarg;
+			break;
+		
+		case 'D': /* --record-direct */
+			record_direct = 1;
+			break;
+		
+		case 'Z': /* --record-size <MB> */
+			record_size = atoi(optarg);
+			break;
+		
+		case 'Y': /* --record-time <seconds> */
+			record_time = atoi(optarg);
+			break;
+		
+		case 'C': /* --cbr <bits/s> */
+			cbr_bitrate = atoll(optarg);
+			
+			if(cbr_bitrate < TS_PACKET_SIZE * 8)
+			{
+				printf("Error: The CBR output needs at least %d bits/s\n", TS_PACKET_SIZE * 8);
+				return(-1);
+			}
+			
+			break;
+		
+		case 'P': /* --cbr-output <host:port|file|-> */
+			cbr_output = optarg;
+			break;
+		
+		case 'I': /* --io <poll|uring> */
+			if(strcmp(optarg, "poll") == 0)
+			{
+				_io = IO_POLL;
+			}
+			else if(strcmp(optarg, "uring") == 0)
+			{
+				_io = IO_URING;
+			}
+			else
+			{
+				printf("Error: Unrecognised I/O backend '%s'\n", optarg);
+				_print_usage();
+				return(-1);
+			}
+			
+			break;
+		
+		case '?':
+			_print_usage();
+			return(0);
+		}
+	}
+	
+	if((cbr_bitrate > 0) != (cbr_output != NULL))
+	{
+		printf("Error: --cbr and --cbr-output must be used together\n");
+		return(-1);
+	}
+	
+	if(record != NULL && cbr_output != NULL &&
+	   strcmp(record, "-") == 0 && strcmp(cbr_output, "-") == 0)
+	{
+		printf("Error: The recording and the CBR output can't both go to stdout\n");
+		return(-1);
+	}
+	
+	/* Start the timebase at the current unix time */
+	_clock_offset = _clock_us(CLOCK_REALTIME) - _clock_us(CLOCK_MONOTONIC);
+	
+	/* Initialise the merger */
+	/* In my example file, PID 256 contains the PCR clock */
+	_merger = mx_open(state, 256, buffer_mb);
+	if(_merger == NULL)
+	{
+		return(-1);
+	}
+	
+	mx_set_buffers(_merger, retention, buffer_mb);
+	mx_set_dedup(_merger, dedup);
+	
+	/* Latency is traced from the current output position, which
+	 * is not 0 when resuming from a state file */
+	_traced_seq = mx_seq(_merger);
+	_first_sent_seq = mx_seq(_merger);
+	
+	/* HLS segments are cut from the merged output */
+	if(hls_duration > 0)
+	{
+		if(http_port <= 0 || hls_memory <= 0)
+		{
+			printf("Error: HLS requires HTTP and some memory for segments\n");
+			return(-1);
+		}
+		
+		if(hls_init(&_hls, _merger, hls_duration, hls_memory) != 0)
+		{
+			return(-1);
+		}
+		
+		_hls_enabled = 1;
+	}
+	
+	/* Prepare the network - ignore SIGPIPE on viewer disconnection */
+	signal(SIGPIPE, SIG_IGN);
+	
+	/* Exit the main loop on SIGINT / SIGTERM, so the state is closed */
+	signal(SIGINT, _signal_quit);
+	signal(SIGTERM, _signal_quit);
+	
+	/* The first _FDS_VIEWERS entries in the fds array are for the listening sockets */
+	memset(&_fds, 0, sizeof(_fds));
+	
+	for(i = 0; i < _NFDS; i++)
+	{
+		_fds[i].fd = -1;
+		_fds[i].events = 0;
+	}
+	
+	if(_open_ingest() != 0)
+	{
+		mx_close(_merger);
+		return(-1);
+	}
+	
+	_fds[_FDS_TCP].fd = _open_viewer_socket(_VIEWER_PORT);
+	_fds[_FDS_TCP].events = POLLIN;
+	
+	_fds[_FDS_HTTP].fd = (http_port > 0 ? _open_viewer_socket(http_port) : -1);
+	_fds[_FDS_HTTP].events = POLLIN;
+	
+	_fds[_FDS_TIMER].fd = _open_timer();
+	_fds[_FDS_TIMER].events = POLLIN;
+	
+	if(_fds[_FDS_TIMER].fd < 0)
+	{
+		mx_close(_merger);
+		return(-1);
+	}
+	
+	/* Clear the viewers array */
+	memset(&_viewers, 0, sizeof(_viewers));
+	
+	if(_io == IO_URING)
+	{
+		if(_open_uring() == 0)
+		{
+			printf("Using io_uring\n");
+		}
+		else
+		{
+			printf("io_uring is not available, using poll\n");
+			_io = IO_POLL;
+		}
+	}
+	
+	if(_workers > 0)
+	{
+		if(_start_workers() != 0)
+		{
+			printf("Unable to start viewer threads\n");
+			mx_close(_merger);
+			return(-1);
+		}
+		
+		printf("Serving viewers from %d threads\n", _workers);
+	}
+	
+	/* A failure here skips the main loop, to shut down
+	 * the workers and close the state as on exit */
+	if(record != NULL)
+	{
+		if(rec_open(&_rec, _merger, record, record_direct, record_size, record_time) != 0)
+		{
+			printf("Unable to start recording\n");
+			exit_code = -1;
+			_quit = 1;
+		}
+		else _recording = 1;
+	}
+	
+	if(cbr_output != NULL && !_quit)
+	{
+		if(cbr_open(&_cbr, _merger, cbr_bitrate, cbr_output) != 0)
+		{
+			printf("Unable to start the CBR output\n");
+			exit_code = -1;
+			_quit = 1;
+		}
+		else _cbr_enabled = 1;
+	}
+	
+	/* The main network loop */
+	while(!_quit)
+	{
+		/* Wait for network activity or the timer, or _IDLE_MS */
+		if(_io == IO_URING)
+		{
+			if(_uring_wait(_IDLE_MS) < 0) break;
+		}
+		else
+		{
+			i = poll(_fds, _NFDS, _IDLE_MS);
+			if(i < 0)
+			{
+				if(errno == EINTR) continue;
 				
-				if(r != TS_PACKET_SIZE)
-				{
-					/* TODO: I don't know if send() can return 0 or a partial amount */
-					printf("Got an odd result from send(): %d\n", TS_PACKET_SIZE);
-				}
+				perror("poll");
+				break;
+			}
+		}
+		
+		timestamp = _timestamp_us();
+		
+		/* Incoming UDP packets? */
+		for(i = 0, r = 0; i < _ingest_count && r == 0; i++)
+		{
+			if(_fds[i].revents == 0) continue;
+			
+			r = _incoming_packet(&_fds[i], i, timestamp, _merger);
+		}
+		
+		if(r < 0) break;
+		
+		/* Request any packets missing from the stations */
+		_send_nacks(_fds[0].fd, timestamp, _merger);
+		
+		/* Print the station statistics */
+		if(timestamp >= next_stats)
+		{
+			if(next_stats != 0)
+			{
+				mx_print_stats(_merger);
+				_print_ingest_stats();
+				if(_latency) _print_latency();
+				_print_viewer_stats(_viewers, 0);
+				if(_recording) rec_print_stats(&_rec);
+				if(_cbr_enabled) cbr_print_stats(&_cbr);
 				
-				/* Update viewer state */
-				_viewers[i].last_station = p->station;
-				_viewers[i].last_counter = p->counter;
-				_viewers[i].timestamp = timestamp;
+				/* Checkpoint the state file, without waiting */
+				mx_sync(_merger);
+			}
+			
+			next_stats = timestamp + MX_MS(_STATS_INTERVAL);
+		}
+		
+		/* Incoming client connection? */
+		if(_fds[_FDS_TCP].revents != 0)
+		{
+			r = _accept_connection(&_fds[_FDS_TCP], timestamp, _viewers, 0);
+			if(r < 0) break;
+		}
+		
+		/* Incoming HTTP connection? */
+		if(_fds[_FDS_HTTP].revents != 0)
+		{
+			r = _accept_connection(&_fds[_FDS_HTTP], timestamp, _viewers, 1);
+			if(r < 0) break;
+		}
+		
+		/* New segments can only be ready once the merger's deadline
+		 * has passed. Incoming packets are still inside the guard */
+		if(timestamp >= deadline)
+		{
+			seq = mx_seq(_merger);
+			while(mx_update(_merger, timestamp) > 0);
+			
+			if(_latency) _trace_output();
+			
+			if(_hls_enabled)
+			{
+				pthread_mutex_lock(&_hls_lock);
+				hls_update(&_hls, _merger);
+				pthread_mutex_unlock(&_hls_lock);
 			}
 			
-			/* Test if the client has timed out */
-			if(_viewers[i].sock > 0 && timestamp - _viewers[i].timestamp > _VIEWER_TIMEOUT)
+			if(_workers > 0 && mx_seq(_merger) != seq)
 			{
-				//send(_viewers[i].sock, "TIMEOUT\n", 8, 0);
-				_close_connection(_viewers, i);
+				_wake_workers();
 			}
 		}
+		
+		/* Sleep until the next deadline, or the next statistics */
+		deadline = mx_next_deadline(_merger, timestamp);
+		_set_timer(_fds[_FDS_TIMER].fd, (deadline < next_stats ? deadline : next_stats));
+		
+		_service_viewers(_viewers, &_fds[_FDS_VIEWERS], timestamp);
 	}
 	
+	if(_workers > 0) _stop_workers();
+	if(_recording) rec_close(&_rec);
+	if(_cbr_enabled) cbr_close(&_cbr);
+	
 	/* Close any open sockets */
 	for(i = 0; i < _VIEWERS; i++)
 	{
@@ -407,9 +2865,15 @@ int main(int argc, char *argv[])
 		}
 	}
 	
-	close(_fds[1].fd);
-	close(_fds[0].fd);
+	if(_io == IO_URING) uring_free(&_uring);
 	
-	return(0);
+	for(i = 0; i < _FDS_VIEWERS; i++)
+	{
+		if(_fds[i].fd >= 0) close(_fds[i].fd);
+	}
+	
+	mx_close(_merger);
+	
+	return(exit_code);
 }
 
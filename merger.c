@@ -2,10 +2,416 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "merger.h"
+#include "psi.h"
+
+/* The SSE2 batch classifier is used where available, unless
+ * MX_SCALAR is defined to build the portable one instead */
+#if defined(__SSE2__) && !defined(MX_SCALAR)
+#define _CLASSIFY_SSE2
+#include <emmintrin.h>
+#endif
 
 #include <stdlib.h> /* testing only */
 
+/* Packet classification flags, set by _classify() */
+#define _BATCH_TS     0x01 /* A TS packet (0x55A1) */
+#define _BATCH_FEC    0x02 /* A parity packet (0x55A3 or 0x55A4) */
+#define _BATCH_SIMPLE 0x04 /* TS sync byte present and no adaptation field */
+#define _BATCH_RUN    0x08 /* Same callsign as the previous packet */
+
+typedef struct {
+	uint32_t counter[MX_BATCH];
+	uint8_t flags[MX_BATCH];
+} _batch_t;
+
+static mx_packet_t *_slot(mx_t *s, int station, uint32_t counter)
+{
+	mx_station_t *st = &s->station[station];
+	int b;
+	
+	/* Returns the buffer slot for a station packet,
+	 * or NULL if no block has been allocated for it */
+	if(st->size == 0) return(NULL);
+	
+	b = st->block[(counter & (st->size - 1)) / _BLOCK_PACKETS];
+	if(b == 0) return(NULL);
+	
+	return(&s->pool[b - 1][counter & (_BLOCK_PACKETS - 1)]);
+}
+
+static int _valid_slot(mx_t *s, int station, mx_packet_t *p, uint32_t counter)
+{
+	/* Epochs are unique across stations, so a slot left
+	 * over from another station or a reset never matches */
+	return(p != NULL && p->epoch == s->station[station].epoch && p->counter == counter);
+}
+
+static mx_packet_t *_alloc_slot(mx_t *s, int station, uint32_t counter)
+{
+	mx_station_t *st = &s->station[station];
+	int *b;
+	
+	/* As _slot(), but takes a block from the pool if needed.
+	 * Returns NULL if the pool is empty */
+	b = &st->block[(counter & (st->size - 1)) / _BLOCK_PACKETS];
+	
+	if(*b == 0)
+	{
+		if(s->pool_free_count == 0) return(NULL);
+		
+		*b = s->pool_free[--s->pool_free_count] + 1;
+		st->blocks++;
+	}
+	
+	return(&s->pool[*b - 1][counter & (_BLOCK_PACKETS - 1)]);
+}
+
+static uint32_t _payload_count(mx_t *s)
+{
+	/* The size of the payload store, one for each pool slot */
+	return((uint32_t) s->pool_blocks * _BLOCK_PACKETS);
+}
+
+static mx_payload_t *_data(mx_t *s, mx_packet_t *p)
+{
+	/* Returns the contents of a stored packet */
+	return(&s->payload[p->payload]);
+}
+
+static uint32_t _home(mx_t *s, mx_packet_t *p)
+{
+	/* The payload that belongs to a pool slot. Without dedup
+	 * each slot always keeps its packet there */
+	return((uint32_t) (p - &s->pool[0][0]) + 1);
+}
+
+static void _unref_payload(mx_t *s, mx_packet_t *p)
+{
+	mx_payload_t *d;
+	uint32_t *n;
+	
+	/* Drop a slot's reference to its payload. The last reference
+	 * returns the payload to the free list, if dedup is set */
+	if(p->payload == 0) return;
+	
+	d = &s->payload[p->payload];
+	s->payload_refs--;
+	
+	if(--d->refs == 0 && !s->dedup)
+	{
+		s->payloads--;
+	}
+	else if(d->refs == 0)
+	{
+		if(d->hashed)
+		{
+			n = &s->payload_bucket[d->hash & (s->payload_buckets - 1)];
+			while(*n != p->payload) n = &s->payload[*n].next;
+			*n = d->next;
+		}
+		
+		d->next = s->payload_free;
+		s->payload_free = p->payload;
+		s->payloads--;
+	}
+	
+	p->payload = 0;
+}
+
+static void _release_memory(void *ptr, size_t len)
+{
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = ((uintptr_t) ptr + page - 1) & ~(page - 1);
+	uintptr_t end = ((uintptr_t) ptr + len) & ~(page - 1);
+	
+	/* Give the whole pages in a block back to the system. MADV_REMOVE
+	 * frees file backed memory and MADV_DONTNEED anonymous memory.
+	 * Either way it reads back as zero, which is never a valid epoch */
+	if(end <= start) return;
+	
+	if(madvise((void *) start, end - start, MADV_REMOVE) != 0)
+	{
+		madvise((void *) start, end - start, MADV_DONTNEED);
+	}
+}
+
+static void _free_table(mx_t *s, int *table, int release)
+{
+	int i, j, b;
+	
+	/* Return the blocks in a block table to the pool, with the
+	 * references their slots hold. If release is set the memory
+	 * is also returned to the system */
+	for(i = 0; i < _STATION_BLOCKS; i++)
+	{
+		b = table[i] - 1;
+		if(b < 0) continue;
+		
+		for(j = 0; j < _BLOCK_PACKETS; j++)
+		{
+			_unref_payload(s, &s->pool[b][j]);
+		}
+		
+		if(release)
+		{
+			_release_memory(s->pool[b], sizeof(s->pool[b]));
+			
+			/* Without dedup the block's payloads go with it */
+			if(!s->dedup)
+			{
+				_release_memory(&s->payload[_home(s, &s->pool[b][0])], sizeof(mx_payload_t) * _BLOCK_PACKETS);
+			}
+		}
+		
+		s->pool_free[s->pool_free_count++] = b;
+		table[i] = 0;
+	}
+}
+
+static void _free_blocks(mx_t *s, int station, int release)
+{
+	_free_table(s, s->station[station].block, release);
+	s->station[station].blocks = 0;
+}
+
+static uint64_t _hash_packet(const uint8_t *raw)
+{
+	uint64_t h = 0, w;
+	int i;
+	
+	/* A fast hash of the whole packet, a multiply per 8 bytes */
+	for(i = 0; i < TS_PACKET_SIZE; i += 8)
+	{
+		w = 0;
+		memcpy(&w, &raw[i], (i + 8 <= TS_PACKET_SIZE ? 8 : TS_PACKET_SIZE - i));
+		
+		h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+		h ^= h >> 32;
+	}
+	
+	return(h);
+}
+
+static void _rehash_payloads(mx_t *s)
+{
+	mx_payload_t *d;
+	uint32_t n, *chain;
+	
+	/* Rebuild the free list and hash chains of the store from
+	 * the payload reference counts, with dedup set */
+	memset(s->payload_bucket, 0, sizeof(uint32_t) * s->payload_buckets);
+	s->payload_free = 0;
+	s->payloads = 0;
+	
+	for(n = s->payload_top; n > 0; n--)
+	{
+		d = &s->payload[n];
+		
+		if(d->refs == 0)
+		{
+			d->next = s->payload_free;
+			s->payload_free = n;
+			continue;
+		}
+		
+		d->hashed = 1;
+		d->hash = _hash_packet(d->raw);
+		
+		chain = &s->payload_bucket[d->hash & (s->payload_buckets - 1)];
+		d->next = *chain;
+		*chain = n;
+		
+		s->payloads++;
+	}
+}
+
+static void _compact_payloads(mx_t *s)
+{
+	mx_packet_t *p;
+	uint32_t n, top;
+	int i, j, b;
+	
+	/* With dedup set payloads are taken from anywhere in the store,
+	 * so their memory isn't returned with the pool blocks. Once most
+	 * of the store is free, the payloads in use are moved down to
+	 * the start of it and the rest is returned to the system */
+	if(s->payload_top - s->payloads < _BLOCK_PACKETS ||
+	   s->payloads > s->payload_top / 2) return;
+	
+	/* Number the payloads in use from 1, in their order in the store */
+	for(n = 1, top = 0; n <= s->payload_top; n++)
+	{
+		if(s->payload[n].refs > 0) s->payload[n].next = ++top;
+	}
+	
+	/* Point the slots at the new numbers. Only blocks in
+	 * a station's table have slots holding references */
+	for(i = 0; i < _STATIONS; i++)
+	{
+		for(j = 0; j < _STATION_BLOCKS; j++)
+		{
+			b = s->station[i].block[j] - 1;
+			if(b < 0) continue;
+			
+			for(p = s->pool[b]; p < s->pool[b] + _BLOCK_PACKETS; p++)
+			{
+				if(p->payload != 0) p->payload = _data(s, p)->next;
+			}
+		}
+	}
+	
+	/* Move the payloads down. Each only moves to the same place or
+	 * lower, over one already moved or free */
+	for(n = 1; n <= s->payload_top; n++)
+	{
+		if(s->payload[n].refs == 0 || s->payload[n].next == n) continue;
+		
+		memcpy(&s->payload[s->payload[n].next], &s->payload[n], sizeof(mx_payload_t));
+	}
+	
+	_release_memory(&s->payload[top + 1], sizeof(mx_payload_t) * (s->payload_top - top));
+	s->payload_top = top;
+	
+	_rehash_payloads(s);
+}
+
+static int _reserved_blocks(mx_t *s, int except)
+{
+	int i, n = 0;
+	
+	/* The number of blocks the active stations' buffers may use */
+	for(i = 0; i < _STATIONS; i++)
+	{
+		if(i == except) continue;
+		if(s->station[i].sid[0] == '\0') continue;
+		if(s->station[i].timestamp <= s->timestamp - MX_MS(_TIMEOUT_MS)) continue;
+		
+		n += s->station[i].size / _BLOCK_PACKETS;
+	}
+	
+	return(n);
+}
+
+static uint32_t _fit_size(mx_t *s, int station, uint32_t packets)
+{
+	int avail;
+	
+	/* Reduce a buffer size until it fits in the memory budget. It
+	 * never goes below _MIN_PACKETS, the pool itself is the hard limit */
+	avail = s->budget_blocks - _reserved_blocks(s, station);
+	
+	while(packets > _MIN_PACKETS && (int) (packets / _BLOCK_PACKETS) > avail)
+	{
+		packets >>= 1;
+	}
+	
+	return(packets);
+}
+
+static void _resize_station(mx_t *s, int station, uint32_t packets)
+{
+	mx_station_t *st = &s->station[station];
+	int old[_STATION_BLOCKS];
+	uint32_t old_size, counter, first;
+	int old_blocks, b;
+	mx_packet_t *p, *q;
+	
+	/* Move the station to a buffer of a new size. Packets from the
+	 * last one output onwards are copied, the others are not needed */
+	first = st->current - 1;
+	
+	/* The buffer can't shrink below the packets still waiting */
+	if(st->latest - first >= packets) return;
+	
+	memcpy(old, st->block, sizeof(old));
+	old_size = st->size;
+	old_blocks = st->blocks;
+	
+	memset(st->block, 0, sizeof(st->block));
+	st->size = packets;
+	st->blocks = 0;
+	
+	for(counter = first; counter != st->latest + 1; counter++)
+	{
+		b = old[(counter & (old_size - 1)) / _BLOCK_PACKETS];
+		if(b == 0) continue;
+		
+		p = &s->pool[b - 1][counter & (_BLOCK_PACKETS - 1)];
+		if(!_valid_slot(s, station, p, counter)) continue;
+		
+		q = _alloc_slot(s, station, counter);
+		if(q == NULL)
+		{
+			/* The pool has run out, stay with the old buffer */
+			_free_blocks(s, station, 0);
+			memcpy(st->block, old, sizeof(old));
+			st->size = old_size;
+			st->blocks = old_blocks;
+			return;
+		}
+		
+		/* The copy holds its own reference, the old slot's is
+		 * dropped when its block is freed. Without dedup the
+		 * payload is copied to the new slot's own */
+		memcpy(q, p, sizeof(mx_packet_t));
+		
+		if(!s->dedup)
+		{
+			q->payload = _home(s, q);
+			memcpy(_data(s, q), _data(s, p), sizeof(mx_payload_t));
+			_data(s, q)->refs = 0;
+			s->payloads++;
+		}
+		
+		_data(s, q)->refs++;
+		s->payload_refs++;
+	}
+	
+	_free_table(s, old, 0);
+	
+	printf("Station %d buffer resized from %u to %u packets (%u packets/s)\n",
+		station, old_size, packets, st->pps);
+}
+
+static void _update_size(mx_t *s, int station)
+{
+	mx_station_t *st = &s->station[station];
+	int64_t elapsed;
+	uint32_t packets;
+	
+	/* Measure the station's packet rate, and size its buffer
+	 * to hold the retention time at that rate */
+	elapsed = s->timestamp - st->rate_timestamp;
+	if(elapsed < MX_MS(_RATE_INTERVAL_MS)) return;
+	
+	st->pps = (int64_t) st->rate_packets * 1000000 / elapsed;
+	st->rate_packets = 0;
+	st->rate_timestamp = s->timestamp;
+	
+	/* A silent station keeps its buffer until it times out */
+	if(st->pps == 0) return;
+	
+	for(packets = _MIN_PACKETS; packets < _MAX_PACKETS; packets <<= 1)
+	{
+		if(packets >= (int64_t) st->pps * s->retention_ms / 1000) break;
+	}
+	
+	packets = _fit_size(s, station, packets);
+	
+	/* Grow straight away, but only shrink when the buffer is
+	 * much too large, so small changes in rate are ignored */
+	if(packets > st->size || packets * 4 <= st->size)
+	{
+		_resize_station(s, station, packets);
+	}
+}
+
 static mx_packet_t *_get_packet(mx_t *s, int station, uint32_t counter)
 {
 	mx_packet_t *p;
@@ -13,13 +419,13 @@ static mx_packet_t *_get_packet(mx_t *s, int station, uint32_t counter)
 	/* Check for a valid station */
 	if(station < 0 || station >= _STATIONS) return(NULL);
 	if(s->station[station].sid[0] == '\0') return(NULL);
-	if(s->station[station].timestamp <= s->timestamp - _TIMEOUT_MS) return(NULL);
+	if(s->station[station].timestamp <= s->timestamp - MX_MS(_TIMEOUT_MS)) return(NULL);
 	
 	/* Fetch a pointer to the target packet */
-	p = &s->station[station].packet[counter & 0xFFFF];
+	p = _slot(s, station, counter);
 	
 	/* Is it stale? */
-	if(p->station != station || p->counter != counter) return(NULL);
+	if(!_valid_slot(s, station, p, counter)) return(NULL);
 	
 	/* Return the pointer */
 	return(p);
@@ -29,6 +435,7 @@ static mx_packet_t *_next_pcr(mx_t *s, int station, uint32_t counter)
 {
 	mx_station_t *st;
 	mx_packet_t *p;
+	mx_payload_t *d;
 	
 	/* Increments the counter until we find the first
 	 * packet in the designated PID with a PCR timestamp.
@@ -39,21 +446,22 @@ static mx_packet_t *_next_pcr(mx_t *s, int station, uint32_t counter)
 	for(; counter != st->latest + 1; counter++)
 	{
 		/* Test for a valid packet */
-		p = &st->packet[counter & 0xFFFF];
+		p = _slot(s, station, counter);
 		
 		/* Packet must exist */
-		if(p->station != station || p->counter != counter) continue;
+		if(!_valid_slot(s, station, p, counter)) continue;
 		
 		/* Packet header must have been parsed */
-		if(p->error != TS_OK) continue;
+		d = _data(s, p);
+		if(d->error != TS_OK) continue;
 		
 		/* Packet must be a part of the designated
 		 * PID and have a timestamp */
-		if(p->header.pid != s->pcr_pid ||
-		   p->header.pcr_flag == 0) continue;
+		if(d->header.pid != s->pcr_pid ||
+		   d->header.pcr_flag == 0) continue;
 		
 		/* Packet must be outside the guard period */
-		if(p->timestamp >= s->timestamp - _GUARD_MS) continue;
+		if(p->timestamp >= s->timestamp - MX_MS(_GUARD_MS)) continue;
 		
 		/* Found one */
 		return(p);
@@ -97,17 +505,69 @@ static mx_packet_t *_next_segment(mx_t *s, int station, mx_packet_t **r)
 	return(left);
 }
 
+static int _segment_output(mx_t *s, mx_packet_t *p)
+{
+	mx_payload_t *d = _data(s, p);
+	mx_output_t *o;
+	uint64_t seq;
+	
+	/* Returns 1 if the PCR packet starting a segment is in the output
+	 * ring, other than as the end of the last segment output. The
+	 * segment overlaps what has been output already */
+	if(d->header.pcr_base == s->next_pcr) return(0);
+	
+	for(seq = s->seq; seq > 0 && s->seq - seq < _OUTPUT_PACKETS; seq--)
+	{
+		o = &s->out_info[(seq - 1) & (_OUTPUT_PACKETS - 1)];
+		
+		if(o->pid != d->header.pid || (o->flags & MX_OUTPUT_PCR) == 0) continue;
+		if(o->pcr_base != d->header.pcr_base) continue;
+		
+		return(memcmp(s->out[(seq - 1) & (_OUTPUT_PACKETS - 1)], d->raw, TS_PACKET_SIZE) == 0);
+	}
+	
+	return(0);
+}
+
+static mx_packet_t *_unused_segment(mx_t *s, int station, uint64_t pcr, mx_packet_t **r)
+{
+	mx_station_t *st = &s->station[station];
+	mx_packet_t *left;
+	
+	/* Returns the left hand packet of the segment last found by
+	 * _next_segment(), if it is still held and not behind the
+	 * last segment output. Otherwise returns NULL. Without a last
+	 * segment to compare with, pcr is 0 and the output ring is
+	 * searched instead */
+	if(st->left == st->right) return(NULL);
+	
+	left = _get_packet(s, station, st->left);
+	*r = _get_packet(s, station, st->right);
+	if(left == NULL || *r == NULL) return(NULL);
+	
+	if(_data(s, left)->header.pcr_base < pcr) return(NULL);
+	if(pcr == 0 && _segment_output(s, left)) return(NULL);
+	
+	return(left);
+}
+
 static void _reset_station(mx_t *s, int id, char sid[10], uint32_t counter)
 {
-	/* Zero the station memory */
+	/* Return the packet buffer to the pool */
+	_free_blocks(s, id, 0);
+	
+	/* Zero the station state. The packets are not touched, the
+	 * new epoch number makes any left in the pool invalid */
 	memset(&s->station[id], 0, sizeof(mx_station_t));
+	s->station[id].epoch = ++s->epoch;
+	
+	/* Start with the default buffer size until the rate is known */
+	s->station[id].size = _fit_size(s, id, _INITIAL_PACKETS);
+	s->station[id].rate_timestamp = s->timestamp;
 	
 	/* Set the callsign */
 	memcpy(s->station[id].sid, sid, 10);
 	
-	/* The memset 0 creates a false positive 'valid' packet for station 0 */
-	s->station[id].packet[0].counter = 1;
-	
 	/* Set the stream positions */
 	s->station[id].current = counter;
 	s->station[id].latest = counter;
@@ -121,7 +581,8 @@ static int _lookup_station(mx_t *s, char sid[10])
 	for(i = 0; i < _STATIONS; i++)
 	{
 		if(strncmp(s->station[i].sid, sid, 10) == 0 &&
-		   s->station[i].timestamp > s->timestamp - _TIMEOUT_MS)
+		   s->station[i].retired == 0 &&
+		   s->station[i].timestamp > s->timestamp - MX_MS(_TIMEOUT_MS))
 		{
 			/* Found a matching station */
 			return(i);
@@ -138,7 +599,7 @@ static int _new_station(mx_t *s, char sid[10])
 	/* Search for an empty slot */
 	for(i = 0; i < _STATIONS; i++)
 	{
-		if(s->station[i].timestamp <= s->timestamp - _TIMEOUT_MS)
+		if(s->station[i].timestamp <= s->timestamp - MX_MS(_TIMEOUT_MS))
 		{
 			/* Found a timed out station */
 			return(i);
@@ -156,130 +617,1599 @@ static int _new_station(mx_t *s, char sid[10])
 	return(-1);
 }
 
-void mx_init(mx_t *s, uint16_t pcr_pid)
+static int _old_station(mx_t *s, int station, uint32_t counter)
 {
-	memset(s, 0, sizeof(mx_t));
+	mx_station_t *st;
+	int32_t d;
+	int i;
 	
-	s->pcr_pid = pcr_pid;
-	s->next_station = -1;
+	/* Returns the slot the station used before restarting its
+	 * counter, if the counter falls in it, or -1 */
+	for(i = 0; i < _STATIONS; i++)
+	{
+		st = &s->station[i];
+		
+		if(st->retired == 0 || strncmp(st->sid, s->station[station].sid, 10) != 0) continue;
+		if(st->timestamp <= s->timestamp - MX_MS(_TIMEOUT_MS)) continue;
+		
+		d = (int32_t) counter - (int32_t) st->current;
+		if(d > -(int32_t) st->size && d < (int32_t) st->size) return(i);
+	}
+	
+	return(-1);
 }
 
-void mx_feed(mx_t *s, int64_t timestamp, uint8_t *data)
+static int _restart_station(mx_t *s, int station, uint32_t counter)
 {
+	char sid[10];
 	int i;
-	int32_t d;
-	uint32_t counter;
-	mx_packet_t *p;
 	
-	/* Update the global timestamp */
-	s->timestamp = timestamp;
+	/* The station has restarted its counter. Its slot is retired,
+	 * keeping the packets from before until they are output, and
+	 * the station carries on in a new slot. It is reset in place
+	 * if there are no free slots. Returns the station number */
+	memcpy(sid, s->station[station].sid, 10);
 	
-	/* Packet ID (2 bytes) */
-	if(data[0x00] != 0xA1 || data[0x01] != 0x55)
+	i = _new_station(s, sid);
+	if(i < 0)
 	{
-		/* Invalid header. Ignore this packet */
-		return;
+		_reset_station(s, station, sid, counter);
+		return(station);
 	}
 	
-	/* Counter (4 bytes little-endian) */
-	counter = (uint32_t) data[0x05] << 24
-	        | (uint32_t) data[0x04] << 16
-	        | (uint32_t) data[0x03] <<  8
-	        | (uint32_t) data[0x02] <<  0;
+	s->station[station].retired = 1;
+	_reset_station(s, i, sid, counter);
 	
-	/* Lookup the station number */
-	i = _lookup_station(s, (char *) &data[0x06]);
+	return(i);
+}
+
+static void _add_nack(mx_station_t *st, uint32_t counter, uint32_t length, int64_t timestamp)
+{
+	mx_nack_t *n;
 	
-	if(i < 0)
-	{
-		/* This is a new station, try to register it */
-		i = _new_station(s, (char *) &data[0x06]);
-		
-		/* No free station slots! */
-		if(i < 0)
-		{
-			printf("No free slots for new station %.10s\n", (char *) &data[0x06]);
-			return;
-		}
-		
-		printf("New station %.10s got slot %d\n", (char *) &data[0x06], i);
-		
-		/* Reset the station */
-		_reset_station(s, i, (char *) &data[0x06], counter);
-	}
-	else
-	{
-		/* Existing station, ensure this new packet
-		 * has a counter within the expected bounds */
-		d = (int32_t) counter - (int32_t) s->station[i].current;
-		
-		if(d < -0xFFFF || d > 0xFFFF)
-		{
-			/* The counter is too far out, assume station has restarted */
-			printf("Station %d counter reset\n", i);
-			_reset_station(s, i, (char *) &data[0x06], counter);
-		}
-		else if(d <= 0)
-		{
-			/* The current stream position has already moved past
-			 * this packet, it's too late to process it */
-			printf("Dropping late packet for station %d\n", i);
-			return;
-		}
-	}
+	/* Very large gaps are more likely an outage than packet loss */
+	if(length > _NACK_MAX_GAP) return;
 	
+	/* Record the missing range, replacing the oldest */
+	n = &st->nack[st->nack_next];
+	st->nack_next = (st->nack_next + 1) % _NACK_RANGES;
 	
+	n->counter = counter;
+	n->length = length;
+	n->timestamp = timestamp;
+	n->sent = 0;
+	n->retries = 0;
+}
+
+void mx_init(mx_t *s, uint16_t pcr_pid)
+{
+	int i;
 	
-	/* Get a pointer to where the packet should go */
-	p = &s->station[i].packet[counter & 0xFFFF];
+	/* The payload store, packet pool and index are left alone, they
+	 * must already be zero as they are in a new memory mapping */
+	memset(s, 0, offsetof(mx_t, pool_blocks));
 	
-	/* Do we already have this packet? If so, ignore it */
-	if(p->station == i && p->counter == counter)
+	s->pcr_pid = pcr_pid;
+	s->next_station = -1;
+	s->rap_seq = -1;
+	s->pmt_pid = TS_NULL_PID;
+	
+	/* All blocks start free, taken from block 0 up */
+	for(i = 0; i < s->pool_blocks; i++)
+	{
+		s->pool_free[i] = s->pool_blocks - 1 - i;
+	}
+	
+	s->pool_free_count = s->pool_blocks;
+	
+	mx_set_buffers(s, MX_RETENTION_MS, MX_BUFFER_MB);
+}
+
+void mx_set_buffers(mx_t *s, int retention_ms, int buffer_mb)
+{
+	/* Set the time each station buffer should hold, and the memory
+	 * budget for all of them. The budget is limited by the pool size,
+	 * which was set from the budget given to mx_open() */
+	s->retention_ms = retention_ms;
+	s->budget_blocks = (int64_t) buffer_mb * 1024 * 1024 / _BLOCK_BYTES;
+	
+	if(s->budget_blocks > s->pool_blocks) s->budget_blocks = s->pool_blocks;
+	if(s->budget_blocks < _MIN_PACKETS / _BLOCK_PACKETS) s->budget_blocks = _MIN_PACKETS / _BLOCK_PACKETS;
+}
+
+void mx_set_dedup(mx_t *s, int dedup)
+{
+	int i;
+	
+	/* The store is laid out differently with and without dedup, so
+	 * packets held under the other setting (in a resumed state) are
+	 * dropped, and the store is started again */
+	if(s->dedup == dedup) return;
+	
+	for(i = 0; i < _STATIONS; i++)
+	{
+		if(s->station[i].blocks == 0) continue;
+		
+		printf("Dedup setting changed, dropping the packets held for station %d\n", i);
+		_free_blocks(s, i, 1);
+	}
+	
+	_release_memory(s->payload_bucket, sizeof(uint32_t) * s->payload_buckets);
+	_release_memory(s->payload, sizeof(mx_payload_t) * (_payload_count(s) + 1));
+	
+	s->dedup = dedup;
+	s->payload_free = 0;
+	s->payload_top = 0;
+	s->payloads = 0;
+	s->payload_refs = 0;
+}
+
+static uint32_t _pow2(uint32_t n)
+{
+	uint32_t p = 1;
+	
+	/* The smallest power of 2 not below n */
+	while(p < n) p <<= 1;
+	
+	return(p);
+}
+
+static int _pool_size(int buffer_mb)
+{
+	int64_t blocks;
+	
+	/* The number of pool blocks for a memory budget. Stations can
+	 * keep their smallest buffer beyond the budget, and a buffer
+	 * being resized briefly holds both sizes, so a few more are
+	 * added. Limited to _POOL_BLOCKS */
+	if(buffer_mb < 0) buffer_mb = 0;
+	
+	blocks = (int64_t) buffer_mb * 1024 * 1024 / _BLOCK_BYTES;
+	blocks += _STATIONS * (_MIN_PACKETS / _BLOCK_PACKETS);
+	
+	return(blocks > _POOL_BLOCKS ? _POOL_BLOCKS : (int) blocks);
+}
+
+static size_t _state_len(int blocks)
+{
+	uint32_t payloads = (uint32_t) blocks * _BLOCK_PACKETS;
+	
+	/* The length of the state with a pool of this many blocks */
+	return(MX_STATE_OFFSET + sizeof(mx_t)
+		+ sizeof(uint32_t) * _pow2(payloads / _PAYLOADS_PER_BUCKET)
+		+ sizeof(mx_payload_t) * (payloads + 1)
+		+ sizeof(mx_packet_t) * payloads
+		+ sizeof(mx_index_t) * _pow2(payloads));
+}
+
+static void _map_store(mx_t *s, int blocks)
+{
+	uint8_t *p = (uint8_t *) (s + 1);
+	
+	/* Size the pool, payload store and index for the number of
+	 * blocks, and point to them in the mapping following mx_t */
+	s->pool_blocks = blocks;
+	s->payload_buckets = _pow2(_payload_count(s) / _PAYLOADS_PER_BUCKET);
+	s->index_size = _pow2(_payload_count(s));
+	
+	s->payload_bucket = (uint32_t *) p;
+	p += sizeof(uint32_t) * s->payload_buckets;
+	
+	s->payload = (mx_payload_t *) p;
+	p += sizeof(mx_payload_t) * (_payload_count(s) + 1);
+	
+	s->pool = (mx_packet_t (*)[_BLOCK_PACKETS]) p;
+	p += sizeof(mx_packet_t) * _payload_count(s);
+	
+	s->index = (mx_index_t *) p;
+}
+
+static mx_state_t *_state(mx_t *s)
+{
+	return((mx_state_t *) ((uint8_t *) s - MX_STATE_OFFSET));
+}
+
+static int _check_pool(mx_t *s)
+{
+	mx_station_t *sta;
+	uint8_t owner[_POOL_BLOCKS];
+	int i, j, b, leaked = 0;
+	
+	/* Each pool block must be either free or in the block table
+	 * of one station, never both or twice. A block in neither was
+	 * lost when the process stopped part way through moving it,
+	 * and is returned to the pool empty. Returns 0 if corrupt */
+	
+	memset(owner, 0, sizeof(owner));
+	
+	for(i = 0; i < s->pool_free_count; i++)
+	{
+		if(owner[s->pool_free[i]]++) return(0);
+	}
+	
+	for(i = 0; i < _STATIONS; i++)
+	{
+		sta = &s->station[i];
+		sta->blocks = 0;
+		
+		for(j = 0; j < _STATION_BLOCKS; j++)
+		{
+			b = sta->block[j] - 1;
+			if(b < 0) continue;
+			
+			if(owner[b]++) return(0);
+			sta->blocks++;
+		}
+	}
+	
+	for(b = 0; b < s->pool_blocks; b++)
+	{
+		if(owner[b]) continue;
+		
+		memset(s->pool[b], 0, sizeof(s->pool[b]));
+		s->pool_free[s->pool_free_count++] = b;
+		leaked++;
+	}
+	
+	if(leaked > 0)
+	{
+		printf("State file had %d pool blocks not in use, returned to the pool\n", leaked);
+	}
+	
+	return(1);
+}
+
+static int _rebuild_payloads(mx_t *s)
+{
+	mx_station_t *sta;
+	mx_packet_t *p;
+	mx_payload_t *d;
+	uint32_t n;
+	int i, j, b;
+	
+	/* Rebuild the payload reference counts, free list and hash chains
+	 * from the slots in the station buffers, rather than trusting them.
+	 * Slots referring to a payload that can't be theirs are emptied,
+	 * and headers are parsed again. Returns 0 if the store is corrupt */
+	
+	if((s->dedup != 0 && s->dedup != 1) || s->payload_top > _payload_count(s)) return(0);
+	
+	for(n = 1; s->dedup && n <= s->payload_top; n++)
+	{
+		s->payload[n].refs = 0;
+	}
+	
+	s->payloads = 0;
+	s->payload_refs = 0;
+	
+	for(i = 0; i < _STATIONS; i++)
+	{
+		sta = &s->station[i];
+		
+		for(j = 0; j < _STATION_BLOCKS; j++)
+		{
+			b = sta->block[j] - 1;
+			if(b < 0) continue;
+			
+			for(p = s->pool[b]; p < s->pool[b] + _BLOCK_PACKETS; p++)
+			{
+				if(p->payload == 0) continue;
+				
+				if(s->dedup ? p->payload > s->payload_top : p->payload != _home(s, p))
+				{
+					memset(p, 0, sizeof(mx_packet_t));
+					continue;
+				}
+				
+				d = _data(s, p);
+				
+				if(s->dedup && d->refs++ > 0)
+				{
+					s->payload_refs++;
+					continue;
+				}
+				
+				d->refs = 1;
+				d->hashed = 0;
+				d->error = ts_parse_header(&d->header, d->raw);
+				
+				s->payload_refs++;
+				if(!s->dedup) s->payloads++;
+			}
+		}
+	}
+	
+	if(s->dedup) _rehash_payloads(s);
+	
+	return(1);
+}
+
+static int _valid_state(mx_state_t *st, mx_t *s, uint16_t pcr_pid)
+{
+	mx_station_t *sta;
+	int i, j;
+	
+	/* Test if a state file can be resumed. Returns 1 if valid */
+	
+	if(memcmp(st->magic, MX_STATE_MAGIC, sizeof(st->magic)) != 0 ||
+	   st->version != MX_STATE_VERSION ||
+	   st->stations != _STATIONS ||
+	   st->packets != _MAX_PACKETS ||
+	   st->output_packets != _OUTPUT_PACKETS ||
+	   st->pool_blocks != (uint32_t) s->pool_blocks ||
+	   st->size != _state_len(s->pool_blocks))
+	{
+		printf("State file layout does not match this build\n");
+		return(0);
+	}
+	
+	if(st->pcr_pid != pcr_pid || s->pcr_pid != pcr_pid)
+	{
+		printf("State file was built for PCR PID %d\n", st->pcr_pid);
+		return(0);
+	}
+	
+	/* Check the indexes used without bounds checks */
+	if(s->next_station < -1 || s->next_station >= _STATIONS ||
+	   s->rap_seq > (int64_t) s->seq ||
+	   s->rap_psi_len < 0 || s->rap_psi_len > MX_JOIN_PSI_LEN)
+	{
+		printf("State file is corrupt\n");
+		return(0);
+	}
+	
+	if(s->pool_free_count < 0 || s->pool_free_count > s->pool_blocks)
+	{
+		printf("State file is corrupt\n");
+		return(0);
+	}
+	
+	for(i = 0; i < s->pool_free_count; i++)
+	{
+		if(s->pool_free[i] < 0 || s->pool_free[i] >= s->pool_blocks)
+		{
+			printf("State file is corrupt\n");
+			return(0);
+		}
+	}
+	
+	for(i = 0; i < _STATIONS; i++)
+	{
+		sta = &s->station[i];
+		
+		if(sta->nack_next < 0 || sta->nack_next >= _NACK_RANGES ||
+		   sta->fec_next < 0 || sta->fec_next >= _FEC_PACKETS)
+		{
+			printf("State file is corrupt\n");
+			return(0);
+		}
+		
+		if(sta->size > _MAX_PACKETS || (sta->size & (sta->size - 1)) != 0 ||
+		  (sta->size != 0 && sta->size < _BLOCK_PACKETS))
+		{
+			printf("State file is corrupt\n");
+			return(0);
+		}
+		
+		for(j = 0; j < _STATION_BLOCKS; j++)
+		{
+			if(sta->block[j] < 0 || sta->block[j] > s->pool_blocks)
+			{
+				printf("State file is corrupt\n");
+				return(0);
+			}
+		}
+	}
+	
+	if(!_check_pool(s) || !_rebuild_payloads(s))
+	{
+		printf("State file is corrupt\n");
+		return(0);
+	}
+	
+	/* The process may have been killed part way through an update.
+	 * At worst this damages one packet, so the state is still used */
+	if(st->running)
+	{
+		printf("State file was not closed cleanly\n");
+	}
+	
+	return(1);
+}
+
+mx_t *mx_open(const char *path, uint16_t pcr_pid, int buffer_mb)
+{
+	mx_state_t *st;
+	mx_t *s;
+	uint8_t *map;
+	struct stat sb;
+	int fd, resume, blocks;
+	size_t len;
+	
+	/* Allocate the merger state, with a packet pool sized for the
+	 * memory budget. If path is set, the state lives in that file
+	 * and is resumed from it if valid, so a restarted process can
+	 * carry on from where the last one stopped. Only the parts of
+	 * the state in use are given memory, the file is sparse.
+	 * Returns NULL on error */
+	
+	blocks = _pool_size(buffer_mb);
+	len = _state_len(blocks);
+	
+	if(path == NULL)
+	{
+		map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if(map == MAP_FAILED)
+		{
+			perror("mmap");
+			return(NULL);
+		}
+		
+		s = (mx_t *) (map + MX_STATE_OFFSET);
+		_map_store(s, blocks);
+		mx_init(s, pcr_pid);
+		
+		return(s);
+	}
+	
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if(fd < 0)
+	{
+		perror("open");
+		return(NULL);
+	}
+	
+	if(fstat(fd, &sb) < 0)
+	{
+		perror("fstat");
+		close(fd);
+		return(NULL);
+	}
+	
+	resume = (sb.st_size == (off_t) len);
+	
+	if(sb.st_size > 0 && !resume)
+	{
+		printf("State file does not match this build and buffer memory budget\n");
+	}
+	
+	if(!resume && ftruncate(fd, len) < 0)
+	{
+		perror("ftruncate");
+		close(fd);
+		return(NULL);
+	}
+	
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED)
+	{
+		perror("mmap");
+		close(fd);
+		return(NULL);
+	}
+	
+	st = (mx_state_t *) map;
+	s = (mx_t *) (map + MX_STATE_OFFSET);
+	_map_store(s, blocks);
+	
+	if(resume && _valid_state(st, s, pcr_pid))
+	{
+		printf("Resuming merger state from %s\n", path);
+		
+		/* The previous run may have stopped part way through an update */
+		s->rap_gen &= ~1;
+	}
+	else
+	{
+		printf("Starting new merger state in %s\n", path);
+		
+		/* Truncating the file zeros it, including the packet pool */
+		if(ftruncate(fd, 0) < 0 || ftruncate(fd, len) < 0)
+		{
+			perror("ftruncate");
+			munmap(map, len);
+			close(fd);
+			return(NULL);
+		}
+		
+		_map_store(s, blocks);
+		mx_init(s, pcr_pid);
+		
+		memset(st, 0, sizeof(mx_state_t));
+		memcpy(st->magic, MX_STATE_MAGIC, sizeof(st->magic));
+		st->version = MX_STATE_VERSION;
+		st->stations = _STATIONS;
+		st->packets = _MAX_PACKETS;
+		st->output_packets = _OUTPUT_PACKETS;
+		st->pool_blocks = blocks;
+		st->size = len;
+		st->pcr_pid = pcr_pid;
+	}
+	
+	close(fd);
+	
+	st->running = 1;
+	
+	return(s);
+}
+
+void mx_sync(mx_t *s)
+{
+	mx_state_t *st = _state(s);
+	
+	/* Schedule the state to be written back to the file. The file
+	 * is the live state, so this only limits what is lost if the
+	 * machine itself fails, and does not wait for the writes */
+	
+	st->timestamp = s->timestamp;
+	msync(st, _state_len(s->pool_blocks), MS_ASYNC);
+}
+
+void mx_close(mx_t *s)
+{
+	mx_state_t *st = _state(s);
+	
+	st->running = 0;
+	st->timestamp = s->timestamp;
+	
+	msync(st, _state_len(s->pool_blocks), MS_SYNC);
+	munmap(st, _state_len(s->pool_blocks));
+}
+
+static void _update_psi(mx_t *s, mx_payload_t *d)
+{
+	psi_pat_t pat;
+	psi_pmt_t pmt;
+	
+	/* Keep copies of the latest PAT and PMT for the first program */
+	if(d->header.pid == PSI_PAT_PID)
+	{
+		if(psi_parse_pat(&pat, &d->header, d->raw) == TS_OK &&
+		   pat.programs > 0)
+		{
+			if(pat.program[0].pid != s->pmt_pid) s->have_pmt = 0;
+			
+			s->pmt_pid = pat.program[0].pid;
+			memcpy(s->pat, d->raw, TS_PACKET_SIZE);
+			s->have_pat = 1;
+		}
+	}
+	else if(d->header.pid == s->pmt_pid && s->have_pat)
+	{
+		if(psi_parse_pmt(&pmt, &d->header, d->raw) == TS_OK)
+		{
+			memcpy(s->pmt, d->raw, TS_PACKET_SIZE);
+			s->have_pmt = 1;
+		}
+	}
+}
+
+static void _output(mx_t *s, mx_packet_t *p)
+{
+	mx_payload_t *d = _data(s, p);
+	mx_output_t *o;
+	
+	/* Append a packet to the output ring */
+	memcpy(s->out[s->seq & (_OUTPUT_PACKETS - 1)], d->raw, TS_PACKET_SIZE);
+	
+	o = &s->out_info[s->seq & (_OUTPUT_PACKETS - 1)];
+	o->timestamp = p->timestamp;
+	o->output_timestamp = s->timestamp;
+	o->pid = (d->error == TS_OK ? d->header.pid : TS_NULL_PID);
+	o->flags = 0;
+	o->pcr_base = 0;
+	
+	if(d->error == TS_OK)
+	{
+		if(d->header.payload_unit_start_indicator) o->flags |= MX_OUTPUT_PUSI;
+		if(d->header.random_access_indicator) o->flags |= MX_OUTPUT_RAI;
+		
+		if(d->header.pcr_flag)
+		{
+			o->flags |= MX_OUTPUT_PCR;
+			o->pcr_base = d->header.pcr_base;
+		}
+	}
+	
+	/* Keep copies of the latest PSI */
+	if(d->error == TS_OK) _update_psi(s, d);
+	
+	/* Note the most recent random access point, and the PSI to send
+	 * ahead of it. Streams without the random access indicator are
+	 * joined at the start of a payload unit instead */
+	if(o->pid == s->pcr_pid)
+	{
+		if(o->flags & MX_OUTPUT_RAI) s->rai_seen = 1;
+		
+		if((o->flags & MX_OUTPUT_RAI) ||
+		   (s->rai_seen == 0 && (o->flags & MX_OUTPUT_PUSI)))
+		{
+			/* Viewer threads may be reading these in mx_join() */
+			__atomic_store_n(&s->rap_gen, s->rap_gen + 1, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_RELEASE);
+			
+			__atomic_store_n(&s->rap_seq, s->seq, __ATOMIC_RELAXED);
+			s->rap_psi_len = 0;
+			
+			if(s->have_pat && s->have_pmt)
+			{
+				memcpy(&s->rap_psi[0], s->pat, TS_PACKET_SIZE);
+				memcpy(&s->rap_psi[TS_PACKET_SIZE], s->pmt, TS_PACKET_SIZE);
+				s->rap_psi_len = TS_PACKET_SIZE * 2;
+			}
+			
+			__atomic_store_n(&s->rap_gen, s->rap_gen + 1, __ATOMIC_RELEASE);
+		}
+	}
+	
+	/* Note the continuity counter and position for the PID */
+	if(d->error == TS_OK && o->pid != TS_NULL_PID)
+	{
+		s->out_cc[o->pid] = _CC_SEEN | d->header.continuity_counter;
+		s->out_pid_seq[o->pid] = s->seq;
+	}
+	
+	/* Publish the packet to viewer threads */
+	__atomic_store_n(&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+static mx_packet_t *_splice_find(mx_t *s, int station, uint32_t counter, int step, uint16_t pid, uint8_t cc)
+{
+	mx_packet_t *p;
+	ts_header_t *h;
+	int i, n;
+	
+	/* Searches a station's buffer from counter, forwards or
+	 * backwards, for a packet on the PID with the given
+	 * continuity counter. The counter wraps after 16 packets on
+	 * the PID, so only the first 15 are searched. Any match past
+	 * that could be from the wrong turn of the counter */
+	for(i = n = 0; i < _SPLICE_WINDOW && n < 15; i++, counter += step)
+	{
+		p = _get_packet(s, station, counter);
+		if(p == NULL || _data(s, p)->error != TS_OK) continue;
+		
+		h = &_data(s, p)->header;
+		if(h->pid != pid || h->payload_flag == 0) continue;
+		
+		if(h->continuity_counter == cc) return(p);
+		
+		n++;
+	}
+	
+	return(NULL);
+}
+
+static int _splice_output(mx_t *s, mx_payload_t *d)
+{
+	uint8_t *raw;
+	uint64_t seq;
+	int i, n;
+	
+	/* Returns 1 if the packet is one of the last 15 with a payload
+	 * output on its PID. The counter wraps after 16, so only the
+	 * output packet with the same continuity counter is compared.
+	 * Any earlier match could be from the wrong turn of the counter */
+	seq = s->out_pid_seq[d->header.pid] + 1;
+	
+	for(i = n = 0; i < _SPLICE_OUTPUT_WINDOW && n < 15 && seq > 0 && s->seq - seq < _OUTPUT_PACKETS; i++)
+	{
+		seq--;
+		
+		if(s->out_info[seq & (_OUTPUT_PACKETS - 1)].pid != d->header.pid) continue;
+		
+		raw = s->out[seq & (_OUTPUT_PACKETS - 1)];
+		if((raw[3] & 0x10) == 0) continue;
+		
+		if((raw[3] & 0x0F) == d->header.continuity_counter)
+		{
+			return(memcmp(raw, d->raw, TS_PACKET_SIZE) == 0);
+		}
+		
+		n++;
+	}
+	
+	return(0);
+}
+
+static int _splice_packet(mx_t *s, int station, uint32_t left, mx_packet_t *p)
+{
+	mx_payload_t *d = _data(s, p);
+	ts_header_t *h = &d->header;
+	mx_packet_t *f;
+	uint8_t last, expected;
+	
+	/* Checks the first packet of each PID output after a splice
+	 * against the last ones output before it. Packets skipped over
+	 * are filled in from just before the new segment, or from just
+	 * after the last packet output. Returns 0 if the packet is a
+	 * duplicate and should be dropped, 1 otherwise */
+	
+	if(d->error != TS_OK || h->pid == TS_NULL_PID) return(1);
+	if(s->out_splice[h->pid] == s->splice) return(1);
+	
+	/* Nothing to compare with if the PID hasn't been output yet */
+	if((s->out_cc[h->pid] & _CC_SEEN) == 0)
+	{
+		s->out_splice[h->pid] = s->splice;
+		return(1);
+	}
+	
+	last = s->out_cc[h->pid] & 0x0F;
+	
+	/* A packet behind the last one on the PID, with the same data
+	 * as the one output with its continuity counter, is a duplicate.
+	 * The new segment overlaps the output. The PID is checked again
+	 * against the packet that follows, until they line up */
+	if(h->payload_flag && _splice_output(s, d))
+	{
+		s->splice_duplicates++;
+		return(0);
+	}
+	
+	s->out_splice[h->pid] = s->splice;
+	
+	if(h->discontinuity_indicator) return(1);
+	
+	/* The counter only advances on packets with a payload */
+	if(h->payload_flag == 0)
+	{
+		if(h->continuity_counter != last) s->splice_cc_errors++;
+		return(1);
+	}
+	
+	/* Fill in any packets skipped over on this PID. A packet found
+	 * that was output already is from the turn of the counter before,
+	 * and the gap can't be filled */
+	for(expected = (last + 1) & 0x0F; expected != h->continuity_counter; expected = (expected + 1) & 0x0F)
+	{
+		f = _splice_find(s, station, left - 1, -1, h->pid, expected);
+		if(f == NULL) f = _splice_find(s, s->next_station, s->next_counter + 1, 1, h->pid, expected);
+		if(f == NULL || _splice_output(s, _data(s, f)))
+		{
+			s->splice_cc_errors++;
+			break;
+		}
+		
+		_output(s, f);
+		s->splice_filled++;
+	}
+	
+	return(1);
+}
+
+static mx_index_t *_index_slot(mx_t *s, int station, uint64_t hash)
+{
+	return(&s->index[(hash + (uint64_t) station * 0xC2B2AE3D27D4EB4FULL) & (s->index_size - 1)]);
+}
+
+static int _indexed(mx_payload_t *d)
+{
+	/* Null packets are all alike and can't be told apart by content */
+	return(d->error == TS_OK && d->header.pid != TS_NULL_PID);
+}
+
+static uint64_t _payload_hash(mx_payload_t *d)
+{
+	return(d->hashed ? d->hash : _hash_packet(d->raw));
+}
+
+static void _index_packet(mx_t *s, mx_packet_t *p)
+{
+	mx_payload_t *d = _data(s, p);
+	mx_index_t *x;
+	uint64_t hash;
+	
+	if(!_indexed(d)) return;
+	
+	hash = _payload_hash(d);
+	x = _index_slot(s, p->station, hash);
+	x->counter = p->counter;
+	x->check = hash >> 32;
+}
+
+static mx_packet_t *_index_find(mx_t *s, int station, mx_packet_t *p, uint64_t hash)
+{
+	mx_index_t *x;
+	mx_packet_t *f;
+	
+	/* Returns the station's copy of the packet, if it has one indexed */
+	x = _index_slot(s, station, hash);
+	if(x->check != (uint32_t) (hash >> 32)) return(NULL);
+	
+	f = _get_packet(s, station, x->counter);
+	if(f == NULL) return(NULL);
+	
+	/* Shared payloads are identical without comparing them */
+	if(f->payload != p->payload &&
+	   memcmp(_data(s, f)->raw, _data(s, p)->raw, TS_PACKET_SIZE) != 0) return(NULL);
+	
+	return(f);
+}
+
+/* Distances from a hole of the packets tried as anchors. The
+ * furthest reach past other losses, at a few lookups a hole */
+static const int _anchor_distance[_FILL_ANCHORS] = { 0, 1, 2, 4, 8, 16, 32, 64 };
+
+static int _anchors(mx_t *s, int station, uint32_t counter, int step, mx_packet_t **p, uint64_t *hash)
+{
+	int i, n = 0;
+	
+	/* Collects the station's indexed packets stepping away from a
+	 * hole from counter, as anchors to find it in other stations.
+	 * The entry for an anchor is NULL if it can't be used */
+	for(i = 0; i < _FILL_ANCHORS; i++)
+	{
+		p[i] = _get_packet(s, station, counter + step * _anchor_distance[i]);
+		
+		if(p[i] == NULL || !_indexed(_data(s, p[i])))
+		{
+			p[i] = NULL;
+			continue;
+		}
+		
+		hash[i] = _payload_hash(_data(s, p[i]));
+		n++;
+	}
+	
+	return(n);
+}
+
+static mx_packet_t *_anchor_find(mx_t *s, int station, mx_packet_t **p, uint64_t *hash, int *k)
+{
+	mx_packet_t *f;
+	int i;
+	
+	/* Returns the station's copy of the nearest anchor it holds,
+	 * with its distance from the hole in k */
+	for(i = 0; i < _FILL_ANCHORS; i++)
+	{
+		if(p[i] == NULL) continue;
+		
+		f = _index_find(s, station, p[i], hash[i]);
+		if(f == NULL) continue;
+		
+		*k = _anchor_distance[i];
+		return(f);
+	}
+	
+	return(NULL);
+}
+
+static int _same_packet(mx_t *s, mx_packet_t *a, mx_packet_t *b)
+{
+	return(a->payload == b->payload ||
+	       memcmp(_data(s, a)->raw, _data(s, b)->raw, TS_PACKET_SIZE) == 0);
+}
+
+static uint32_t _fill_hole(mx_t *s, int station, uint32_t counter, uint32_t right, int splice)
+{
+	mx_station_t *st = &s->station[station];
+	mx_packet_t *a[_FILL_ANCHORS], *b[_FILL_ANCHORS];
+	uint64_t ha[_FILL_ANCHORS], hb[_FILL_ANCHORS];
+	uint32_t first[_STATIONS], length[_STATIONS], missing[_STATIONS];
+	mx_packet_t *fa, *fb, *p;
+	uint32_t end, c, last;
+	int i, j, ka, kb, votes[_STATIONS], best = -1;
+	
+	/* A hole starting at counter has been found in the segment being
+	 * output. Another station holding copies of the packets on either
+	 * side of it, close enough together, is taken to hold what was lost
+	 * in between. When a station doesn't hold the packets next to the
+	 * hole, ones a little further out are tried. The length of the hole
+	 * is the one most stations agree on. The packets are taken from the
+	 * station with that length missing the fewest of them, and any it
+	 * lacks from the others that agree with it. Returns the counter of
+	 * the packet after the hole */
+	
+	for(end = counter + 1; end != right && _get_packet(s, station, end) == NULL; end++);
+	
+	s->holes += end - counter;
+	
+	if(_anchors(s, station, counter - 1, -1, a, ha) == 0 ||
+	   _anchors(s, station, end, 1, b, hb) == 0) return(end);
+	
+	for(i = 0; i < _STATIONS; i++)
+	{
+		missing[i] = UINT32_MAX;
+		
+		if(i == station) continue;
+		
+		fa = _anchor_find(s, i, a, ha, &ka);
+		if(fa == NULL) continue;
+		
+		fb = _anchor_find(s, i, b, hb, &kb);
+		if(fb == NULL) continue;
+		
+		/* The packets this station holds for the hole */
+		first[i] = fa->counter + ka + 1;
+		last = fb->counter - kb;
+		
+		/* The copies must bridge a gap */
+		if((int32_t) (last - first[i]) < 1 ||
+		   last - first[i] > _FILL_MAX_PACKETS) continue;
+		
+		/* Anchors further out must line up with the packets
+		 * next to the hole, where the station has them */
+		p = _get_packet(s, i, first[i] - 1);
+		if(ka > 0 && p != NULL && a[0] != NULL && !_same_packet(s, p, a[0])) continue;
+		
+		p = _get_packet(s, i, last);
+		if(kb > 0 && p != NULL && b[0] != NULL && !_same_packet(s, p, b[0])) continue;
+		
+		length[i] = last - first[i];
+		missing[i] = 0;
+		for(c = first[i]; c != last; c++)
+		{
+			if(_get_packet(s, i, c) == NULL) missing[i]++;
+		}
+	}
+	
+	/* Count the stations agreeing with each length, including this
+	 * one by the length of its own hole. The most agreed on wins,
+	 * or the more complete copy if it is a tie */
+	for(i = 0; i < _STATIONS; i++)
+	{
+		if(missing[i] == UINT32_MAX) continue;
+		
+		for(votes[i] = (length[i] == end - counter), j = 0; j < _STATIONS; j++)
+		{
+			if(missing[j] != UINT32_MAX && length[j] == length[i]) votes[i]++;
+		}
+		
+		if(best == -1 || votes[i] > votes[best] ||
+		   (votes[i] == votes[best] && missing[i] < missing[best])) best = i;
+	}
+	
+	if(best == -1) return(end);
+	
+	for(c = 0; c < length[best]; c++)
+	{
+		p = _get_packet(s, best, first[best] + c);
+		
+		for(j = 0; p == NULL && j < _STATIONS; j++)
+		{
+			if(j != best && missing[j] != UINT32_MAX && length[j] == length[best])
+			{
+				p = _get_packet(s, j, first[j] + c);
+			}
+		}
+		
+		if(p == NULL) continue;
+		
+		if(splice && _splice_packet(s, station, st->left, p) == 0) continue;
+		
+		_output(s, p);
+		s->holes_filled++;
+	}
+	
+	return(end);
+}
+
+static void _simple_header(ts_header_t *ts, uint8_t *data)
+{
+	/* Decodes a TS header already known to have a valid sync byte and
+	 * no adaptation field, matching the result of ts_parse_header().
+	 * Fields not set here are expected to be zero */
+	ts->sync_byte                    = data[0];
+	ts->transport_error_indicator    = (data[1] & 0x80) >> 7;
+	ts->payload_unit_start_indicator = (data[1] & 0x40) >> 6;
+	ts->transport_priority           = (data[1] & 0x20) >> 5;
+	ts->pid                          = ((data[1] & 0x1F) << 8) | data[2];
+	ts->scrambling_control           = (data[3] & 0xC0) >> 6;
+	ts->payload_flag                 = (data[3] & 0x10) >> 4;
+	ts->continuity_counter           = data[3] & 0x0F;
+	ts->payload_offset               = 4;
+}
+
+static void _queue_pcr(mx_station_t *st, uint32_t counter, int64_t timestamp)
+{
+	mx_pcr_t *q;
+	
+	/* The oldest entry is dropped if the queue is full */
+	if(st->pcr_count == _PCR_QUEUE)
+	{
+		st->pcr_head = (st->pcr_head + 1) % _PCR_QUEUE;
+		st->pcr_count--;
+	}
+	
+	q = &st->pcr_queue[(st->pcr_head + st->pcr_count) % _PCR_QUEUE];
+	q->counter = counter;
+	q->timestamp = timestamp;
+	st->pcr_count++;
+}
+
+static int64_t _pcr_deadline(mx_station_t *st, int64_t timestamp)
+{
+	mx_pcr_t *q;
+	int i;
+	
+	/* Drop the PCR packets the stream position has passed */
+	while(st->pcr_count > 0 &&
+	      (int32_t) (st->pcr_queue[st->pcr_head].counter - st->current) < 0)
+	{
+		st->pcr_head = (st->pcr_head + 1) % _PCR_QUEUE;
+		st->pcr_count--;
+	}
+	
+	/* Returns when the next PCR packet leaves the guard period */
+	for(i = 0; i < st->pcr_count; i++)
+	{
+		q = &st->pcr_queue[(st->pcr_head + i) % _PCR_QUEUE];
+		
+		if(q->timestamp + MX_MS(_GUARD_MS) > timestamp)
+		{
+			return(q->timestamp + MX_MS(_GUARD_MS));
+		}
+	}
+	
+	return(INT64_MAX);
+}
+
+static uint32_t _store_payload(mx_t *s, mx_packet_t *p, uint8_t *raw, int simple)
+{
+	mx_payload_t *d;
+	uint64_t hash = 0;
+	uint32_t n;
+	
+	/* Returns a new reference to a payload holding the packet for
+	 * slot p. Without dedup that is the slot's own payload. With
+	 * dedup set, an identical payload already stored is shared */
+	
+	if(!s->dedup)
+	{
+		n = _home(s, p);
+	}
+	else
+	{
+		hash = _hash_packet(raw);
+		
+		for(n = s->payload_bucket[hash & (s->payload_buckets - 1)]; n != 0; n = d->next)
+		{
+			d = &s->payload[n];
+			
+			if(d->hash == hash && memcmp(d->raw, raw, TS_PACKET_SIZE) == 0)
+			{
+				d->refs++;
+				s->payload_refs++;
+				return(n);
+			}
+		}
+		
+		/* Take a payload from the free list, or one not used before.
+		 * There is one for every pool slot, so the store can't run out */
+		if(s->payload_free != 0)
+		{
+			n = s->payload_free;
+			s->payload_free = s->payload[n].next;
+		}
+		else
+		{
+			n = ++s->payload_top;
+		}
+	}
+	
+	/* The raw packet is all written over, only the rest is cleared */
+	d = &s->payload[n];
+	memset(d, 0, offsetof(mx_payload_t, raw));
+	d->refs = 1;
+	
+	memcpy(d->raw, raw, TS_PACKET_SIZE);
+	
+	if(simple) _simple_header(&d->header, d->raw);
+	else d->error = ts_parse_header(&d->header, d->raw);
+	
+	if(s->dedup)
+	{
+		d->hashed = 1;
+		d->hash = hash;
+		d->next = s->payload_bucket[hash & (s->payload_buckets - 1)];
+		s->payload_bucket[hash & (s->payload_buckets - 1)] = n;
+	}
+	
+	s->payloads++;
+	s->payload_refs++;
+	
+	return(n);
+}
+
+static void _insert_packet(mx_t *s, int i, uint32_t counter, int64_t timestamp, uint8_t *raw, int simple)
+{
+	mx_packet_t *p;
+	mx_payload_t *pl;
+	int32_t d;
+	
+	/* Get a pointer to where the packet should go */
+	p = _alloc_slot(s, i, counter);
+	if(p == NULL)
+	{
+		printf("Packet pool is full, dropping packet for station %d\n", i);
+		return;
+	}
+	
+	/* Release whatever the slot held before */
+	_unref_payload(s, p);
+	
+	/* Insert the packet into memory */
+	memset(p, 0, sizeof(mx_packet_t));
+	p->station   = i;
+	p->epoch     = s->station[i].epoch;
+	p->counter   = counter;
+	p->timestamp = timestamp;
+	p->payload   = _store_payload(s, p, raw, simple);
+	
+	pl = _data(s, p);
+	
+	//printf("%d: ", counter);
+	//if(pl->error != TS_INVALID) ts_dump_header(&pl->header);
+	//else printf("TS_INVALID\n");
+	
+	/* Update the station data */
+	d = (int32_t) counter - (int32_t) s->station[i].latest;
+	if(d > 0)
+	{
+		/* Note any packets skipped over so they can be requested again */
+		if(d > 1)
+		{
+			_add_nack(&s->station[i], s->station[i].latest + 1, d - 1, timestamp);
+		}
+		
+		s->station[i].latest = counter;
+	}
+	
+	/* Index the packet by its content */
+	_index_packet(s, p);
+	
+	/* Note when a PCR packet leaves the guard period */
+	if(pl->error == TS_OK && pl->header.pid == s->pcr_pid && pl->header.pcr_flag)
+	{
+		_queue_pcr(&s->station[i], counter, timestamp);
+	}
+	
+	s->station[i].timestamp = timestamp;
+	s->station[i].rate_packets++;
+}
+
+static int _fec_plausible(mx_t *s, int station, uint32_t counter, uint8_t *raw)
+{
+	mx_packet_t *p;
+	mx_payload_t *d;
+	ts_header_t ts;
+	int i, gap;
+	
+	/* Sanity checks a packet rebuilt from parity before it is used.
+	 * A parity packet that doesn't match the packets it is combined
+	 * with gives garbage, so the header must be valid, and its
+	 * continuity counter must follow on from the last packet on the
+	 * PID before it in the station's buffer, allowing for any missing
+	 * packets in between. Returns 1 if it looks right */
+	
+	if(ts_parse_header(&ts, raw) != TS_OK) return(0);
+	if(ts.transport_error_indicator) return(0);
+	if((raw[3] & 0x30) == 0) return(0);
+	
+	if(ts.pid == TS_NULL_PID) return(1);
+	
+	for(i = 1, gap = 0; i < _SPLICE_WINDOW && gap < 15; i++)
+	{
+		p = _get_packet(s, station, counter - i);
+		if(p == NULL || _data(s, p)->error != TS_OK)
+		{
+			/* This could have been on the PID too */
+			gap++;
+			continue;
+		}
+		
+		d = _data(s, p);
+		if(d->header.pid != ts.pid) continue;
+		
+		/* The counter advances by one for each packet with a
+		 * payload, and is repeated without one or for a duplicate */
+		return(((ts.continuity_counter - d->header.continuity_counter) & 0x0F) <= gap + ts.payload_flag);
+	}
+	
+	/* The PID isn't in the buffer nearby, there is nothing to compare with */
+	return(1);
+}
+
+static int _fec_recover_slot(mx_t *s, int station, mx_fec_t *f)
+{
+	mx_station_t *st;
+	mx_packet_t *p;
+	mx_payload_t *d;
+	uint8_t raw[TS_PACKET_SIZE];
+	uint32_t counter, step, missing = 0;
+	int i, j, n;
+	
+	/* Attempts to rebuild a single missing packet covered by this
+	 * parity packet. Returns 1 if the slot is finished with (a packet
+	 * was recovered or none are missing), or 0 if more than one packet
+	 * is still missing */
+	
+	st = &s->station[station];
+	
+	step = (f->type == MX_FEC_ROW ? 1 : f->l);
+	n = (f->type == MX_FEC_ROW ? f->l : f->d);
+	
+	memcpy(raw, f->raw, TS_PACKET_SIZE);
+	
+	for(i = 0, counter = f->counter; i < n; i++, counter += step)
+	{
+		p = _get_packet(s, station, counter);
+		
+		if(p == NULL)
+		{
+			/* Give up if more than one packet is missing */
+			if(missing++ > 0) return(0);
+			
+			f->missing = counter;
+			continue;
+		}
+		
+		d = _data(s, p);
+		
+		for(j = 1; j < TS_PACKET_SIZE; j++)
+		{
+			raw[j] ^= d->raw[j];
+		}
+	}
+	
+	if(missing == 0) return(1);
+	
+	/* Too late, the stream has moved past this packet */
+	if((int32_t) f->missing - (int32_t) st->current <= 0) return(1);
+	
+	/* The sync byte is known */
+	raw[0] = TS_HEADER_SYNC;
+	
+	if(!_fec_plausible(s, station, f->missing, raw))
+	{
+		st->fec_rejected++;
+		return(1);
+	}
+	
+	_insert_packet(s, station, f->missing, f->timestamp, raw, 0);
+	st->fec_recovered++;
+	
+	return(1);
+}
+
+static void _fec_recover(mx_t *s, int station)
+{
+	mx_station_t *st;
+	mx_fec_t *f;
+	int i, found;
+	
+	st = &s->station[station];
+	
+	/* Repeat until no more packets can be recovered, as
+	 * a row recovery can complete a column and vice versa */
+	do
+	{
+		found = 0;
+		
+		for(i = 0; i < _FEC_PACKETS; i++)
+		{
+			f = &st->fec[i];
+			if(f->type == 0) continue;
+			
+			if(_fec_recover_slot(s, station, f) == 1)
+			{
+				f->type = 0;
+				found = 1;
+			}
+			else if((int32_t) f->missing - (int32_t) st->current <= 0)
+			{
+				/* The stream has moved past a missing packet */
+				st->fec_unrecoverable++;
+				f->type = 0;
+			}
+		}
+	}
+	while(found);
+}
+
+static void _feed_fec(mx_t *s, int i, uint32_t counter, int64_t timestamp, uint8_t *data)
+{
+	mx_station_t *st;
+	mx_fec_t *f;
+	
+	st = &s->station[i];
+	
+	/* Store the parity packet, replacing the oldest */
+	f = &st->fec[st->fec_next];
+	st->fec_next = (st->fec_next + 1) % _FEC_PACKETS;
+	
+	if(f->type != 0)
+	{
+		/* The replaced slot still had packets missing */
+		st->fec_unrecoverable++;
+	}
+	
+	f->type = (data[0x00] == 0xA4 ? MX_FEC_ROW : MX_FEC_COLUMN);
+	f->counter = counter;
+	f->timestamp = timestamp;
+	f->l = data[0x10] >> 4;
+	f->d = data[0x10] & 0x0F;
+	memcpy(f->raw, &data[0x10], TS_PACKET_SIZE);
+	
+	if(f->l == 0 || f->d == 0)
 	{
-		printf("Duplicate packet received from station %d\n", i);
+		/* Invalid matrix size */
+		f->type = 0;
 		return;
 	}
 	
-	/* Insert the packet into memory */
-	memset(p, 0, sizeof(mx_packet_t));
-	p->station   = i;
-	p->counter   = counter;
-	p->timestamp = timestamp;
+	if(_fec_recover_slot(s, i, f) == 1)
+	{
+		f->type = 0;
+	}
+}
+
+static int _feed_packet(mx_t *s, int i, uint32_t counter, int64_t timestamp, uint8_t *data, int simple)
+{
+	int32_t d;
+	mx_packet_t *p;
+	int j;
 	
-	memcpy(p->raw, &data[0x10], TS_PACKET_SIZE);
-	p->error = ts_parse_header(&p->header, p->raw);
+	/* Feeds a single MX packet once its header has been checked
+	 * and the station looked up, i is -1 for an unknown station.
+	 * Returns the station number or -1 */
 	
-	p->next_station = -1;
-	p->next_counter = 0;
+	if(data[0x00] != 0xA1)
+	{
+		/* Parity packets are only used for known stations */
+		if(i >= 0) _feed_fec(s, i, counter, timestamp, data);
+		return(i);
+	}
 	
-	//printf("%d: ", counter);
-	//if(p->error != TS_INVALID) ts_dump_header(&p->header);
-	//else printf("TS_INVALID\n");
+	if(i < 0)
+	{
+		/* This is a new station, try to register it */
+		i = _new_station(s, (char *) &data[0x06]);
+		
+		/* No free station slots! */
+		if(i < 0)
+		{
+			printf("No free slots for new station %.10s\n", (char *) &data[0x06]);
+			return(-1);
+		}
+		
+		printf("New station %.10s got slot %d\n", (char *) &data[0x06], i);
+		
+		/* Reset the station */
+		_reset_station(s, i, (char *) &data[0x06], counter);
+	}
+	else
+	{
+		/* Existing station, ensure this new packet
+		 * has a counter within the expected bounds */
+		d = (int32_t) counter - (int32_t) s->station[i].current;
+		
+		if(d <= -(int32_t) s->station[i].size || d >= (int32_t) s->station[i].size)
+		{
+			/* A late packet from before a counter reset goes to the
+			 * station's old slot. If there is none, the counter is
+			 * too far out, assume the station has restarted */
+			j = _old_station(s, i, counter);
+			
+			if(j < 0)
+			{
+				printf("Station %d counter reset\n", i);
+				i = _restart_station(s, i, counter);
+			}
+			else if((int32_t) counter - (int32_t) s->station[j].current <= 0)
+			{
+				printf("Dropping late packet for station %d\n", j);
+				return(j);
+			}
+			else
+			{
+				i = j;
+			}
+		}
+		else if(d <= 0)
+		{
+			/* The current stream position has already moved past
+			 * this packet, it's too late to process it */
+			printf("Dropping late packet for station %d\n", i);
+			return(i);
+		}
+	}
 	
-	/* Update the station data */
-	d = (int32_t) counter - (int32_t) s->station[i].latest;
-	if(d > 0)
+	/* Get a pointer to where the packet should go */
+	p = _slot(s, i, counter);
+	
+	/* Do we already have this packet? If so, ignore it */
+	if(_valid_slot(s, i, p, counter))
 	{
-		s->station[i].latest = counter;
+		printf("Duplicate packet received from station %d\n", i);
+		return(i);
 	}
 	
-	s->station[i].timestamp = timestamp;
+	_insert_packet(s, i, counter, timestamp, &data[0x10], simple);
+	
+	return(i);
+}
+
+int mx_feed(mx_t *s, int64_t timestamp, uint8_t *data)
+{
+	int i;
+	uint32_t counter;
+	
+	/* Update the global timestamp */
+	s->timestamp = timestamp;
+	
+	/* Packet ID (2 bytes). 0x55A1 is a TS packet, 0x55A3
+	 * and 0x55A4 are column and row parity packets */
+	if(data[0x01] != 0x55 ||
+	  (data[0x00] != 0xA1 && data[0x00] != 0xA3 && data[0x00] != 0xA4))
+	{
+		/* Invalid header. Ignore this packet */
+		return(-1);
+	}
+	
+	/* Counter (4 bytes little-endian) */
+	counter = (uint32_t) data[0x05] << 24
+	        | (uint32_t) data[0x04] << 16
+	        | (uint32_t) data[0x03] <<  8
+	        | (uint32_t) data[0x02] <<  0;
+	
+	/* Lookup the station number */
+	i = _lookup_station(s, (char *) &data[0x06]);
+	
+	return(_feed_packet(s, i, counter, timestamp, data, 0));
+}
+
+#ifdef _CLASSIFY_SSE2
+
+static void _classify(_batch_t *b, uint8_t **data, int count)
+{
+	__m128i hdr, prev = _mm_setzero_si128();
+	uint32_t ts;
+	int i, f;
+	
+	/* As the portable version below. The 16 byte MX header is loaded
+	 * once, and compared with the last packet's callsign in one step.
+	 * The packet ID and counter are read little-endian from it */
+	
+	for(i = 0; i < count; i++)
+	{
+		hdr = _mm_loadu_si128((__m128i *) data[i]);
+		b->counter[i] = _mm_cvtsi128_si32(_mm_srli_si128(hdr, 2));
+		
+		/* The sync byte, and the adaptation field flag in bit 29 */
+		memcpy(&ts, &data[i][0x10], 4);
+		
+		switch(_mm_cvtsi128_si32(hdr) & 0xFFFF)
+		{
+		case 0x55A1:
+			f = _BATCH_TS;
+			if((ts & 0x200000FF) == TS_HEADER_SYNC) f |= _BATCH_SIMPLE;
+			break;
+		
+		case 0x55A3:
+		case 0x55A4:
+			f = _BATCH_FEC;
+			break;
+		
+		default:
+			f = 0;
+			break;
+		}
+		
+		/* The callsign is in bytes 6 to 15 */
+		if(i > 0 && (_mm_movemask_epi8(_mm_cmpeq_epi8(hdr, prev)) & 0xFFC0) == 0xFFC0)
+		{
+			f |= _BATCH_RUN;
+		}
+		
+		b->flags[i] = f;
+		prev = hdr;
+	}
+}
+
+#else
+
+static void _classify(_batch_t *b, uint8_t **data, int count)
+{
+	uint8_t *d;
+	int i, type;
+	
+	/* Reads the packet ID, counter and TS header of each packet in
+	 * one pass, and marks runs of packets from the same callsign */
+	
+	for(i = 0; i < count; i++)
+	{
+		d = data[i];
+		type = d[0x01] << 8 | d[0x00];
+		
+		b->counter[i] = (uint32_t) d[0x05] << 24
+		              | (uint32_t) d[0x04] << 16
+		              | (uint32_t) d[0x03] <<  8
+		              | (uint32_t) d[0x02] <<  0;
+		
+		b->flags[i] = 0;
+		
+		if(type == 0x55A1)
+		{
+			b->flags[i] |= _BATCH_TS;
+			
+			/* A sync byte and no adaptation field */
+			if(d[0x10] == TS_HEADER_SYNC && (d[0x13] & 0x20) == 0)
+			{
+				b->flags[i] |= _BATCH_SIMPLE;
+			}
+		}
+		else if(type == 0x55A3 || type == 0x55A4)
+		{
+			b->flags[i] |= _BATCH_FEC;
+		}
+		
+		if(i > 0 && memcmp(&d[0x06], &data[i - 1][0x06], 10) == 0)
+		{
+			b->flags[i] |= _BATCH_RUN;
+		}
+	}
+}
+
+#endif
+
+void mx_feed_batch(mx_t *s, int64_t timestamp, uint8_t **data, int64_t *arrival, int count, int *station)
+{
+	_batch_t b;
+	int i, n;
+	
+	/* Feeds up to MX_BATCH packets. The packet headers are classified
+	 * together first, then each run of packets from one station shares
+	 * a single station lookup. Each packet's receive time is taken from
+	 * arrival[], or is timestamp if that is NULL. The station number
+	 * for each packet is written to station[] */
+	
+	s->timestamp = timestamp;
+	
+	_classify(&b, data, count);
+	
+	for(i = 0, n = -1; i < count; i++)
+	{
+		if((b.flags[i] & (_BATCH_TS | _BATCH_FEC)) == 0)
+		{
+			/* Invalid header. Ignore this packet */
+			station[i] = n = -1;
+			continue;
+		}
+		
+		/* Lookup the station number, unless the last packet was
+		 * from the same callsign and its station is known */
+		if(n < 0 || (b.flags[i] & _BATCH_RUN) == 0)
+		{
+			n = _lookup_station(s, (char *) &data[i][0x06]);
+		}
+		
+		station[i] = n = _feed_packet(s, n, b.counter[i],
+			(arrival != NULL ? arrival[i] : timestamp),
+			data[i], b.flags[i] & _BATCH_SIMPLE);
+	}
 }
 
 int mx_update(mx_t *s, int64_t timestamp)
 {
 	int i;
-	mx_packet_t *o, *l, *r, *p;
+	mx_packet_t *o, *r, *p, *best_r = NULL;
 	uint64_t pcr, best_pcr;
 	uint32_t counter;
-	int best_station;
+	int64_t behind = 0;
+	int best_station, splice, last;
 	
 	/* Update the global timestamp */
 	s->timestamp = timestamp;
 	
-	/* Fetch the timestamp of the last packet sent, or 0 */
+	/* Fetch the timestamp of the last packet output, or 0. Its station
+	 * may have reset or timed out since, so a copy is kept. That is
+	 * only trusted for a guard period after the last output */
 	o = _get_packet(s, s->next_station, s->next_counter);
-	pcr = (o != NULL ? o->header.pcr_base : 0);
+	last = (o != NULL || (s->seq > 0 && s->next_timestamp > timestamp - MX_MS(_GUARD_MS)));
+	pcr = (last ? s->next_pcr : 0);
 	
 	best_station = -1;
 	best_pcr = 0;
@@ -290,29 +2220,77 @@ int mx_update(mx_t *s, int64_t timestamp)
 	{
 		/* Skip inactive stations */
 		if(s->station[i].sid[0] == '\0') continue;
-		if(s->station[i].timestamp <= s->timestamp - _TIMEOUT_MS) continue;
+		if(s->station[i].timestamp <= s->timestamp - MX_MS(_TIMEOUT_MS))
+		{
+			/* Return the memory of stations that have timed out */
+			if(s->station[i].blocks > 0)
+			{
+				_free_blocks(s, i, 1);
+				if(s->dedup) _compact_payloads(s);
+			}
+			
+			continue;
+		}
 		
-		while((p = _next_segment(s, i, &r)) != NULL)
+		if(s->station[i].retired)
 		{
-			/* Skip past segments with weird or invalid PCR timings */
-			/* TODO: This won't handle clock roll-over well */
-			if(p->header.pcr_base >= r->header.pcr_base) continue;
-			if(r->header.pcr_base - p->header.pcr_base > _SEGMENT_PCR_LIMIT) continue;
+			/* A retired slot is given up once its packets are
+			 * past the guard period, and have been output */
+			if(s->station[i].timestamp <= s->timestamp - MX_MS(_GUARD_MS * 2))
+			{
+				_free_blocks(s, i, 1);
+				memset(&s->station[i], 0, sizeof(mx_station_t));
+				if(s->dedup) _compact_payloads(s);
+				continue;
+			}
+		}
+		else
+		{
+			/* Fit the buffer to the station's packet rate */
+			_update_size(s, i);
 			
-			/* Stop when we are at or ahead of the last sent segment */
-			if(p->header.pcr_base >= pcr) break;
+			/* Rebuild any lost packets that the parity data allows */
+			_fec_recover(s, i);
 		}
 		
-		/* Didn't find a newer segment? */
-		if(p == NULL) continue;
+		/* A segment offered before but not used is offered again */
+		if((p = _unused_segment(s, i, pcr, &r)) == NULL)
+		{
+			while((p = _next_segment(s, i, &r)) != NULL)
+			{
+				/* Skip past segments with weird or invalid PCR timings */
+				/* TODO: This won't handle clock roll-over well */
+				if(_data(s, p)->header.pcr_base >= _data(s, r)->header.pcr_base) continue;
+				if(_data(s, r)->header.pcr_base - _data(s, p)->header.pcr_base > _SEGMENT_PCR_LIMIT) continue;
+				
+				/* Stop when we are at or ahead of the last sent segment.
+				 * If that is no longer trusted, skip past segments that
+				 * overlap the output ring instead */
+				if(_data(s, p)->header.pcr_base < pcr) continue;
+				if(pcr > 0 || !_segment_output(s, p)) break;
+			}
+		}
+		
+		/* Didn't find a newer segment? Note when the station last
+		 * received a packet, if it is still to reach the end of the
+		 * last segment output */
+		if(p == NULL)
+		{
+			p = _get_packet(s, i, s->station[i].right);
+			if(p != NULL && _data(s, p)->header.pcr_base <= pcr &&
+			   s->station[i].timestamp > behind) behind = s->station[i].timestamp;
+			
+			continue;
+		}
 		
 		/* Track which station is offering the "best" segment to use next */
-		if(best_station == -1 || p->header.pcr_base < best_pcr)
+		if(best_station == -1 || _data(s, p)->header.pcr_base < best_pcr)
 		{
 			best_station = i;
-			best_pcr = p->header.pcr_base;
+			best_pcr = _data(s, p)->header.pcr_base;
+			best_r = r;
 		}
-		else if(p->header.pcr_base == best_pcr)
+		else if(_data(s, p)->header.pcr_base == best_pcr)
 		{
 			/* TODO: Use segment and station score to decide
 			 * if we should switch to this station next */
@@ -321,35 +2299,47 @@ int mx_update(mx_t *s, int64_t timestamp)
 	
 	if(best_station == -1) return(0);
 	
-	/* Link the packets inside the segment */
-	l = NULL;
+	/* A segment that skips ahead is held back for a while if a station
+	 * behind was still receiving after it, and so may still have the
+	 * segments in between */
+	s->skip_deadline = 0;
+	if(last && best_pcr > pcr && behind > best_r->timestamp &&
+	   best_r->timestamp + MX_MS(_GUARD_MS + _SKIP_WAIT_MS) > s->timestamp)
+	{
+		s->skip_deadline = best_r->timestamp + MX_MS(_GUARD_MS + _SKIP_WAIT_MS);
+		return(0);
+	}
+	
+	/* Switching station or skipping ahead is a splice. Each PID
+	 * is checked for continuity in the first segment after it */
+	splice = (best_station != s->next_station || !last || pcr != best_pcr);
+	if(splice) s->splice++;
+	
+	/* Copy the packets of the segment to the output */
 	for(counter = s->station[best_station].left; counter != s->station[best_station].right + 1; counter++)
 	{
 		p = _get_packet(s, best_station, counter);
-		if(p == NULL) continue;
 		
-		/* Link the last packet to this one */
-		if(l != NULL)
+		/* Fill any hole from another station */
+		if(p == NULL)
 		{
-			l->next_station = p->station;
-			l->next_counter = p->counter;
+			counter = _fill_hole(s, best_station, counter, s->station[best_station].right, splice) - 1;
+			continue;
 		}
 		
-		l = p;
-	}
-	
-	/* Link the previous segment to this one */
-	if(o != NULL)
-	{
-		p = _get_packet(s, best_station, s->station[best_station].left);
+		/* The first packet is skipped when it repeats the last segment's PCR */
+		if(counter == s->station[best_station].left && last && pcr == best_pcr) continue;
+		
+		if(splice && _splice_packet(s, best_station, s->station[best_station].left, p) == 0) continue;
 		
-		o->next_station = p->station;
-		o->next_counter = (pcr == best_pcr ? p->next_counter : p->counter);
+		_output(s, p);
 	}
 	
-	/* Update pointer for new stations */
+	/* Update pointer to the last packet output */
 	s->next_station = best_station;
 	s->next_counter = s->station[s->next_station].right;
+	s->next_pcr = _data(s, best_r)->header.pcr_base;
+	s->next_timestamp = timestamp;
 	
 	//printf("s->next_station = %d\n", s->next_station);
 	//printf("s->next_counter = %d\n", s->next_counter);
@@ -357,15 +2347,268 @@ int mx_update(mx_t *s, int64_t timestamp)
 	return(1);
 }
 
-mx_packet_t *mx_next(mx_t *s, int last_station, uint32_t last_counter)
+uint64_t mx_seq(mx_t *s)
+{
+	/* Returns the next output sequence number. Output packets and
+	 * their details before this can be read from any thread */
+	return(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE));
+}
+
+int mx_read(mx_t *s, uint64_t seq, uint8_t **data)
 {
-	mx_packet_t *p = _get_packet(s, last_station, last_counter);
+	uint64_t head = mx_seq(s);
+	uint64_t n;
 	
-	/* Fetch a pointer to the next packet in the chain, or if no
-	 * previous valid packet use the latest segment in s */
-	if(p == NULL) p = _get_packet(s, s->next_station, s->next_counter);
-	else          p = _get_packet(s, p->next_station, p->next_counter);
+	/* Returns the number of output packets available in one
+	 * contiguous block starting at seq, and a pointer to them.
+	 * Returns -1 if seq has already been overwritten */
 	
-	return(p);
+	if(seq >= head) return(0);
+	if(head - seq > _OUTPUT_PACKETS) return(-1);
+	
+	n = head - seq;
+	
+	/* Stop at the end of the ring */
+	if(n > _OUTPUT_PACKETS - (seq & (_OUTPUT_PACKETS - 1)))
+	{
+		n = _OUTPUT_PACKETS - (seq & (_OUTPUT_PACKETS - 1));
+	}
+	
+	*data = s->out[seq & (_OUTPUT_PACKETS - 1)];
+	
+	return(n);
+}
+
+mx_output_t *mx_info(mx_t *s, uint64_t seq)
+{
+	uint64_t head = mx_seq(s);
+	
+	/* Returns the details of an output packet, or NULL if it
+	 * has not been output yet or has been overwritten */
+	if(seq >= head || head - seq > _OUTPUT_PACKETS) return(NULL);
+	
+	return(&s->out_info[seq & (_OUTPUT_PACKETS - 1)]);
+}
+
+uint64_t mx_rap(mx_t *s)
+{
+	uint64_t head = mx_seq(s);
+	int64_t rap = __atomic_load_n(&s->rap_seq, __ATOMIC_RELAXED);
+	
+	/* Returns the position of the most recent random access point
+	 * in the output, or the end of the output if there is none */
+	if(rap < 0 || head - rap > _OUTPUT_PACKETS) return(head);
+	
+	return(rap);
+}
+
+uint64_t mx_join(mx_t *s, uint8_t *psi, int *psi_len)
+{
+	uint64_t head;
+	int64_t rap;
+	uint32_t gen;
+	int len;
+	
+	/* Returns the position a new viewer should start from, the most
+	 * recent random access point. The PAT and PMT in effect there are
+	 * copied to psi (up to MX_JOIN_PSI_LEN bytes), to be sent first.
+	 * The copy is retried if the merger updated them meanwhile */
+	do
+	{
+		gen = __atomic_load_n(&s->rap_gen, __ATOMIC_ACQUIRE);
+		if(gen & 1) continue;
+		
+		head = mx_seq(s);
+		rap = __atomic_load_n(&s->rap_seq, __ATOMIC_RELAXED);
+		len = s->rap_psi_len;
+		
+		if(len < 0 || len > MX_JOIN_PSI_LEN) len = 0;
+		memcpy(psi, s->rap_psi, len);
+		
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	}
+	while((gen & 1) || gen != __atomic_load_n(&s->rap_gen, __ATOMIC_RELAXED));
+	
+	if(rap < 0 || head - rap > _OUTPUT_PACKETS)
+	{
+		*psi_len = 0;
+		return(head);
+	}
+	
+	*psi_len = len;
+	
+	return(rap);
 }
 
+int mx_nack(mx_t *s, int station, int64_t timestamp, uint8_t *data)
+{
+	mx_station_t *st;
+	mx_nack_t *n;
+	int i, ranges;
+	int32_t d;
+	
+	/* Builds a NACK packet listing the packets still missing from
+	 * this station. Returns the length of the packet, or 0 if there
+	 * is nothing to request yet */
+	
+	if(station < 0 || station >= _STATIONS) return(0);
+	
+	st = &s->station[station];
+	if(st->sid[0] == '\0' || st->retired) return(0);
+	if(st->timestamp <= s->timestamp - MX_MS(_TIMEOUT_MS)) return(0);
+	
+	ranges = 0;
+	
+	for(i = 0; i < _NACK_RANGES; i++)
+	{
+		n = &st->nack[i];
+		if(n->length == 0) continue;
+		
+		/* Give up when a retransmission would arrive too late */
+		if(timestamp - n->timestamp > MX_MS(_NACK_TIMEOUT_MS) ||
+		   n->retries >= _NACK_RETRIES)
+		{
+			n->length = 0;
+			continue;
+		}
+		
+		/* Don't request packets the stream has already moved past */
+		d = (int32_t) st->current - (int32_t) n->counter;
+		if(d > 0)
+		{
+			if(d >= n->length)
+			{
+				n->length = 0;
+				continue;
+			}
+			
+			n->counter += d;
+			n->length -= d;
+		}
+		
+		/* Trim any packets that have arrived since */
+		while(n->length > 0 && _get_packet(s, station, n->counter) != NULL)
+		{
+			n->counter++;
+			n->length--;
+		}
+		
+		while(n->length > 0 && _get_packet(s, station, n->counter + n->length - 1) != NULL)
+		{
+			n->length--;
+		}
+		
+		if(n->length == 0) continue;
+		
+		/* Wait a moment in case the packets were only reordered,
+		 * and rate limit repeated requests for the same range */
+		if(timestamp - n->timestamp < MX_MS(_NACK_DELAY_MS)) continue;
+		if(timestamp - n->sent < MX_MS(_NACK_INTERVAL_MS)) continue;
+		
+		/* Add the range to the packet (6 bytes little-endian) */
+		data[0x10 + ranges * 6 + 0] = (n->counter & 0x000000FF) >>  0;
+		data[0x10 + ranges * 6 + 1] = (n->counter & 0x0000FF00) >>  8;
+		data[0x10 + ranges * 6 + 2] = (n->counter & 0x00FF0000) >> 16;
+		data[0x10 + ranges * 6 + 3] = (n->counter & 0xFF000000) >> 24;
+		data[0x10 + ranges * 6 + 4] = (n->length & 0x00FF) >> 0;
+		data[0x10 + ranges * 6 + 5] = (n->length & 0xFF00) >> 8;
+		
+		n->sent = timestamp;
+		n->retries++;
+		st->nacked += n->length;
+		ranges++;
+	}
+	
+	if(ranges == 0) return(0);
+	
+	/* Packet header */
+	data[0x00] = 0xA2;
+	data[0x01] = 0x55;
+	data[0x02] = ranges;
+	data[0x03] = 0x00;
+	data[0x04] = 0x00;
+	data[0x05] = 0x00;
+	memcpy(&data[0x06], st->sid, 10);
+	
+	return(0x10 + ranges * 6);
+}
+
+int64_t mx_next_deadline(mx_t *s, int64_t timestamp)
+{
+	mx_station_t *st;
+	mx_nack_t *n;
+	int64_t deadline, t;
+	int i, j;
+	
+	/* Returns the next time after timestamp that mx_update() or
+	 * mx_nack() will have work to do, without any new packets.
+	 * That is when the next PCR packet leaves the guard period, a
+	 * segment held back from skipping ahead is due, or a missing
+	 * range is due to be requested. Returns INT64_MAX if there is
+	 * nothing to wait for */
+	
+	deadline = INT64_MAX;
+	if(s->skip_deadline > timestamp) deadline = s->skip_deadline;
+	
+	for(i = 0; i < _STATIONS; i++)
+	{
+		st = &s->station[i];
+		
+		if(st->sid[0] == '\0') continue;
+		if(st->timestamp <= s->timestamp - MX_MS(_TIMEOUT_MS)) continue;
+		
+		t = _pcr_deadline(st, timestamp);
+		if(t < deadline) deadline = t;
+		
+		for(j = 0; j < _NACK_RANGES; j++)
+		{
+			n = &st->nack[j];
+			if(n->length == 0) continue;
+			
+			t = n->timestamp + MX_MS(_NACK_DELAY_MS);
+			if(t < n->sent + MX_MS(_NACK_INTERVAL_MS)) t = n->sent + MX_MS(_NACK_INTERVAL_MS);
+			
+			if(t > timestamp && t < deadline) deadline = t;
+		}
+	}
+	
+	return(deadline);
+}
+
+void mx_print_stats(mx_t *s)
+{
+	mx_station_t *st;
+	int i;
+	
+	for(i = 0; i < _STATIONS; i++)
+	{
+		st = &s->station[i];
+		
+		if(st->sid[0] == '\0') continue;
+		if(st->timestamp <= s->timestamp - MX_MS(_TIMEOUT_MS)) continue;
+		
+		printf("Station %d %-10.10s: %u packets/s, %u packet buffer, %llu nacked, %llu fec recovered, %llu fec unrecoverable, %llu fec rejected\n",
+			i, st->sid, st->pps, st->size,
+			(unsigned long long) st->nacked,
+			(unsigned long long) st->fec_recovered,
+			(unsigned long long) st->fec_unrecoverable,
+			(unsigned long long) st->fec_rejected
+		);
+	}
+	
+	printf("Output: %u splices, %llu duplicates dropped, %llu packets filled, %llu continuity errors at splices\n",
+		s->splice,
+		(unsigned long long) s->splice_duplicates,
+		(unsigned long long) s->splice_filled,
+		(unsigned long long) s->splice_cc_errors
+	);
+	
+	printf("Output: %llu packets missing from segments, %llu filled from other stations\n",
+		(unsigned long long) s->holes,
+		(unsigned long long) s->holes_filled
+	);
+	
+	printf("Payloads: %u stored, %u references\n",
+		s->payloads, s->payload_refs
+	);
+}
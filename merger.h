@@ -5,9 +5,62 @@
 #ifndef _MERGER_H
 #define _MERGER_H
 
-/* Maximum number of stations and packets */
+/* Maximum number of stations */
 #define _STATIONS 8
-#define _PACKETS  UINT16_MAX
+
+/* Station buffers are made of blocks taken from a shared pool as
+ * they are needed (_BLOCK_PACKETS must be a power of 2). The pool
+ * is sized from the memory budget, up to _POOL_BLOCKS */
+#define _BLOCK_PACKETS 4096
+#define _POOL_BLOCKS   1024
+
+/* Limits and starting size of a station buffer, in packets. The
+ * size is always a power of 2 and a multiple of _BLOCK_PACKETS */
+#define _MIN_PACKETS     (_BLOCK_PACKETS * 2)
+#define _MAX_PACKETS     (_BLOCK_PACKETS * 256)
+#define _INITIAL_PACKETS 65536
+#define _STATION_BLOCKS  (_MAX_PACKETS / _BLOCK_PACKETS)
+
+/* Timestamps are in microseconds, on a clock that does not step.
+ * Durations below are in ms, and converted with MX_MS() */
+#define MX_MS(ms) ((int64_t) (ms) * 1000)
+
+/* Default time each station buffer should hold at the station's
+ * measured rate, and the memory budget for all station buffers */
+#define MX_RETENTION_MS 5000
+#define MX_BUFFER_MB    512
+
+/* Interval over which the station packet rate is measured (ms) */
+#define _RATE_INTERVAL_MS 1000
+
+/* Number of packets in the output ring (must be a power of 2) */
+#define _OUTPUT_PACKETS 65536
+
+/* Set in mx_t out_cc[] for PIDs that have been output */
+#define _CC_SEEN 0x10
+
+/* Number of packets searched on either side of a splice
+ * for packets skipped over on each PID */
+#define _SPLICE_WINDOW 64
+
+/* Number of output packets searched back at a splice for the
+ * last turn of the continuity counter on each PID */
+#define _SPLICE_OUTPUT_WINDOW 4096
+
+/* The payload store holds a payload for every pool slot, so each
+ * can hold a different packet. It has a hash chain for about every
+ * _PAYLOADS_PER_BUCKET payloads */
+#define _PAYLOADS_PER_BUCKET 4
+
+/* Memory used by a block of the pool, with a payload for each slot */
+#define _BLOCK_BYTES (_BLOCK_PACKETS * (sizeof(mx_packet_t) + sizeof(mx_payload_t)))
+
+/* The index of station packets by content has a slot for about every
+ * pool slot. The largest run of another station's packets that will
+ * be used to fill a hole, and the number of packets on each side of
+ * a hole tried as anchors (see _anchor_distance in merger.c) */
+#define _FILL_MAX_PACKETS 1024
+#define _FILL_ANCHORS 8
 
 /* Station timeout in milliseconds */
 #define _TIMEOUT_MS 10000
@@ -15,12 +68,54 @@
 /* Guard period in milliseconds */
 #define _GUARD_MS 1000
 
+/* Longest time in milliseconds a segment that skips ahead of the
+ * output is held back, while a slower station may still deliver
+ * the segments in between */
+#define _SKIP_WAIT_MS 200
+
+/* Number of PCR packets per station waiting for the end of their
+ * guard period, whose times are kept for mx_next_deadline() */
+#define _PCR_QUEUE 256
+
 /* Maximum PCR range for a segment */
 #define _SEGMENT_PCR_LIMIT (90000 / 2) /* 500ms (90kHz clock) */
 
+/* Largest PSI sent ahead of the stream by mx_join() */
+#define MX_JOIN_PSI_LEN (TS_PACKET_SIZE * 2)
+
 /* Length of MX packet */
 #define MX_PACKET_LEN (0x10 + TS_PACKET_SIZE)
 
+/* Maximum number of MX packets passed to mx_feed_batch() */
+#define MX_BATCH 64
+
+/* Number of missing counter ranges tracked per station */
+#define _NACK_RANGES 16
+
+/* Largest gap that will be requested again, in packets */
+#define _NACK_MAX_GAP 1024
+
+/* Time to wait before requesting a missing packet, in case it is only
+ * reordered, the interval between repeat requests, and the number of
+ * times a range is requested (ms) */
+#define _NACK_DELAY_MS 10
+#define _NACK_INTERVAL_MS 50
+#define _NACK_RETRIES 3
+
+/* Missing packets are only requested while a retransmission
+ * can still arrive inside the guard period */
+#define _NACK_TIMEOUT_MS (_GUARD_MS / 2)
+
+/* Maximum length of a NACK packet */
+#define MX_NACK_LEN (0x10 + _NACK_RANGES * 6)
+
+/* Number of parity packets held per station while waiting for data */
+#define _FEC_PACKETS 64
+
+/* Maximum FEC matrix dimensions */
+#define MX_FEC_MAX_L 15
+#define MX_FEC_MAX_D 15
+
 /* Packet structure: (little endian)
  *
  * uint16_t type    = Packet type identifier, always 0x55A1
@@ -28,55 +123,206 @@
  * char station[10] = Station callsign (eg. "MI0VIM-15"). Unused bytes set to 0x00.
 */
 
+/* NACK packet structure, sent by the merger back to a station: (little endian)
+ *
+ * uint16_t type    = Packet type identifier, always 0x55A2
+ * uint16_t ranges  = Number of missing ranges that follow the header
+ * uint16_t reserved
+ * char station[10] = Station callsign
+ * 
+ * Followed by each missing range:
+ * 
+ * uint32_t counter = The first missing packet counter
+ * uint16_t length  = The number of missing packets
+*/
+
+/* Parity packet structure, sent by a station alongside its TS packets: (little endian)
+ *
+ * uint16_t type    = Packet type identifier, 0x55A3 for column or 0x55A4 for row parity
+ * uint32_t counter = Counter of the first packet covered
+ * char station[10] = Station callsign
+ * 
+ * Followed by the 188 byte XOR of the covered TS packets. The first byte,
+ * which would otherwise hold the XOR of the sync bytes, is replaced with
+ * the matrix size as (L << 4) | D.
+ * 
+ * A row parity packet covers L packets: counter, counter + 1, ...
+ * A column parity packet covers D packets: counter, counter + L, ...
+*/
+
+#define MX_FEC_COLUMN 1
+#define MX_FEC_ROW    2
+
 typedef struct {
 	
-	/* The station number */
-	int station;
+	/* Parity type (0 == unused), matrix size and first packet covered */
+	int type;
+	int l;
+	int d;
+	uint32_t counter;
 	
-	/* The station packet counter */
+	/* The receive time of the parity packet (in us) */
+	int64_t timestamp;
+	
+	/* The missing packet found by the last recovery attempt */
+	uint32_t missing;
+	
+	/* The parity data */
+	uint8_t raw[TS_PACKET_SIZE];
+	
+} mx_fec_t;
+
+typedef struct {
+	
+	/* The first missing packet counter and number of packets (0 == unused) */
+	uint32_t counter;
+	uint16_t length;
+	
+	/* Time the gap was detected, and the last time it was requested (in us) */
+	int64_t timestamp;
+	int64_t sent;
+	
+	/* Number of times this range has been requested */
+	int retries;
+	
+} mx_nack_t;
+
+typedef struct {
+	
+	/* Station counter of the packet, and the top 32 bits
+	 * of its hash to check the slot before comparing */
 	uint32_t counter;
+	uint32_t check;
+	
+} mx_index_t;
+
+typedef struct {
 	
-	/* The receive time of the packet (in ms) */
+	/* Station counter and receive time (in us) of a PCR packet */
+	uint32_t counter;
 	int64_t timestamp;
 	
+} mx_pcr_t;
+
+typedef struct {
+	
+	/* Number of station slots referring to the payload (0 == free),
+	 * and the next payload in its hash chain or the free list */
+	uint32_t refs;
+	uint32_t next;
+	
+	/* Set if the payload is in a hash chain, with its hash */
+	int hashed;
+	uint64_t hash;
+	
 	/* Packet error flag, 0 == No Error, 1 = Error (header not populated) */
 	int error;
 	
 	/* Parsed header */
 	ts_header_t header;
 	
-	/* Processed flag */
-	//int processed;
-	
 	/* A copy of the raw TS packet */
 	uint8_t raw[TS_PACKET_SIZE];
 	
-	/* Branch information */
-	int next_station;
-	uint32_t next_counter;
+} mx_payload_t;
+
+typedef struct {
+	
+	/* The station number, and the station's epoch when the
+	 * packet was stored. The slot is only valid while they match */
+	int station;
+	uint32_t epoch;
+	
+	/* The station packet counter */
+	uint32_t counter;
+	
+	/* The packet contents in the payload store (0 == none). Each
+	 * slot holds a reference to its payload while this is set */
+	uint32_t payload;
+	
+	/* The receive time of the packet (in us) */
+	int64_t timestamp;
 	
 } mx_packet_t;
 
+#define MX_OUTPUT_PUSI 0x01
+#define MX_OUTPUT_RAI  0x02
+#define MX_OUTPUT_PCR  0x04
+
+typedef struct {
+	
+	/* The receive time of the packet, and the time
+	 * it was added to the output (in us) */
+	int64_t timestamp;
+	int64_t output_timestamp;
+	
+	/* The packet PID (TS_NULL_PID if the header was invalid) and flags */
+	uint16_t pid;
+	uint8_t flags;
+	
+	/* The PCR, if MX_OUTPUT_PCR is set */
+	uint64_t pcr_base;
+	
+} mx_output_t;
+
 typedef struct {
 	
 	/* The station ID */
 	char sid[10];
 	
+	/* Epoch number, changed each time the station is reset */
+	uint32_t epoch;
+	
 	/* The current position in the stream */
 	uint32_t current;
 	
 	/* The latest position in the stream */
 	uint32_t latest;
 	
-	/* The receive time of the last packet (in ms) */
+	/* The receive time of the last packet (in us) */
 	int64_t timestamp;
 	
+	/* Set once the station has restarted its counter and carried on in
+	 * another slot. The packets from before are kept here to be output */
+	int retired;
+	
 	/* The current segment (if left == right, no segment) */
 	uint32_t left;
 	uint32_t right;
 	
-	/* The station packet buffer */
-	mx_packet_t packet[_PACKETS];
+	/* PCR packets on the PCR PID in the order received, from
+	 * pcr_queue[pcr_head], not yet passed by the stream position */
+	mx_pcr_t pcr_queue[_PCR_QUEUE];
+	int pcr_head;
+	int pcr_count;
+	
+	/* Missing packet ranges to be requested again */
+	mx_nack_t nack[_NACK_RANGES];
+	int nack_next;
+	
+	/* Number of packets requested again */
+	uint64_t nacked;
+	
+	/* Parity packets waiting to be used */
+	mx_fec_t fec[_FEC_PACKETS];
+	int fec_next;
+	
+	/* Packets rebuilt from parity data, parity packets that could not
+	 * be used, and rebuilt packets that failed the sanity checks */
+	uint64_t fec_recovered;
+	uint64_t fec_unrecoverable;
+	uint64_t fec_rejected;
+	
+	/* The station packet buffer. Packet n is stored in pool block
+	 * block[(n % size) / _BLOCK_PACKETS] - 1 (0 == no block yet) */
+	uint32_t size;
+	int block[_STATION_BLOCKS];
+	int blocks;
+	
+	/* Packets received since rate_timestamp, and the last measured rate */
+	uint32_t rate_packets;
+	int64_t rate_timestamp;
+	uint32_t pps;
 	
 } mx_station_t;
 
@@ -88,19 +334,169 @@ typedef struct {
 	/* The current timestamp */
 	int64_t timestamp;
 	
-	/* Pointer to the latest packet */
+	/* Pointer to the last packet output, its PCR, and when it was output */
 	int next_station;
 	uint32_t next_counter;
+	uint64_t next_pcr;
+	int64_t next_timestamp;
+	
+	/* When a segment held back from skipping ahead is output
+	 * anyway, or 0 if none is being held back */
+	int64_t skip_deadline;
 	
 	/* The station array */
 	mx_station_t station[_STATIONS];
 	
+	/* The output ring. Output packet n is stored at
+	 * out[n & (_OUTPUT_PACKETS - 1)] */
+	uint8_t out[_OUTPUT_PACKETS][TS_PACKET_SIZE];
+	mx_output_t out_info[_OUTPUT_PACKETS];
+	
+	/* The next output sequence number. This is the publication point
+	 * for viewer threads, it is only advanced after the packet and its
+	 * details have been written. Use mx_seq() to read it from them */
+	uint64_t seq;
+	
+	/* Output position of the latest random access point on the PCR PID,
+	 * or -1. Packets with the payload unit start indicator set are used
+	 * until one with the random access indicator has been seen */
+	int64_t rap_seq;
+	int rai_seen;
+	
+	/* The latest PAT and PMT (for the first program) output, and
+	 * copies of them as they were at the random access point */
+	uint16_t pmt_pid;
+	int have_pat;
+	int have_pmt;
+	uint8_t pat[TS_PACKET_SIZE];
+	uint8_t pmt[TS_PACKET_SIZE];
+	int rap_psi_len;
+	uint8_t rap_psi[MX_JOIN_PSI_LEN];
+	
+	/* Odd while rap_seq and rap_psi are being updated, so mx_join()
+	 * can take a consistent copy of them from another thread */
+	uint32_t rap_gen;
+	
+	/* Continuity counter of the last packet output on each PID, with
+	 * _CC_SEEN set once the PID has been output, and its position */
+	uint8_t out_cc[TS_PID_COUNT];
+	uint64_t out_pid_seq[TS_PID_COUNT];
+	
+	/* Splice number, increased each time the output switches station or
+	 * skips ahead. A PID has been checked for continuity across the
+	 * latest splice once out_splice[pid] matches */
+	uint32_t splice;
+	uint32_t out_splice[TS_PID_COUNT];
+	
+	/* Packets dropped as duplicates at splices, packets filled in
+	 * from before the splice, and continuity errors left by splices */
+	uint64_t splice_duplicates;
+	uint64_t splice_filled;
+	uint64_t splice_cc_errors;
+	
+	/* Packets missing from the segments output, and packets
+	 * filled in from other stations */
+	uint64_t holes;
+	uint64_t holes_filled;
+	
+	/* The last epoch number given to a station */
+	uint32_t epoch;
+	
+	/* Time each station buffer should hold (ms), and the
+	 * number of pool blocks all stations may reserve */
+	int retention_ms;
+	int budget_blocks;
+	
+	/* Free pool blocks */
+	int pool_free[_POOL_BLOCKS];
+	int pool_free_count;
+	
+	/* Set to share one payload between all the station slots holding
+	 * identical packets. Otherwise each slot keeps its packet in the
+	 * payload at the same position in the store as the slot is in the
+	 * pool, and the store is used like the pool */
+	int dedup;
+	
+	/* The payload free list, the number of payloads taken from the
+	 * store, and those in use and references to them. The free list
+	 * and payload_top are only used with dedup set */
+	uint32_t payload_free;
+	uint32_t payload_top;
+	uint32_t payloads;
+	uint32_t payload_refs;
+	
+	/* The number of blocks in the pool, and of payload hash chains and
+	 * index slots (both powers of 2). They are set from the memory
+	 * budget when the merger is opened. These must stay last in mx_t
+	 * with the pointers below, mx_init() doesn't clear them */
+	int pool_blocks;
+	uint32_t payload_buckets;
+	uint32_t index_size;
+	
+	/* The payload hash chains, payload store, packet pool and index,
+	 * which follow mx_t in the same mapping. The chains are only
+	 * touched with dedup set. Payload 0 is never used. With dedup,
+	 * payloads are taken from the free list first, and the store is
+	 * compacted once most of it is free, so it is only touched as far
+	 * as the payloads held. Unused blocks are never touched.
+	 * 
+	 * The index holds station packets by content, so a hole in one
+	 * station's segment can be filled from another station's copy.
+	 * The slot is picked by the packet hash and the station, and may
+	 * have been reused */
+	uint32_t *payload_bucket;
+	mx_payload_t *payload;
+	mx_packet_t (*pool)[_BLOCK_PACKETS];
+	mx_index_t *index;
+	
 } mx_t;
 
+/* State files hold this header, followed by mx_t at MX_STATE_OFFSET and
+ * the pool and payload store. MX_STATE_VERSION must be increased whenever
+ * the layout of mx_t changes */
+#define MX_STATE_MAGIC   "TSMERGE"
+#define MX_STATE_VERSION 15
+#define MX_STATE_OFFSET  4096
+
+typedef struct {
+	
+	/* Layout identification */
+	char magic[8];
+	uint32_t version;
+	uint32_t stations;
+	uint32_t packets;
+	uint32_t output_packets;
+	uint32_t pool_blocks;
+	uint64_t size;
+	
+	/* The PCR PID the state was built with */
+	uint16_t pcr_pid;
+	
+	/* Set while a process has the state open */
+	int running;
+	
+	/* Merger time of the last sync */
+	int64_t timestamp;
+	
+} mx_state_t;
+
 extern void mx_init(mx_t *s, uint16_t pcr_pid);
-extern void mx_feed(mx_t *s, int64_t timestamp, uint8_t *data);
+extern mx_t *mx_open(const char *path, uint16_t pcr_pid, int buffer_mb);
+extern void mx_set_buffers(mx_t *s, int retention_ms, int buffer_mb);
+extern void mx_set_dedup(mx_t *s, int dedup);
+extern void mx_sync(mx_t *s);
+extern void mx_close(mx_t *s);
+extern int mx_feed(mx_t *s, int64_t timestamp, uint8_t *data);
+extern void mx_feed_batch(mx_t *s, int64_t timestamp, uint8_t **data, int64_t *arrival, int count, int *station);
 extern int mx_update(mx_t *s, int64_t timestamp);
-extern mx_packet_t *mx_next(mx_t *s, int last_station, uint32_t last_counter);
+extern int mx_nack(mx_t *s, int station, int64_t timestamp, uint8_t *data);
+extern int64_t mx_next_deadline(mx_t *s, int64_t timestamp);
+extern void mx_print_stats(mx_t *s);
+extern uint64_t mx_seq(mx_t *s);
+extern int mx_read(mx_t *s, uint64_t seq, uint8_t **data);
+extern mx_output_t *mx_info(mx_t *s, uint64_t seq);
+extern uint64_t mx_rap(mx_t *s);
+extern uint64_t mx_join(mx_t *s, uint8_t *psi, int *psi_len);
 
 #endif
 
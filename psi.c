@@ -0,0 +1,247 @@
+/* psi.c/h - Simple DVB PSI (PAT/PMT) parser                             */
+/*=======================================================================*/
+/* Copyright (C)2026 The tsmerge contributors                            */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+
+#include <stdint.h>
+#include <string.h>
+#include "ts.h"
+#include "psi.h"
+
+uint32_t psi_crc32(const uint8_t *data, int length)
+{
+	uint32_t crc = 0xFFFFFFFF;
+	int i;
+	
+	/* MPEG-2 CRC32, polynomial 0x04C11DB7, no reflection */
+	while(length--)
+	{
+		crc ^= (uint32_t) *(data++) << 24;
+		
+		for(i = 0; i < 8; i++)
+		{
+			crc = (crc & 0x80000000 ? (crc << 1) ^ 0x04C11DB7 : crc << 1);
+		}
+	}
+	
+	return(crc);
+}
+
+static uint8_t *_section(ts_header_t *ts, uint8_t * const data, uint8_t table_id, int *length)
+{
+	uint8_t *sec;
+	int offset;
+	int l;
+	
+	/* Locates a complete section at the start of this packet's payload,
+	 * checks the header and CRC. Returns a pointer to the section */
+	
+	/* Sections must begin in this packet */
+	if(ts->payload_unit_start_indicator == 0 ||
+	   ts->payload_flag == 0) return(NULL);
+	
+	/* Skip the pointer field */
+	offset = ts->payload_offset;
+	if(offset >= TS_PACKET_SIZE) return(NULL);
+	offset += 1 + data[offset];
+	if(offset + 12 > TS_PACKET_SIZE) return(NULL);
+	
+	sec = &data[offset];
+	
+	/* Test the table ID and section_syntax_indicator */
+	if(sec[0] != table_id || (sec[1] & 0x80) == 0) return(NULL);
+	
+	/* The whole section must fit inside this packet */
+	l = 3 + (((sec[1] & 0x0F) << 8) | sec[2]);
+	if(l < 12 || offset + l > TS_PACKET_SIZE) return(NULL);
+	
+	/* Ignore tables that are not yet applicable */
+	if((sec[5] & 0x01) == 0) return(NULL);
+	
+	/* Test the CRC */
+	if(psi_crc32(sec, l - 4) != ((uint32_t) sec[l - 4] << 24
+	                           | (uint32_t) sec[l - 3] << 16
+	                           | (uint32_t) sec[l - 2] <<  8
+	                           | (uint32_t) sec[l - 1] <<  0))
+	{
+		return(NULL);
+	}
+	
+	*length = l;
+	
+	return(sec);
+}
+
+int psi_parse_pat(psi_pat_t *pat, ts_header_t *ts, uint8_t * const data)
+{
+	uint8_t *sec;
+	int i, l;
+	
+	memset(pat, 0, sizeof(psi_pat_t));
+	
+	sec = _section(ts, data, PSI_PAT_TABLE_ID, &l);
+	if(sec == NULL) return(TS_INVALID);
+	
+	pat->transport_stream_id = (sec[3] << 8) | sec[4];
+	pat->version_number = (sec[5] & 0x3E) >> 1;
+	
+	/* Program loop, up to the CRC */
+	for(i = 8; i + 4 <= l - 4; i += 4)
+	{
+		uint16_t program_number = (sec[i + 0] << 8) | sec[i + 1];
+		
+		/* Skip the network PID */
+		if(program_number == 0) continue;
+		
+		if(pat->programs == PSI_MAX_PROGRAMS) break;
+		
+		pat->program[pat->programs].program_number = program_number;
+		pat->program[pat->programs].pid = ((sec[i + 2] & 0x1F) << 8) | sec[i + 3];
+		pat->programs++;
+	}
+	
+	return(TS_OK);
+}
+
+int psi_parse_pmt(psi_pmt_t *pmt, ts_header_t *ts, uint8_t * const data)
+{
+	uint8_t *sec;
+	int i, l;
+	
+	memset(pmt, 0, sizeof(psi_pmt_t));
+	
+	sec = _section(ts, data, PSI_PMT_TABLE_ID, &l);
+	if(sec == NULL) return(TS_INVALID);
+	
+	pmt->program_number = (sec[3] << 8) | sec[4];
+	pmt->version_number = (sec[5] & 0x3E) >> 1;
+	pmt->pcr_pid = ((sec[8] & 0x1F) << 8) | sec[9];
+	
+	/* Skip the program info descriptors */
+	i = 12 + (((sec[10] & 0x0F) << 8) | sec[11]);
+	
+	/* Elementary stream loop, up to the CRC */
+	while(i + 5 <= l - 4)
+	{
+		if(pmt->streams == PSI_MAX_STREAMS) break;
+		
+		pmt->stream[pmt->streams].stream_type = sec[i];
+		pmt->stream[pmt->streams].pid = ((sec[i + 1] & 0x1F) << 8) | sec[i + 2];
+		pmt->streams++;
+		
+		i += 5 + (((sec[i + 3] & 0x0F) << 8) | sec[i + 4]);
+	}
+	
+	return(TS_OK);
+}
+
+static void _write_section(uint8_t *out, uint8_t * const data, uint8_t *sec, int l)
+{
+	uint32_t crc;
+	
+	/* Build a packet with the same header as data, carrying the
+	 * section in sec (of l bytes, including space for the CRC) */
+	
+	/* Keep the PID and continuity counter, with no adaptation field */
+	out[0] = data[0];
+	out[1] = data[1];
+	out[2] = data[2];
+	out[3] = 0x10 | (data[3] & 0x0F);
+	out[4] = 0x00;
+	
+	/* Update the section length and CRC */
+	sec[1] = (sec[1] & 0xF0) | ((l - 3) >> 8);
+	sec[2] = (l - 3) & 0xFF;
+	
+	crc = psi_crc32(sec, l - 4);
+	sec[l - 4] = crc >> 24;
+	sec[l - 3] = crc >> 16;
+	sec[l - 2] = crc >> 8;
+	sec[l - 1] = crc >> 0;
+	
+	memset(&out[5 + l], 0xFF, TS_PACKET_SIZE - 5 - l);
+}
+
+int psi_filter_pat(uint8_t *out, ts_header_t *ts, uint8_t * const data, const uint8_t *pids)
+{
+	uint8_t *sec, *o;
+	int i, l, n, programs;
+	
+	/* Write a copy of the PAT in data to out, listing only the
+	 * programs whose PMT PID is in pids. Returns the number of
+	 * programs kept, or -1 if the PAT is invalid */
+	
+	sec = _section(ts, data, PSI_PAT_TABLE_ID, &l);
+	if(sec == NULL) return(-1);
+	
+	o = &out[5];
+	memcpy(o, sec, 8);
+	n = 8;
+	programs = 0;
+	
+	for(i = 8; i + 4 <= l - 4; i += 4)
+	{
+		if(!TS_PIDS_TEST(pids, ((sec[i + 2] & 0x1F) << 8) | sec[i + 3])) continue;
+		
+		memcpy(&o[n], &sec[i], 4);
+		n += 4;
+		programs++;
+	}
+	
+	_write_section(out, data, o, n + 4);
+	
+	return(programs);
+}
+
+int psi_filter_pmt(uint8_t *out, ts_header_t *ts, uint8_t * const data, const uint8_t *pids)
+{
+	uint8_t *sec, *o;
+	int i, l, n, e, streams;
+	
+	/* Write a copy of the PMT in data to out, listing only the
+	 * elementary streams in pids. Descriptors are kept. The PCR PID
+	 * becomes 0x1FFF (no PCR) if it is not in pids. Returns the
+	 * number of streams kept, or -1 if the PMT is invalid */
+	
+	sec = _section(ts, data, PSI_PMT_TABLE_ID, &l);
+	if(sec == NULL) return(-1);
+	
+	/* The header and program info descriptors */
+	i = 12 + (((sec[10] & 0x0F) << 8) | sec[11]);
+	if(i > l - 4) return(-1);
+	
+	o = &out[5];
+	memcpy(o, sec, i);
+	n = i;
+	streams = 0;
+	
+	if(!TS_PIDS_TEST(pids, ((sec[8] & 0x1F) << 8) | sec[9]))
+	{
+		o[8] |= 0x1F;
+		o[9] = 0xFF;
+	}
+	
+	while(i + 5 <= l - 4)
+	{
+		e = 5 + (((sec[i + 3] & 0x0F) << 8) | sec[i + 4]);
+		if(i + e > l - 4) break;
+		
+		if(TS_PIDS_TEST(pids, ((sec[i + 1] & 0x1F) << 8) | sec[i + 2]))
+		{
+			memcpy(&o[n], &sec[i], e);
+			n += e;
+			streams++;
+		}
+		
+		i += e;
+	}
+	
+	_write_section(out, data, o, n + 4);
+	
+	return(streams);
+}
+
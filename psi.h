@@ -0,0 +1,63 @@
+/* psi.c/h - Simple DVB PSI (PAT/PMT) parser                             */
+/*=======================================================================*/
+/* Copyright (C)2026 The tsmerge contributors                            */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+
+#ifndef _PSI_H
+#define _PSI_H
+
+#include <stdint.h>
+#include "ts.h"
+
+/* Well known PIDs and table IDs */
+#define PSI_PAT_PID 0x0000
+#define PSI_PAT_TABLE_ID 0x00
+#define PSI_PMT_TABLE_ID 0x02
+
+/* Limits for the number of entries parsed from a single table */
+#define PSI_MAX_PROGRAMS 64
+#define PSI_MAX_STREAMS  32
+
+/* Only sections that fit inside a single TS packet are supported */
+
+typedef struct {
+	
+	uint16_t transport_stream_id;
+	uint8_t version_number;
+	
+	/* The programs listed in the PAT. Program 0 (the NIT) is not included */
+	int programs;
+	struct {
+		uint16_t program_number;
+		uint16_t pid;
+	} program[PSI_MAX_PROGRAMS];
+	
+} psi_pat_t;
+
+typedef struct {
+	
+	uint16_t program_number;
+	uint8_t version_number;
+	uint16_t pcr_pid;
+	
+	/* The elementary streams listed in the PMT */
+	int streams;
+	struct {
+		uint8_t stream_type;
+		uint16_t pid;
+	} stream[PSI_MAX_STREAMS];
+	
+} psi_pmt_t;
+
+extern uint32_t psi_crc32(const uint8_t *data, int length);
+extern int psi_parse_pat(psi_pat_t *pat, ts_header_t *ts, uint8_t * const data);
+extern int psi_parse_pmt(psi_pmt_t *pmt, ts_header_t *ts, uint8_t * const data);
+extern int psi_filter_pat(uint8_t *out, ts_header_t *ts, uint8_t * const data, const uint8_t *pids);
+extern int psi_filter_pmt(uint8_t *out, ts_header_t *ts, uint8_t * const data, const uint8_t *pids);
+
+#endif
+
@@ -13,17 +13,97 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include "ts.h"
+#include "psi.h"
+#include "merger.h"
+
+/* Number of recently sent MX packets kept for retransmission (power of 2) */
+#define _RETRANSMIT_PACKETS 16384
+
+/* Maximum number of packets retransmitted per second */
+#define _RETRANSMIT_RATE 5000
+
+/* Maximum number of packets held by the simulated delay */
+#define _DELAY_PACKETS 16384
 
 typedef enum {
 	MODE_MX,
 	MODE_TS,
 } _mode_t;
 
+typedef enum {
+	FILTER_NONE,
+	FILTER_INCLUDE,
+	FILTER_EXCLUDE,
+	FILTER_PROGRAM,
+} _filter_t;
+
+/* PID filter state. _pid_pass[pid] is non-zero for PIDs to be relayed */
+static _filter_t _filter = FILTER_NONE;
+static uint8_t _pid_pass[TS_PID_COUNT];
+
+/* State for the program filter */
+static int _program = -1;
+static uint16_t _pmt_pid = TS_NULL_PID;
+
+/* Per-PID byte counters */
+static uint64_t _pid_sent[TS_PID_COUNT];
+static uint64_t _pid_filtered[TS_PID_COUNT];
+
+/* Recently sent MX packets, indexed by counter */
+static uint8_t _retransmit[_RETRANSMIT_PACKETS][MX_PACKET_LEN];
+
+/* Retransmission rate limit and counters */
+static time_t _retransmit_window = 0;
+static int _retransmit_count = 0;
+static uint64_t _retransmitted = 0;
+static uint64_t _retransmit_limited = 0;
+
+/* Simulated network impairments. Every decision is drawn from
+ * rand(), so a run is repeatable for the same input and --seed */
+static double _loss = 0;        /* Packet loss, in percent */
+static double _burst = 1;       /* Mean length of a loss burst, in packets */
+static double _duplicate = 0;   /* Packets sent twice, in percent */
+static double _reorder = 0;     /* Packets swapped with the next, in percent */
+static double _tei = 0;         /* Packets corrupted, in percent */
+static int _delay = 0;          /* Fixed delay, in ms */
+static int _jitter = 0;         /* Random extra delay of up to this, in ms */
+static uint32_t _reset = 0;     /* Restart the counter after this many packets */
+
+/* Loss burst state, and a packet held back to be reordered */
+static int _in_burst = 0;
+static int _held = 0;
+static uint8_t _held_data[MX_PACKET_LEN];
+
+/* Packets waiting for their simulated delay, in order of due time */
+typedef struct {
+	int64_t due;
+	uint8_t data[MX_PACKET_LEN];
+} _delayed_t;
+
+static _delayed_t _delayed[_DELAY_PACKETS];
+static int _delayed_count = 0;
+
+/* Impairment counters */
+static uint64_t _lost = 0;
+static uint64_t _duplicated = 0;
+static uint64_t _reordered = 0;
+static uint64_t _corrupted = 0;
+static uint64_t _resets = 0;
+
+/* FEC matrix size (0 == disabled), the position of the next packet
+ * in the matrix, and the row and column parity being built */
+static int _fec_l = 0;
+static int _fec_d = 0;
+static int _fec_idx = 0;
+static uint8_t _fec_row[MX_PACKET_LEN];
+static uint8_t _fec_col[MX_FEC_MAX_L][MX_PACKET_LEN];
+
 static int _open_socket(char *host, char *port, int ai_family)
 {
 	int r;
@@ -94,6 +174,355 @@ static int _open_socket(char *host, char *port, int ai_family)
 	return(sock);
 }
 
+static int _parse_pid_list(char *list, uint8_t *map)
+{
+	char *s, *e;
+	long pid;
+	
+	/* Parse a comma separated list of PIDs, setting each in map */
+	for(s = list; *s != '\0'; s = e)
+	{
+		pid = strtol(s, &e, 0);
+		if(e == s || pid < 0 || pid >= TS_PID_COUNT) return(-1);
+		
+		map[pid] = 1;
+		
+		if(*e == ',') e++;
+		else if(*e != '\0') return(-1);
+	}
+	
+	return(0);
+}
+
+static void _update_program(ts_header_t *ts, uint8_t *data)
+{
+	psi_pat_t pat;
+	psi_pmt_t pmt;
+	int i;
+	
+	/* Track the PAT and the selected program's PMT, and
+	 * rebuild the list of PIDs to relay from them */
+	
+	if(ts->pid == PSI_PAT_PID)
+	{
+		if(psi_parse_pat(&pat, ts, data) != TS_OK) return;
+		
+		for(i = 0; i < pat.programs; i++)
+		{
+			if(_program == 0 || pat.program[i].program_number == _program) break;
+		}
+		
+		if(i == pat.programs || pat.program[i].pid == _pmt_pid) return;
+		
+		printf("Relaying program %d, PMT PID %d\n", pat.program[i].program_number, pat.program[i].pid);
+		
+		/* The PMT PID has changed, wait for the new PMT */
+		_pmt_pid = pat.program[i].pid;
+		memset(_pid_pass, 0, sizeof(_pid_pass));
+		_pid_pass[PSI_PAT_PID] = 1;
+		_pid_pass[_pmt_pid] = 1;
+	}
+	else if(ts->pid == _pmt_pid)
+	{
+		if(psi_parse_pmt(&pmt, ts, data) != TS_OK) return;
+		
+		memset(_pid_pass, 0, sizeof(_pid_pass));
+		_pid_pass[PSI_PAT_PID] = 1;
+		_pid_pass[_pmt_pid] = 1;
+		_pid_pass[pmt.pcr_pid] = 1;
+		
+		for(i = 0; i < pmt.streams; i++)
+		{
+			_pid_pass[pmt.stream[i].pid] = 1;
+		}
+	}
+}
+
+static int _chance(double percent)
+{
+	return(percent > 0 && rand() < percent / 100.0 * ((double) RAND_MAX + 1));
+}
+
+static int64_t _time_ms(void)
+{
+	struct timespec tp;
+	
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	
+	return((int64_t) tp.tv_sec * 1000 + tp.tv_nsec / 1000000);
+}
+
+static void _flush_delayed(int sock, int64_t now)
+{
+	int i;
+	
+	/* Send the delayed packets that are due */
+	for(i = 0; i < _delayed_count && _delayed[i].due <= now; i++)
+	{
+		send(sock, _delayed[i].data, MX_PACKET_LEN, 0);
+	}
+	
+	_delayed_count -= i;
+	memmove(&_delayed[0], &_delayed[i], _delayed_count * sizeof(_delayed_t));
+}
+
+static void _send_delayed(int sock, uint8_t *data)
+{
+	int64_t now, due;
+	int i;
+	
+	if(_delay == 0 && _jitter == 0)
+	{
+		send(sock, data, MX_PACKET_LEN, 0);
+		return;
+	}
+	
+	now = _time_ms();
+	due = now + _delay + (_jitter > 0 ? rand() % (_jitter + 1) : 0);
+	
+	/* Make room by sending the oldest packet early */
+	if(_delayed_count == _DELAY_PACKETS)
+	{
+		_flush_delayed(sock, _delayed[0].due);
+	}
+	
+	/* Keep the queue in order of due time. Jitter
+	 * lets packets overtake each other */
+	for(i = _delayed_count; i > 0 && _delayed[i - 1].due > due; i--);
+	
+	memmove(&_delayed[i + 1], &_delayed[i], (_delayed_count - i) * sizeof(_delayed_t));
+	_delayed[i].due = due;
+	memcpy(_delayed[i].data, data, MX_PACKET_LEN);
+	_delayed_count++;
+	
+	_flush_delayed(sock, now);
+}
+
+static void _drain_delayed(int sock)
+{
+	/* Send everything still waiting, at the simulated times */
+	if(_held)
+	{
+		_send_delayed(sock, _held_data);
+		_held = 0;
+	}
+	
+	while(_delayed_count > 0)
+	{
+		while(_time_ms() < _delayed[0].due)
+		{
+			usleep(1000);
+		}
+		
+		_flush_delayed(sock, _time_ms());
+	}
+}
+
+static void _send_mx(int sock, uint8_t *data)
+{
+	uint8_t pkt[MX_PACKET_LEN];
+	int i;
+	
+	/* Send an MX packet through the simulated network */
+	
+	/* Losses start at random and continue for a mean of _burst packets */
+	if(_in_burst)
+	{
+		_in_burst = !_chance(100.0 / _burst);
+	}
+	else
+	{
+		_in_burst = _chance(_loss / _burst);
+	}
+	
+	if(_in_burst)
+	{
+		_lost++;
+		return;
+	}
+	
+	memcpy(pkt, data, MX_PACKET_LEN);
+	
+	/* Corrupt the TS packet as a receiver would report it, with
+	 * the transport error indicator set and some damaged bytes */
+	if(_chance(_tei))
+	{
+		pkt[0x11] |= 0x80;
+		
+		for(i = 0; i < 4; i++)
+		{
+			pkt[0x14 + rand() % (TS_PACKET_SIZE - 4)] ^= 1 << (rand() % 8);
+		}
+		
+		_corrupted++;
+	}
+	
+	/* Hold this packet back and send it after the next one */
+	if(!_held && _chance(_reorder))
+	{
+		memcpy(_held_data, pkt, MX_PACKET_LEN);
+		_held = 1;
+		_reordered++;
+		return;
+	}
+	
+	_send_delayed(sock, pkt);
+	
+	if(_chance(_duplicate))
+	{
+		_send_delayed(sock, pkt);
+		_duplicated++;
+	}
+	
+	if(_held)
+	{
+		_send_delayed(sock, _held_data);
+		_held = 0;
+	}
+}
+
+static void _parity(uint8_t *parity, uint8_t *data, int start)
+{
+	int i;
+	
+	if(start)
+	{
+		/* The first packet covered sets the header */
+		memcpy(parity, data, MX_PACKET_LEN);
+		parity[0x10] = (_fec_l << 4) | _fec_d;
+		return;
+	}
+	
+	/* XOR in the TS packet, skipping the sync byte */
+	for(i = 0x11; i < MX_PACKET_LEN; i++)
+	{
+		parity[i] ^= data[i];
+	}
+}
+
+static void _send_fec(int sock, uint8_t *data)
+{
+	int idx, row, col;
+	
+	/* Position of this packet in the L x D matrix. The parity packets
+	 * name the first packet they cover, so the matrix needn't line up
+	 * with the counter, and it starts again when the counter does */
+	idx = _fec_idx;
+	_fec_idx = (_fec_idx + 1) % (_fec_l * _fec_d);
+	row = idx / _fec_l;
+	col = idx % _fec_l;
+	
+	_parity(_fec_row, data, col == 0);
+	_parity(_fec_col[col], data, row == 0);
+	
+	/* Send the row parity once the row is complete */
+	if(col == _fec_l - 1)
+	{
+		_fec_row[0x00] = 0xA4;
+		_send_mx(sock, _fec_row);
+	}
+	
+	/* Send the column parity once the column is complete */
+	if(row == _fec_d - 1)
+	{
+		_fec_col[col][0x00] = 0xA3;
+		_send_mx(sock, _fec_col[col]);
+	}
+}
+
+static void _process_nacks(int sock, uint8_t *header, uint32_t counter)
+{
+	uint8_t data[MX_NACK_LEN];
+	uint32_t c;
+	int32_t d;
+	int i, r, ranges, length;
+	
+	/* Read any NACKs sent back by the merger, and resend the
+	 * requested packets that are still in the retransmit buffer */
+	while((r = recv(sock, data, sizeof(data), MSG_DONTWAIT)) >= 0x10)
+	{
+		/* Must be a NACK for this station */
+		if(data[0x00] != 0xA2 || data[0x01] != 0x55) continue;
+		if(memcmp(&data[0x06], &header[0x06], 10) != 0) continue;
+		
+		ranges = data[0x02] | (data[0x03] << 8);
+		if(0x10 + ranges * 6 > r) continue;
+		
+		for(i = 0; i < ranges; i++)
+		{
+			c = (uint32_t) data[0x10 + i * 6 + 3] << 24
+			  | (uint32_t) data[0x10 + i * 6 + 2] << 16
+			  | (uint32_t) data[0x10 + i * 6 + 1] <<  8
+			  | (uint32_t) data[0x10 + i * 6 + 0] <<  0;
+			
+			length = data[0x10 + i * 6 + 4] | (data[0x10 + i * 6 + 5] << 8);
+			
+			for(; length > 0; length--, c++)
+			{
+				/* Only packets that have been sent and are still buffered */
+				d = (int32_t) counter - (int32_t) c;
+				if(d <= 0 || d > _RETRANSMIT_PACKETS) continue;
+				
+				/* Limit the number of packets resent each second */
+				if(time(NULL) != _retransmit_window)
+				{
+					_retransmit_window = time(NULL);
+					_retransmit_count = 0;
+				}
+				
+				if(_retransmit_count >= _RETRANSMIT_RATE)
+				{
+					_retransmit_limited++;
+					continue;
+				}
+				
+				send(sock, _retransmit[c & (_RETRANSMIT_PACKETS - 1)], MX_PACKET_LEN, 0);
+				_retransmit_count++;
+				_retransmitted++;
+			}
+		}
+	}
+}
+
+static void _print_stats(void)
+{
+	int pid;
+	uint64_t sent = 0, filtered = 0;
+	
+	printf("PID     Sent (bytes)  Filtered (bytes)\n");
+	
+	for(pid = 0; pid < TS_PID_COUNT; pid++)
+	{
+		if(_pid_sent[pid] == 0 && _pid_filtered[pid] == 0) continue;
+		
+		printf("%4d  %14llu  %16llu\n", pid,
+			(unsigned long long) _pid_sent[pid],
+			(unsigned long long) _pid_filtered[pid]
+		);
+		
+		sent += _pid_sent[pid];
+		filtered += _pid_filtered[pid];
+	}
+	
+	printf("Total %14llu  %16llu\n",
+		(unsigned long long) sent,
+		(unsigned long long) filtered
+	);
+	
+	printf("Retransmitted %llu packets, %llu over the rate limit\n",
+		(unsigned long long) _retransmitted,
+		(unsigned long long) _retransmit_limited
+	);
+	
+	printf("Simulated %llu lost, %llu duplicated, %llu reordered, %llu corrupted, %llu counter resets\n",
+		(unsigned long long) _lost,
+		(unsigned long long) _duplicated,
+		(unsigned long long) _reordered,
+		(unsigned long long) _corrupted,
+		(unsigned long long) _resets
+	);
+}
+
 void _print_usage(void)
 {
 	printf(
@@ -108,6 +537,31 @@ void _print_usage(void)
 		"                         Default: mx\n"
 		"  -c, --callsign <id>    Set the station callsign, up to 10 characters.\n"
 		"                         Required for mx mode. Not used by ts mode.\n"
+		"  -i, --include <pids>   Only relay the listed PIDs (comma separated).\n"
+		"  -x, --exclude <pids>   Relay all PIDs except those listed.\n"
+		"  -P, --program <number> Only relay the PIDs of this program, found\n"
+		"                         using the PAT and PMT. 0 selects the first\n"
+		"                         program in the PAT.\n"
+		"  -s, --stats <seconds>  Print per-PID byte counters at this interval.\n"
+		"                         Default: 0 (disabled)\n"
+		"  -l, --loss <percent>   Simulate packet loss by dropping this percentage\n"
+		"                         of MX packets when first sent. Default: 0\n"
+		"      --burst <packets>  Mean length of each simulated loss. Default: 1\n"
+		"      --duplicate <percent>\n"
+		"                         Send this percentage of MX packets twice.\n"
+		"      --reorder <percent>\n"
+		"                         Send this percentage of MX packets after the next.\n"
+		"      --delay <ms>       Delay MX packets by this long.\n"
+		"      --jitter <ms>      Delay MX packets by a random extra time up to\n"
+		"                         this long. Packets may overtake each other.\n"
+		"      --tei <percent>    Corrupt this percentage of MX packets, setting\n"
+		"                         the transport error indicator.\n"
+		"      --reset <packets>  Restart the packet counter at a random value\n"
+		"                         after this many packets.\n"
+		"      --seed <number>    Random seed for the simulation. Default: 1\n"
+		"  -f, --fec <L>x<D>      Send row and column XOR parity packets over an\n"
+		"                         L x D matrix of MX packets. L and D can be 1-15.\n"
+		"                         Default: disabled\n"
 		"\n"
 	);
 }
@@ -118,6 +572,7 @@ int main(int argc, char *argv[])
 	int opt;
 	int sock;
 	uint32_t counter = 0;
+	uint32_t relayed = 0;
 	char *host = "localhost";
 	char *port = "5678";
 	char *callsign = NULL;
@@ -126,6 +581,9 @@ int main(int argc, char *argv[])
 	FILE *f = stdin;
 	uint8_t data[16 + TS_PACKET_SIZE];
 	ts_header_t ts;
+	int stats = 0;
+	time_t next_stats = 0;
+	unsigned int seed = 1;
 	
 	static const struct option long_options[] = {
 		{ "host",        required_argument, 0, 'h' },
@@ -134,11 +592,25 @@ int main(int argc, char *argv[])
 		{ "ipv4",        no_argument,       0, '4' },
 		{ "callsign",    required_argument, 0, 'c' },
 		{ "mode",        required_argument, 0, 'm' },
+		{ "include",     required_argument, 0, 'i' },
+		{ "exclude",     required_argument, 0, 'x' },
+		{ "program",     required_argument, 0, 'P' },
+		{ "stats",       required_argument, 0, 's' },
+		{ "loss",        required_argument, 0, 'l' },
+		{ "seed",        required_argument, 0, 'S' },
+		{ "burst",       required_argument, 0, 'B' },
+		{ "duplicate",   required_argument, 0, 'D' },
+		{ "reorder",     required_argument, 0, 'R' },
+		{ "delay",       required_argument, 0, 'd' },
+		{ "jitter",      required_argument, 0, 'j' },
+		{ "tei",         required_argument, 0, 'T' },
+		{ "reset",       required_argument, 0, 'r' },
+		{ "fec",         required_argument, 0, 'f' },
 		{ 0,             0,                 0,  0  }
 	};
 	
 	opterr = 0;
-	while((c = getopt_long(argc, argv, "h:p:64c:", long_options, &opt)) != -1)
+	while((c = getopt_long(argc, argv, "h:p:64c:m:i:x:P:s:l:f:", long_options, &opt)) != -1)
 	{
 		switch(c)
 		{
@@ -180,6 +652,102 @@ int main(int argc, char *argv[])
 			callsign = optarg;
 			break;
 		
+		case 'i': /* --include <pids> */
+		case 'x': /* --exclude <pids> */
+			if(_filter != FILTER_NONE && _filter != (c == 'i' ? FILTER_INCLUDE : FILTER_EXCLUDE))
+			{
+				printf("Error: Only one of --include, --exclude or --program can be used\n");
+				_print_usage();
+				return(-1);
+			}
+			
+			_filter = (c == 'i' ? FILTER_INCLUDE : FILTER_EXCLUDE);
+			
+			if(_parse_pid_list(optarg, _pid_pass) != 0)
+			{
+				printf("Error: Invalid PID list '%s'\n", optarg);
+				_print_usage();
+				return(-1);
+			}
+			
+			break;
+		
+		case 'P': /* --program <number> */
+			if(_filter != FILTER_NONE)
+			{
+				printf("Error: Only one of --include, --exclude or --program can be used\n");
+				_print_usage();
+				return(-1);
+			}
+			
+			_filter = FILTER_PROGRAM;
+			_program = atoi(optarg);
+			
+			if(_program < 0 || _program > 0xFFFF)
+			{
+				printf("Error: Invalid program number '%s'\n", optarg);
+				_print_usage();
+				return(-1);
+			}
+			
+			/* Nothing but the PAT is relayed until the PMT is found */
+			_pid_pass[PSI_PAT_PID] = 1;
+			
+			break;
+		
+		case 's': /* --stats <seconds> */
+			stats = atoi(optarg);
+			break;
+		
+		case 'l': /* --loss <percent> */
+			_loss = atof(optarg);
+			break;
+		
+		case 'S': /* --seed <number> */
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		
+		case 'B': /* --burst <packets> */
+			_burst = atof(optarg);
+			if(_burst < 1) _burst = 1;
+			break;
+		
+		case 'D': /* --duplicate <percent> */
+			_duplicate = atof(optarg);
+			break;
+		
+		case 'R': /* --reorder <percent> */
+			_reorder = atof(optarg);
+			break;
+		
+		case 'd': /* --delay <ms> */
+			_delay = atoi(optarg);
+			break;
+		
+		case 'j': /* --jitter <ms> */
+			_jitter = atoi(optarg);
+			break;
+		
+		case 'T': /* --tei <percent> */
+			_tei = atof(optarg);
+			break;
+		
+		case 'r': /* --reset <packets> */
+			_reset = strtoul(optarg, NULL, 0);
+			break;
+		
+		case 'f': /* --fec <L>x<D> */
+			if(sscanf(optarg, "%dx%d", &_fec_l, &_fec_d) != 2 ||
+			   _fec_l < 1 || _fec_l > MX_FEC_MAX_L ||
+			   _fec_d < 1 || _fec_d > MX_FEC_MAX_D)
+			{
+				printf("Error: Invalid FEC matrix size '%s'\n", optarg);
+				_print_usage();
+				return(-1);
+			}
+			
+			break;
+		
 		case '?':
 			_print_usage();
 			return(0);
@@ -226,6 +794,8 @@ int main(int argc, char *argv[])
 		return(-1);
 	}
 	
+	srand(seed);
+	
 	/* Initialise the header */
 	memset(data, 0, sizeof(data));
 	
@@ -267,6 +837,38 @@ int main(int argc, char *argv[])
 		/* We don't transmit NULL/padding packets */
 		if(ts.pid == TS_NULL_PID) continue;
 		
+		if(stats > 0 && time(NULL) >= next_stats)
+		{
+			if(next_stats != 0) _print_stats();
+			next_stats = time(NULL) + stats;
+		}
+		
+		if(_filter == FILTER_PROGRAM)
+		{
+			_update_program(&ts, &data[0x10]);
+		}
+		
+		/* Drop filtered packets. The counter is only incremented
+		 * for relayed packets, so the merger sees no gaps */
+		if(_filter != FILTER_NONE &&
+		   (_pid_pass[ts.pid] != 0) == (_filter == FILTER_EXCLUDE))
+		{
+			_pid_filtered[ts.pid] += TS_PACKET_SIZE;
+			continue;
+		}
+		
+		_pid_sent[ts.pid] += TS_PACKET_SIZE;
+		
+		/* Simulate the station restarting */
+		if(_reset > 0 && relayed > 0 && relayed % _reset == 0)
+		{
+			counter = rand();
+			_fec_idx = 0;
+			_resets++;
+		}
+		
+		relayed++;
+		
 		/* Counter (4 bytes little-endian) */
 		data[0x05] = (counter & 0xFF000000) >> 24;
 		data[0x04] = (counter & 0x00FF0000) >> 16;
@@ -275,8 +877,19 @@ int main(int argc, char *argv[])
 		
 		if(mode == MODE_MX)
 		{
+			/* Keep a copy in case the merger asks for it again */
+			memcpy(_retransmit[counter & (_RETRANSMIT_PACKETS - 1)], data, sizeof(data));
+			
 			/* Send the full MX packet */
-			send(sock, data, sizeof(data), 0);
+			_send_mx(sock, data);
+			
+			/* Update and send the parity packets */
+			if(_fec_l > 0)
+			{
+				_send_fec(sock, data);
+			}
+			
+			_process_nacks(sock, data, counter + 1);
 		}
 		else if(mode == MODE_TS)
 		{
@@ -287,6 +900,16 @@ int main(int argc, char *argv[])
 		counter++;
 	}
 	
+	if(mode == MODE_MX)
+	{
+		_drain_delayed(sock);
+	}
+	
+	if(stats > 0)
+	{
+		_print_stats();
+	}
+	
 	if(f != stdin)
 	{
 		fclose(f);
@@ -0,0 +1,395 @@
+/* rec.c/h - Recording the merged output to disk                         */
+/*=======================================================================*/
+/* Copyright (C)2026 The tsmerge contributors                            */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include "ts.h"
+#include "merger.h"
+#include "rec.h"
+
+/* Time the writer sleeps between collecting the output (ms) */
+#define _INTERVAL_MS 50
+
+/* Time between attempts to open a file after an error (s) */
+#define _RETRY_S 1
+
+static int64_t _seconds(void)
+{
+	struct timespec tp;
+	
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	
+	return(tp.tv_sec);
+}
+
+static int _open_file(rec_t *r)
+{
+	char name[REC_PATH_LEN];
+	struct tm tm;
+	time_t t;
+	int flags;
+	
+	/* Open the next file. Returns -1 on error */
+	
+	r->bytes = 0;
+	r->opened = _seconds();
+	
+	t = time(NULL);
+	localtime_r(&t, &tm);
+	
+	if(strftime(name, sizeof(name), r->path, &tm) == 0)
+	{
+		fprintf(stderr, "Recording file name is too long\n");
+		return(-1);
+	}
+	
+	/* Don't replace the last file if the name hasn't changed */
+	if(strcmp(name, r->base) == 0)
+	{
+		if(snprintf(r->name, sizeof(r->name), "%s.%u", name, ++r->repeat) >= sizeof(r->name))
+		{
+			fprintf(stderr, "Recording file name is too long\n");
+			return(-1);
+		}
+	}
+	else
+	{
+		strcpy(r->base, name);
+		strcpy(r->name, name);
+		r->repeat = 0;
+	}
+	
+	flags = O_WRONLY | O_CREAT | O_TRUNC;
+	
+	r->fd = open(r->name, flags | (r->direct ? O_DIRECT : 0), 0644);
+	if(r->fd < 0 && r->direct && errno == EINVAL)
+	{
+		fprintf(stderr, "%s: O_DIRECT is not supported here, using buffered writes\n", r->name);
+		r->direct = 0;
+		r->fd = open(r->name, flags, 0644);
+	}
+	
+	if(r->fd < 0)
+	{
+		perror(r->name);
+		return(-1);
+	}
+	
+	printf("Recording to %s\n", r->name);
+	
+	return(0);
+}
+
+static int _write_all(int fd, uint8_t *data, int len)
+{
+	int n;
+	
+	while(len > 0)
+	{
+		n = write(fd, data, len);
+		if(n < 0)
+		{
+			if(errno == EINTR) continue;
+			return(-1);
+		}
+	
+		data += n;
+		len -= n;
+	}
+	
+	return(0);
+}
+
+static int _flush(rec_t *r, int all)
+{
+	int len;
+	
+	/* Write out the whole blocks in the buffer, and any partial
+	 * block that follows them if all is set. Returns -1 on error */
+	
+	len = r->len - r->len % REC_ALIGN;
+	
+	if(len > 0)
+	{
+		if(_write_all(r->fd, r->buffer, len) != 0) return(-1);
+	
+		/* The buffer start stays aligned */
+		memmove(r->buffer, r->buffer + len, r->len - len);
+		r->len -= len;
+		r->bytes += len;
+		__atomic_add_fetch(&r->written, len, __ATOMIC_RELAXED);
+	}
+	
+	if(all && r->len > 0)
+	{
+		/* O_DIRECT can't write a partial block, the file is
+		 * about to be closed so it is no longer needed */
+		if(r->direct)
+		{
+			fcntl(r->fd, F_SETFL, fcntl(r->fd, F_GETFL) & ~O_DIRECT);
+		}
+	
+		if(_write_all(r->fd, r->buffer, r->len) != 0) return(-1);
+	
+		r->bytes += r->len;
+		__atomic_add_fetch(&r->written, r->len, __ATOMIC_RELAXED);
+		r->len = 0;
+	}
+	
+	return(0);
+}
+
+static void _close_file(rec_t *r)
+{
+	if(r->fd < 0) return;
+	
+	if(_flush(r, 1) != 0)
+	{
+		perror(r->name);
+		__atomic_add_fetch(&r->dropped, r->len / TS_PACKET_SIZE, __ATOMIC_RELAXED);
+		r->len = 0;
+	}
+	
+	close(r->fd);
+	r->fd = -1;
+}
+
+static void _start(rec_t *r)
+{
+	uint8_t psi[MX_JOIN_PSI_LEN];
+	uint64_t seq;
+	int len;
+	
+	/* Start from the latest random access point, with the PSI in
+	 * effect there. Any packets skipped over are counted as dropped */
+	seq = mx_join(r->s, psi, &len);
+	
+	if(seq > r->seq)
+	{
+		__atomic_add_fetch(&r->dropped, seq - r->seq, __ATOMIC_RELAXED);
+	}
+	
+	r->seq = seq;
+	r->start = seq;
+	
+	memcpy(r->buffer + r->len, psi, len);
+	r->len += len;
+}
+
+static void _collect(rec_t *r)
+{
+	uint8_t psi[MX_JOIN_PSI_LEN];
+	uint8_t *data;
+	uint64_t limit, rap;
+	int64_t now;
+	int n, psi_len;
+	
+	/* Copy the new output to the buffer, writing it out as it fills */
+	
+	now = _seconds();
+	
+	if(r->fd < 0)
+	{
+		/* Retry after an error, dropping the output meanwhile.
+		 * stdout can't be opened again once it has failed */
+		if(r->to_stdout || now - r->opened < _RETRY_S || _open_file(r) != 0)
+		{
+			_start(r);
+			r->len = 0;
+			return;
+		}
+	
+		_start(r);
+	}
+	
+	/* Replace the file once it is big or old enough */
+	if(!r->to_stdout &&
+	   ((r->max_bytes > 0 && r->bytes + r->len >= r->max_bytes) ||
+	    (r->max_time > 0 && now - r->opened >= r->max_time)))
+	{
+		r->rotate = 1;
+	}
+	
+	while(1)
+	{
+		limit = UINT64_MAX;
+	
+		/* The new file starts at the next random access point */
+		if(r->rotate)
+		{
+			rap = mx_join(r->s, psi, &psi_len);
+			if(rap >= r->seq && rap > r->start) limit = rap;
+		}
+	
+		if(r->seq == limit)
+		{
+			r->rotate = 0;
+			_close_file(r);
+			if(_open_file(r) != 0) return;
+	
+			memcpy(r->buffer, psi, psi_len);
+			r->len = psi_len;
+			r->start = r->seq;
+	
+			continue;
+		}
+	
+		n = mx_read(r->s, r->seq, &data);
+	
+		if(n < 0)
+		{
+			/* The writes have fallen too far behind */
+			_start(r);
+			continue;
+		}
+	
+		if(n == 0) break;
+	
+		if(n > limit - r->seq) n = limit - r->seq;
+	
+		if(n > (REC_BUFFER_LEN - r->len) / TS_PACKET_SIZE)
+		{
+			n = (REC_BUFFER_LEN - r->len) / TS_PACKET_SIZE;
+		}
+	
+		memcpy(r->buffer + r->len, data, n * TS_PACKET_SIZE);
+	
+		/* The last packets copied may have been overwritten meanwhile */
+		if(mx_seq(r->s) + 1 - r->seq > _OUTPUT_PACKETS)
+		{
+			_start(r);
+			continue;
+		}
+	
+		r->len += n * TS_PACKET_SIZE;
+		r->seq += n;
+	
+		if(r->len >= REC_WRITE_LEN && _flush(r, 0) != 0)
+		{
+			/* Drop the buffered output, and start a new file later */
+			perror(r->name);
+			__atomic_add_fetch(&r->dropped, r->len / TS_PACKET_SIZE, __ATOMIC_RELAXED);
+			r->len = 0;
+	
+			close(r->fd);
+			r->fd = -1;
+	
+			return;
+		}
+	}
+}
+
+static void *_thread(void *arg)
+{
+	rec_t *r = arg;
+	struct timespec ts;
+	
+	ts.tv_sec = 0;
+	ts.tv_nsec = _INTERVAL_MS * 1000000;
+	
+	/* Writes can block for as long as they like here,
+	 * the merger never waits for the recording */
+	while(!__atomic_load_n(&r->quit, __ATOMIC_RELAXED))
+	{
+		_collect(r);
+		nanosleep(&ts, NULL);
+	}
+	
+	_collect(r);
+	_close_file(r);
+	
+	return(NULL);
+}
+
+int rec_open(rec_t *r, mx_t *s, const char *path, int direct, int size_mb, int seconds)
+{
+	sigset_t set, old;
+	int e;
+	
+	memset(r, 0, sizeof(rec_t));
+	r->s = s;
+	r->path = path;
+	r->direct = direct;
+	r->max_bytes = (uint64_t) size_mb * 1024 * 1024;
+	r->max_time = seconds;
+	r->seq = mx_seq(s);
+	
+	if(posix_memalign((void **) &r->buffer, REC_ALIGN, REC_BUFFER_LEN) != 0)
+	{
+		perror("posix_memalign");
+		return(-1);
+	}
+	
+	if(strcmp(path, "-") == 0)
+	{
+		/* Recording to stdout. Messages are moved to stderr */
+		fflush(stdout);
+		r->fd = dup(STDOUT_FILENO);
+		r->to_stdout = 1;
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+		strcpy(r->name, "stdout");
+		r->direct = 0;
+		r->max_bytes = 0;
+		r->max_time = 0;
+	}
+	else if(_open_file(r) != 0)
+	{
+		free(r->buffer);
+		return(-1);
+	}
+	
+	_start(r);
+	
+	/* SIGINT and SIGTERM are left to the main thread */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	
+	e = pthread_create(&r->thread, NULL, _thread, r);
+	
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	
+	if(e != 0)
+	{
+		fprintf(stderr, "Error starting the recording thread\n");
+		_close_file(r);
+		free(r->buffer);
+		return(-1);
+	}
+	
+	return(0);
+}
+
+void rec_close(rec_t *r)
+{
+	/* Stop the thread, once it has written what it has */
+	__atomic_store_n(&r->quit, 1, __ATOMIC_RELAXED);
+	pthread_join(r->thread, NULL);
+	
+	free(r->buffer);
+}
+
+void rec_print_stats(rec_t *r)
+{
+	printf("Recording: %llu MB written, %llu packets dropped\n",
+		(unsigned long long) __atomic_load_n(&r->written, __ATOMIC_RELAXED) / (1024 * 1024),
+		(unsigned long long) __atomic_load_n(&r->dropped, __ATOMIC_RELAXED)
+	);
+}
+
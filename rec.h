@@ -0,0 +1,81 @@
+/* rec.c/h - Recording the merged output to disk                         */
+/*=======================================================================*/
+/* Copyright (C)2026 The tsmerge contributors                            */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+
+#ifndef _REC_H
+#define _REC_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "merger.h"
+
+/* Size of the write buffer, and the amount collected before it
+ * is written out. Both are multiples of the O_DIRECT alignment */
+#define REC_BUFFER_LEN (4 * 1024 * 1024)
+#define REC_WRITE_LEN (256 * 1024)
+
+/* Block size that O_DIRECT writes are aligned to */
+#define REC_ALIGN 4096
+
+/* Maximum length of a file name */
+#define REC_PATH_LEN 1024
+
+typedef struct {
+	
+	/* The merger whose output is recorded */
+	mx_t *s;
+	
+	/* The file name, passed through strftime() for each new file, or
+	 * "-" for stdout. Files are replaced after max_bytes bytes or
+	 * max_time seconds, if set. Rotation is not used with stdout,
+	 * and stdout is not opened again after an error */
+	const char *path;
+	int to_stdout;
+	int direct;
+	uint64_t max_bytes;
+	int max_time;
+	
+	/* The open file, the name strftime() gave it and its actual name,
+	 * the bytes written to it and when it was opened (s). The name is
+	 * numbered if strftime() gives the same name again */
+	int fd;
+	char base[REC_PATH_LEN];
+	char name[REC_PATH_LEN];
+	unsigned int repeat;
+	uint64_t bytes;
+	int64_t opened;
+	
+	/* Set once the file is due to be replaced, at the next
+	 * random access point after start, the file's first packet */
+	int rotate;
+	uint64_t start;
+	
+	/* Data waiting to be written, aligned for O_DIRECT */
+	uint8_t *buffer;
+	int len;
+	
+	/* The next output packet to record */
+	uint64_t seq;
+	
+	/* Bytes written, and packets dropped because the writes fell
+	 * too far behind the output or failed */
+	uint64_t written;
+	uint64_t dropped;
+	
+	/* The writer thread */
+	pthread_t thread;
+	int quit;
+	
+} rec_t;
+
+extern int rec_open(rec_t *r, mx_t *s, const char *path, int direct, int size_mb, int seconds);
+extern void rec_close(rec_t *r);
+extern void rec_print_stats(rec_t *r);
+
+#endif
+
@@ -0,0 +1,204 @@
+/* bench_feed.c - Benchmark of feeding received MX packets               */
+/*=======================================================================*/
+/* Copyright (C)2026 The tsmerge contributors                            */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+
+/* Feeds the same synthetic batches of MX packets to one merger with
+ * mx_feed(), a packet at a time, and to another with mx_feed_batch().
+ * Checks both put each packet in the same station and give the same
+ * output, and prints the time each takes per packet. mx_update() is
+ * called between batches, as tsmerge does, but is not timed. "make
+ * bench" runs it built with the SSE2 batch classifier and with the
+ * portable one (MX_SCALAR) */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "../ts.h"
+#include "../merger.h"
+
+/* Stations fed, interleaved in runs of _RUN packets, and the packet
+ * rate of each. Every station sends the same stream. One packet in
+ * _PCR_EVERY carries a PCR, one in _JUNK_EVERY is not an MX packet */
+#define _BENCH_STATIONS 2
+#define _RUN            8
+#define _RATE           10000
+#define _PCR_EVERY      40
+#define _JUNK_EVERY     97
+
+/* Packets fed in each round, and the number of rounds. The first round
+ * warms up the packet pool and is not counted */
+#define _PACKETS (MX_BATCH * 256)
+#define _ROUNDS  100
+
+static uint8_t _packet[_PACKETS][MX_PACKET_LEN];
+static uint8_t *_data[_PACKETS];
+static int _single[_PACKETS];
+static int _batch[_PACKETS];
+static uint32_t _counter[_BENCH_STATIONS];
+
+static double _now(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static void _make_round(void)
+{
+	uint8_t *d;
+	uint64_t pcr;
+	uint32_t c;
+	int i, n;
+	
+	/* Builds the next round of packets, carrying on each station's counter */
+	for(i = 0; i < _PACKETS; i++)
+	{
+		d = _packet[i];
+		n = (i / _RUN) % _BENCH_STATIONS;
+		c = _counter[n]++;
+		
+		memset(d, 0, MX_PACKET_LEN);
+		
+		if(i % _JUNK_EVERY == _JUNK_EVERY - 1)
+		{
+			d[0x00] = 0xFF;
+			continue;
+		}
+		
+		/* MX header */
+		d[0x00] = 0xA1;
+		d[0x01] = 0x55;
+		d[0x02] = c >> 0;
+		d[0x03] = c >> 8;
+		d[0x04] = c >> 16;
+		d[0x05] = c >> 24;
+		snprintf((char *) &d[0x06], 10, "BENCH%d", n);
+		
+		/* TS header */
+		d[0x10] = TS_HEADER_SYNC;
+		d[0x11] = 0x01;
+		d[0x12] = 0x00;
+		d[0x13] = 0x10 | (c & 0x0F);
+		
+		if(c % _PCR_EVERY == 0)
+		{
+			/* An adaptation field with the PCR, in 90kHz units */
+			pcr = (uint64_t) c * 90000 / _RATE;
+			
+			d[0x13] |= 0x20;
+			d[0x14] = 7;
+			d[0x15] = 0x10;
+			d[0x16] = pcr >> 25;
+			d[0x17] = pcr >> 17;
+			d[0x18] = pcr >> 9;
+			d[0x19] = pcr >> 1;
+			d[0x1A] = (pcr & 1) << 7 | 0x7E;
+			d[0x1B] = 0x00;
+		}
+	}
+}
+
+static int _compare_output(mx_t *a, mx_t *b)
+{
+	uint8_t *da, *db;
+	uint64_t seq;
+	int n;
+	
+	/* Returns 0 if both mergers output the same packets */
+	if(mx_seq(a) == 0 || mx_seq(a) != mx_seq(b)) return(-1);
+	
+	for(seq = mx_seq(a) > _OUTPUT_PACKETS ? mx_seq(a) - _OUTPUT_PACKETS : 0; seq < mx_seq(a); seq += n)
+	{
+		n = mx_read(a, seq, &da);
+		if(n <= 0 || mx_read(b, seq, &db) != n) return(-1);
+		if(memcmp(da, db, (size_t) n * TS_PACKET_SIZE) != 0) return(-1);
+	}
+	
+	return(0);
+}
+
+int main(void)
+{
+	mx_t *single, *batch;
+	double t, t_single = 0, t_batch = 0;
+	int64_t timestamp = MX_MS(1000);
+	int r, i, j;
+	
+	single = mx_open(NULL, 0x100, MX_BUFFER_MB);
+	batch = mx_open(NULL, 0x100, MX_BUFFER_MB);
+	
+	if(single == NULL || batch == NULL)
+	{
+		fprintf(stderr, "mx_open failed\n");
+		return(1);
+	}
+	
+	for(i = 0; i < _PACKETS; i++)
+	{
+		_data[i] = _packet[i];
+	}
+	
+	for(r = 0; r < _ROUNDS; r++)
+	{
+		_make_round();
+		
+		for(i = 0; i < _PACKETS; i += MX_BATCH)
+		{
+			t = _now();
+			
+			for(j = i; j < i + MX_BATCH; j++)
+			{
+				_single[j] = mx_feed(single, timestamp, _data[j]);
+			}
+			
+			if(r > 0) t_single += _now() - t;
+			
+			t = _now();
+			
+			mx_feed_batch(batch, timestamp, &_data[i], NULL, MX_BATCH, &_batch[i]);
+			
+			if(r > 0) t_batch += _now() - t;
+			
+			/* Advance the clock by the batch, and output any segments */
+			timestamp += (int64_t) MX_BATCH * 1000000 / (_RATE * _BENCH_STATIONS);
+			
+			while(mx_update(single, timestamp) > 0);
+			while(mx_update(batch, timestamp) > 0);
+		}
+		
+		if(memcmp(_single, _batch, sizeof(_single)) != 0)
+		{
+			fprintf(stderr, "mx_feed() and mx_feed_batch() disagree in round %d\n", r);
+			return(1);
+		}
+	}
+	
+	if(_compare_output(single, batch) != 0)
+	{
+		fprintf(stderr, "mx_feed() and mx_feed_batch() output differs\n");
+		return(1);
+	}
+	
+	mx_close(single);
+	mx_close(batch);
+	
+#if defined(__SSE2__) && !defined(MX_SCALAR)
+	printf("Batch classifier: SSE2\n");
+#else
+	printf("Batch classifier: portable\n");
+#endif
+	
+	printf("mx_feed():       %.1f ns/packet\n", t_single * 1e9 / ((double) (_ROUNDS - 1) * _PACKETS));
+	printf("mx_feed_batch(): %.1f ns/packet\n", t_batch * 1e9 / ((double) (_ROUNDS - 1) * _PACKETS));
+	
+	return(0);
+}
@@ -0,0 +1,760 @@
+/* test_merger.c - Merger tests on a simulated clock                     */
+/*=======================================================================*/
+/* Copyright (C)2026 The tsmerge contributors                            */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+
+/* Feeds one test stream through mx_feed() and mx_update() from several
+ * simulated stations, each with its own delay and losses, then checks
+ * what the merger output. Time is simulated, so each run takes only as
+ * long as the merger's own work and always gives the same result */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "../ts.h"
+#include "../psi.h"
+#include "../merger.h"
+
+/* The test stream. Each packet carries its number in its last 4 bytes */
+#define _RATE    2000
+#define _PACKETS (_RATE * 20)
+#define _PCR_PID 256
+#define _PMT_PID 4096
+#define _AUD_PID 257
+
+/* Simulation steps: mx_update() is called every _UPDATE_US */
+#define _TICK_US   500
+#define _UPDATE_US 2000
+
+/* Most stations in a test, and the number of chaos test runs */
+#define _SIM_STATIONS 4
+#define _CHAOS_SEEDS  16
+
+typedef struct {
+	
+	/* The station ID, and its network delay and random jitter (us) */
+	const char *sid;
+	int64_t delay;
+	int64_t jitter;
+	
+	/* Random loss, in packets per 1000, and the mean burst length */
+	int loss;
+	int burst;
+	
+	/* Packets delivered twice, per 1000, with extra jitter on the copy */
+	int duplicate;
+	
+	/* Stream packets from lost_from up to lost_to are never delivered.
+	 * If upstream is set they are lost before reaching the station,
+	 * and its counter doesn't count them */
+	int lost_from;
+	int lost_to;
+	int upstream;
+	
+	/* If set, the station restarts its counter at reset_counter
+	 * from this stream packet on, as tspush --reset does */
+	int reset_at;
+	uint32_t reset_counter;
+	
+	/* Round trip time (us) for packets requested by NACK, or 0 if the
+	 * station ignores requests. Packets sent again are lost at the
+	 * same rate, but not in bursts */
+	int64_t rtt;
+	
+	/* Results: the stream packets that were delivered, and the
+	 * number requested and sent again */
+	uint8_t held[_PACKETS];
+	int requested;
+	
+} _sim_station_t;
+
+typedef struct {
+	
+	/* Stream packets output, and the first and last of them */
+	int packets;
+	int first;
+	int last;
+	
+	/* Output packets that match no stream packet, repeats, those out
+	 * of order on their PID, stream packets in range that were not
+	 * output, and those of them no station delivered */
+	int corrupt;
+	int duplicates;
+	int reordered;
+	int missing;
+	int unheld;
+	
+	/* Stream packets in range held by the most complete station */
+	int best;
+	
+} _result_t;
+
+typedef struct {
+	int64_t t;
+	int station;
+	int n;
+} _event_t;
+
+/* Most packets waiting to be sent again */
+#define _RESENDS 4096
+
+static uint8_t _stream[_PACKETS][TS_PACKET_SIZE];
+static _event_t _events[_PACKETS * _SIM_STATIONS * 2];
+static _event_t _resends[_RESENDS];
+static int _resend_count;
+static uint8_t _output[_PACKETS];
+static int _pid_last[TS_PID_COUNT];
+static uint32_t _rng;
+
+static int _failed = 0;
+static FILE *_log;
+
+static uint32_t _rand(void)
+{
+	/* xorshift32, so runs are the same everywhere */
+	_rng ^= _rng << 13;
+	_rng ^= _rng >> 17;
+	_rng ^= _rng << 5;
+	return(_rng);
+}
+
+static void _section(uint8_t *p, uint8_t table_id, uint16_t ext, const uint8_t *body, int len)
+{
+	uint8_t *s = &p[5];
+	uint32_t crc;
+	
+	/* Writes a PSI section into packet p, after a zero pointer field */
+	p[4] = 0x00;
+	s[0] = table_id;
+	s[1] = 0xB0 | ((len + 9) >> 8);
+	s[2] = (len + 9) & 0xFF;
+	s[3] = ext >> 8;
+	s[4] = ext & 0xFF;
+	s[5] = 0xC1;
+	s[6] = 0x00;
+	s[7] = 0x00;
+	memcpy(&s[8], body, len);
+	
+	crc = psi_crc32(s, len + 8);
+	s[len + 8]  = crc >> 24;
+	s[len + 9]  = crc >> 16;
+	s[len + 10] = crc >> 8;
+	s[len + 11] = crc;
+}
+
+static void _make_stream(void)
+{
+	static const uint8_t pat[] = { 0x00, 0x01, 0xE0 | (_PMT_PID >> 8), _PMT_PID & 0xFF };
+	static const uint8_t pmt[] = {
+		0xE0 | (_PCR_PID >> 8), _PCR_PID & 0xFF, 0xF0, 0x00,
+		0x1B, 0xE0 | (_PCR_PID >> 8), _PCR_PID & 0xFF, 0xF0, 0x00,
+		0x0F, 0xE0 | (_AUD_PID >> 8), _AUD_PID & 0xFF, 0xF0, 0x00,
+	};
+	uint8_t cc[4] = { 0, 0, 0, 0 };
+	uint8_t *p;
+	uint64_t pcr;
+	int n, i, k, pid;
+	
+	/* A PAT and PMT every 100ms, a PCR every 20ms with a random
+	 * access point every 200ms, and one audio packet in seven */
+	for(n = 0; n < _PACKETS; n++)
+	{
+		p = _stream[n];
+		memset(p, 0xFF, TS_PACKET_SIZE);
+		
+		if(n % 200 == 0) { pid = PSI_PAT_PID; k = 0; }
+		else if(n % 200 == 1) { pid = _PMT_PID; k = 1; }
+		else if(n % 7 == 3 && n % 40 != 2) { pid = _AUD_PID; k = 3; }
+		else { pid = _PCR_PID; k = 2; }
+		
+		p[0] = TS_HEADER_SYNC;
+		p[1] = (pid >> 8) | (k < 2 || n % 40 == 2 ? 0x40 : 0x00);
+		p[2] = pid & 0xFF;
+		p[3] = 0x10 | cc[k];
+		cc[k] = (cc[k] + 1) & 0x0F;
+		
+		if(k == 0) _section(p, PSI_PAT_TABLE_ID, 1, pat, sizeof(pat));
+		else if(k == 1) _section(p, PSI_PMT_TABLE_ID, 1, pmt, sizeof(pmt));
+		else
+		{
+			for(i = 4; i < TS_PACKET_SIZE; i++)
+			{
+				p[i] = (n * 131 + i * 7) & 0xFF;
+			}
+			
+			if(n % 40 == 2)
+			{
+				/* PCR in 90kHz units, the extension is left zero */
+				pcr = (uint64_t) n * 90000 / _RATE + 90000;
+				p[3] |= 0x20;
+				p[4] = 7;
+				p[5] = 0x10 | (n % 400 == 2 ? 0x40 : 0x00);
+				p[6] = pcr >> 25;
+				p[7] = pcr >> 17;
+				p[8] = pcr >> 9;
+				p[9] = pcr >> 1;
+				p[10] = ((pcr & 1) << 7) | 0x7E;
+				p[11] = 0x00;
+			}
+		}
+		
+		p[184] = n;
+		p[185] = n >> 8;
+		p[186] = n >> 16;
+		p[187] = n >> 24;
+	}
+}
+
+static void _mx_packet(uint8_t *data, const char *sid, uint32_t counter, int n)
+{
+	memset(data, 0, MX_PACKET_LEN);
+	data[0x00] = 0xA1;
+	data[0x01] = 0x55;
+	data[0x02] = counter;
+	data[0x03] = counter >> 8;
+	data[0x04] = counter >> 16;
+	data[0x05] = counter >> 24;
+	strncpy((char *) &data[0x06], sid, 10);
+	memcpy(&data[0x10], _stream[n], TS_PACKET_SIZE);
+}
+
+static uint32_t _counter(_sim_station_t *st, int n)
+{
+	/* The station's counter for stream packet n */
+	if(st->reset_at > 0 && n >= st->reset_at) return(st->reset_counter + (n - st->reset_at));
+	if(st->upstream && n >= st->lost_to) return(n - (st->lost_to - st->lost_from));
+	return(n);
+}
+
+static int _packet_n(_sim_station_t *st, uint32_t counter)
+{
+	/* The stream packet for a station counter, or -1 */
+	if(st->reset_at > 0 && counter - st->reset_counter < (uint32_t) (_PACKETS - st->reset_at))
+	{
+		return(st->reset_at + (counter - st->reset_counter));
+	}
+	
+	if(st->upstream && counter >= (uint32_t) st->lost_from) counter += st->lost_to - st->lost_from;
+	
+	if(counter < (uint32_t) _PACKETS && (st->reset_at == 0 || (int) counter < st->reset_at))
+	{
+		return(counter);
+	}
+	
+	return(-1);
+}
+
+static int _event_cmp(const void *a, const void *b)
+{
+	const _event_t *x = a, *y = b;
+	
+	if(x->t != y->t) return(x->t < y->t ? -1 : 1);
+	if(x->station != y->station) return(x->station - y->station);
+	return(x->n - y->n);
+}
+
+static int _schedule(_sim_station_t *st, int stations)
+{
+	_sim_station_t *s;
+	int i, n, events = 0, burst;
+	
+	/* Decide which packets each station delivers, and when */
+	for(i = 0; i < stations; i++)
+	{
+		s = &st[i];
+		memset(s->held, 0, sizeof(s->held));
+		burst = 0;
+		
+		for(n = 0; n < _PACKETS; n++)
+		{
+			if(burst == 0 && s->loss > 0 && (int) (_rand() % 1000) < s->loss)
+			{
+				burst = 1 + (s->burst > 1 ? _rand() % (s->burst * 2 - 1) : 0);
+			}
+			
+			if(burst > 0)
+			{
+				burst--;
+				continue;
+			}
+			
+			if(n >= s->lost_from && n < s->lost_to) continue;
+			
+			s->held[n] = 1;
+			_events[events].t = (int64_t) n * 1000000 / _RATE + s->delay +
+			                    (s->jitter > 0 ? _rand() % s->jitter : 0);
+			_events[events].station = i;
+			_events[events].n = n;
+			events++;
+			
+			if(s->duplicate > 0 && (int) (_rand() % 1000) < s->duplicate)
+			{
+				_events[events] = _events[events - 1];
+				_events[events].t += 1000 + (s->jitter > 0 ? _rand() % s->jitter : 0);
+				events++;
+			}
+		}
+	}
+	
+	qsort(_events, events, sizeof(_event_t), _event_cmp);
+	
+	return(events);
+}
+
+static void _request(_sim_station_t *st, int stations, int64_t t, uint8_t *data, int len)
+{
+	_sim_station_t *s;
+	uint32_t counter;
+	int i, r, n, length;
+	
+	/* Answers a NACK packet from the merger, as tspush does, by
+	 * sending the packets again. They arrive one round trip later */
+	if(len < 0x10 || data[0] != 0xA2 || data[1] != 0x55) return;
+	
+	for(i = 0; i < stations && strncmp((char *) &data[6], st[i].sid, 10) != 0; i++);
+	if(i == stations || st[i].rtt == 0) return;
+	
+	s = &st[i];
+	
+	for(r = 0; r < data[2] && 0x10 + r * 6 + 6 <= len; r++)
+	{
+		counter = data[0x10 + r * 6 + 0]
+		        | data[0x10 + r * 6 + 1] << 8
+		        | data[0x10 + r * 6 + 2] << 16
+		        | (uint32_t) data[0x10 + r * 6 + 3] << 24;
+		length = data[0x10 + r * 6 + 4] | data[0x10 + r * 6 + 5] << 8;
+		
+		for(; length > 0; length--, counter++)
+		{
+			n = _packet_n(s, counter);
+			if(n < 0) continue;
+			
+			s->requested++;
+			
+			if(s->loss > 0 && (int) (_rand() % 1000) < s->loss) continue;
+			if(_resend_count == _RESENDS) continue;
+			
+			_resends[_resend_count].t = t + s->rtt;
+			_resends[_resend_count].station = i;
+			_resends[_resend_count].n = n;
+			_resend_count++;
+		}
+	}
+}
+
+static void _collect(mx_t *s, uint64_t *seq, _result_t *r)
+{
+	uint8_t *out;
+	uint32_t n;
+	int pid;
+	
+	/* Checks each packet output since the last call. Packets filled
+	 * in at a splice can come after later packets on other PIDs, so
+	 * the order is only checked within each PID */
+	for(; *seq < mx_seq(s); (*seq)++)
+	{
+		if(mx_read(s, *seq, &out) < 1)
+		{
+			r->corrupt++;
+			continue;
+		}
+		
+		n = out[184] | out[185] << 8 | out[186] << 16 | (uint32_t) out[187] << 24;
+		
+		if(n >= _PACKETS || memcmp(out, _stream[n], TS_PACKET_SIZE) != 0)
+		{
+			r->corrupt++;
+			continue;
+		}
+		
+		pid = ((out[1] & 0x1F) << 8) | out[2];
+		
+		if(_output[n]++) r->duplicates++;
+		if((int) n < _pid_last[pid]) r->reordered++;
+		if(r->first < 0) r->first = n;
+		if((int) n > r->last) r->last = n;
+		
+		_pid_last[pid] = n;
+		r->packets++;
+	}
+}
+
+static void _run(_sim_station_t *st, int stations, int dedup, _result_t *r)
+{
+	uint8_t data[MX_PACKET_LEN > MX_NACK_LEN ? MX_PACKET_LEN : MX_NACK_LEN];
+	mx_t *s;
+	int64_t t, end;
+	uint64_t seq = 0;
+	int e, events, i, k, n;
+	
+	/* Feeds the stations' packets to a new merger, in order of
+	 * arrival, and checks every packet it outputs */
+	
+	events = _schedule(st, stations);
+	
+	memset(r, 0, sizeof(_result_t));
+	memset(_output, 0, sizeof(_output));
+	memset(_pid_last, 0xFF, sizeof(_pid_last));
+	r->first = -1;
+	r->last = -1;
+	_resend_count = 0;
+	
+	s = mx_open(NULL, _PCR_PID, MX_BUFFER_MB);
+	if(s == NULL)
+	{
+		fprintf(_log, "mx_open failed\n");
+		exit(1);
+	}
+	
+	mx_set_dedup(s, dedup);
+	
+	end = (int64_t) _PACKETS * 1000000 / _RATE + 5000000;
+	
+	for(t = 0, e = 0; t < end; t += _TICK_US)
+	{
+		for(; e < events && _events[e].t <= t; e++)
+		{
+			i = _events[e].station;
+			_mx_packet(data, st[i].sid, _counter(&st[i], _events[e].n), _events[e].n);
+			mx_feed(s, t, data);
+		}
+		
+		/* Packets sent again that have arrived */
+		for(k = 0; k < _resend_count; )
+		{
+			if(_resends[k].t > t)
+			{
+				k++;
+				continue;
+			}
+			
+			i = _resends[k].station;
+			_mx_packet(data, st[i].sid, _counter(&st[i], _resends[k].n), _resends[k].n);
+			mx_feed(s, t, data);
+			st[i].held[_resends[k].n] = 1;
+			
+			_resends[k] = _resends[--_resend_count];
+		}
+		
+		if(t % _UPDATE_US == 0)
+		{
+			mx_update(s, t);
+			_collect(s, &seq, r);
+			
+			for(i = 0; i < _STATIONS; i++)
+			{
+				k = mx_nack(s, i, t, data);
+				if(k > 0) _request(st, stations, t, data, k);
+			}
+		}
+	}
+	
+	mx_close(s);
+	
+	if(r->first < 0) return;
+	
+	/* Compare the range output against each station */
+	for(i = 0; i < stations; i++)
+	{
+		for(k = 0, n = r->first; n <= r->last; n++)
+		{
+			k += st[i].held[n];
+		}
+		
+		if(k > r->best) r->best = k;
+	}
+	
+	for(n = r->first; n <= r->last; n++)
+	{
+		if(_output[n] != 0) continue;
+		
+		r->missing++;
+		
+		for(i = 0; i < stations && st[i].held[n] == 0; i++);
+		if(i == stations) r->unheld++;
+	}
+}
+
+static void _print(const char *name, _result_t *r)
+{
+	fprintf(_log, "%s: %d packets (%d to %d), %d missing (%d not delivered), "
+		"best station %d, %d corrupt, %d duplicates, %d out of order\n",
+		name, r->packets, r->first, r->last, r->missing, r->unheld,
+		r->best, r->corrupt, r->duplicates, r->reordered);
+}
+
+static void _check(const char *name, int ok, const char *what)
+{
+	if(ok) return;
+	
+	fprintf(_log, "FAIL %s: %s\n", name, what);
+	_failed = 1;
+}
+
+static void _check_output(const char *name, _result_t *r)
+{
+	/* What every run must satisfy, whatever the losses */
+	_check(name, r->packets > _PACKETS / 2, "too little output");
+	_check(name, r->corrupt == 0, "corrupt packets output");
+	_check(name, r->duplicates == 0, "duplicate packets output");
+	_check(name, r->reordered == 0, "packets output out of order");
+}
+
+static void _check_best(const char *name, _result_t *r)
+{
+	_check(name, r->packets >= r->best, "less complete than the best station");
+}
+
+static void _test_holes(int dedup)
+{
+	static _sim_station_t st[3];
+	const char *name = dedup ? "holes, dedup" : "holes";
+	_result_t r;
+	int i;
+	
+	/* Three stations with different random burst losses, and no
+	 * retransmission. A hole in one station is filled from the others,
+	 * unless they have lost the packets all around it too */
+	memset(st, 0, sizeof(st));
+	
+	for(i = 0; i < 3; i++)
+	{
+		st[i].sid = (const char *[]) { "STA1", "STA2", "STA3" }[i];
+		st[i].delay = 20000 + i * 15000;
+		st[i].loss = 5;
+		st[i].burst = 8;
+	}
+	
+	_rng = 1;
+	_run(st, 3, dedup, &r);
+	_print(name, &r);
+	_check_output(name, &r);
+	_check_best(name, &r);
+	_check(name, r.missing - r.unheld <= _PACKETS / 2000, "holes not filled from the other stations");
+}
+
+static void _test_hole_length(void)
+{
+	static _sim_station_t st[3];
+	_result_t r;
+	
+	/* A hole in one station, where the next station to have joined
+	 * lost some of the packets before they reached it. Both stations
+	 * holding copies around the hole disagree on its length, the one
+	 * agreeing with the length of the hole itself must be used */
+	memset(st, 0, sizeof(st));
+	st[0].sid = "STA1";
+	st[0].delay = 20000;
+	st[0].lost_from = _PACKETS / 2 + 3;
+	st[0].lost_to = _PACKETS / 2 + 23;
+	st[1].sid = "STA2";
+	st[1].delay = 25000;
+	st[1].lost_from = _PACKETS / 2 + 8;
+	st[1].lost_to = _PACKETS / 2 + 13;
+	st[1].upstream = 1;
+	st[2].sid = "STA3";
+	st[2].delay = 30000;
+	
+	_rng = 6;
+	_run(st, 3, 0, &r);
+	_print("hole length", &r);
+	_check_output("hole length", &r);
+	_check("hole length", r.missing == 0, "hole filled with the wrong length");
+}
+
+static void _test_nack(void)
+{
+	static _sim_station_t st[1];
+	_result_t r, ref;
+	
+	/* One station losing 1% of packets in short bursts. Without NACKs
+	 * the holes stay, with them nearly every packet is sent again in
+	 * time. Only those lost on every try are missing */
+	memset(st, 0, sizeof(st));
+	st[0].sid = "STA1";
+	st[0].delay = 20000;
+	st[0].loss = 3;
+	st[0].burst = 4;
+	
+	_rng = 2;
+	_run(st, 1, 0, &ref);
+	_print("no nack", &ref);
+	_check_output("no nack", &ref);
+	
+	st[0].rtt = 40000;
+	
+	_rng = 2;
+	_run(st, 1, 0, &r);
+	_print("nack", &r);
+	fprintf(_log, "nack: %d packets requested\n", st[0].requested);
+	_check_output("nack", &r);
+	_check_best("nack", &r);
+	_check("nack", st[0].requested >= ref.missing, "missing packets not all requested");
+	_check("nack", r.missing - r.unheld == 0, "packets sent again were not output");
+	_check("nack", r.missing <= ref.missing / 50, "too few packets recovered");
+}
+
+static void _test_reset(void)
+{
+	static _sim_station_t st[1];
+	_result_t r;
+	
+	/* One station restarting its counter halfway, with jitter so
+	 * packets from before the restart still arrive after it. The
+	 * packets it held from before must still be output. Only those
+	 * between the last PCR before the restart and the first after
+	 * it are lost, as they belong to no complete segment */
+	memset(st, 0, sizeof(st));
+	st[0].sid = "STA1";
+	st[0].delay = 20000;
+	st[0].jitter = 5000;
+	st[0].reset_at = _PACKETS / 2;
+	st[0].reset_counter = 0x89ABCDEF;
+	
+	_rng = 3;
+	_run(st, 1, 0, &r);
+	_print("reset", &r);
+	_check_output("reset", &r);
+	_check("reset", r.missing < 40, "packets lost at the restart");
+}
+
+static void _test_jitter(void)
+{
+	static _sim_station_t st[2];
+	_result_t r;
+	
+	/* Two stations with long delays and enough jitter to reorder
+	 * packets, but no losses. Nothing may go missing */
+	memset(st, 0, sizeof(st));
+	st[0].sid = "STA1";
+	st[0].delay = 100000;
+	st[0].jitter = 30000;
+	st[1].sid = "STA2";
+	st[1].delay = 100000;
+	st[1].jitter = 30000;
+	
+	_rng = 4;
+	_run(st, 2, 0, &r);
+	_print("jitter", &r);
+	_check_output("jitter", &r);
+	_check_best("jitter", &r);
+	_check("jitter", r.missing == 0, "packets lost");
+}
+
+static void _test_overlap(void)
+{
+	static _sim_station_t st[2];
+	_result_t r;
+	
+	/* One station stops a quarter of the way in. The other lags it by
+	 * more than the station timeout, so once the first has timed out
+	 * the merger is offered segments it has already output. They must
+	 * not be output again, and the output must carry on from where the
+	 * first station stopped */
+	memset(st, 0, sizeof(st));
+	st[0].sid = "STA1";
+	st[0].delay = 20000;
+	st[0].lost_from = _PACKETS / 4;
+	st[0].lost_to = _PACKETS;
+	st[1].sid = "STA2";
+	st[1].delay = 20000 + MX_MS(_TIMEOUT_MS + _GUARD_MS);
+	
+	_rng = 5;
+	_run(st, 2, 0, &r);
+	_print("overlap", &r);
+	_check_output("overlap", &r);
+	_check("overlap", r.missing == 0, "packets lost");
+}
+
+static void _test_chaos(uint32_t seed)
+{
+	static _sim_station_t st[_SIM_STATIONS];
+	static const char *sid[] = { "STA1", "STA2", "STA3", "STA4" };
+	char name[32];
+	_result_t r;
+	int i, stations;
+	
+	/* Two to four stations, each with a random delay, jitter, burst
+	 * loss, duplicates and maybe NACKs or a counter restart. Whatever
+	 * happens, the output must be clean and at least as complete as
+	 * the best station */
+	snprintf(name, sizeof(name), "chaos %u", seed);
+	memset(st, 0, sizeof(st));
+	
+	_rng = seed * 2654435761U;
+	stations = 2 + _rand() % (_SIM_STATIONS - 1);
+	
+	for(i = 0; i < stations; i++)
+	{
+		st[i].sid = sid[i];
+		st[i].delay = 10000 + _rand() % 140000;
+		st[i].jitter = _rand() % 30000;
+		st[i].loss = _rand() % 20;
+		st[i].burst = 1 + _rand() % 20;
+		st[i].duplicate = _rand() % 20;
+		st[i].rtt = (_rand() % 2 ? 20000 + _rand() % 80000 : 0);
+		
+		if(_rand() % 2)
+		{
+			st[i].reset_at = _rand() % _PACKETS;
+			st[i].reset_counter = _rand();
+		}
+	}
+	
+	_run(st, stations, _rand() % 2, &r);
+	_print(name, &r);
+	_check_output(name, &r);
+	_check_best(name, &r);
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t seed;
+	int fd;
+	
+	/* The merger reports to stdout, keep that out of the results */
+	fflush(stdout);
+	_log = fdopen(dup(STDOUT_FILENO), "w");
+	
+	fd = open("/dev/null", O_WRONLY);
+	if(fd >= 0)
+	{
+		dup2(fd, STDOUT_FILENO);
+		close(fd);
+	}
+	
+	_make_stream();
+	
+	/* A seed given on the command line runs just that chaos test */
+	if(argc > 1)
+	{
+		_test_chaos(strtoul(argv[1], NULL, 0));
+	}
+	else
+	{
+		_test_holes(0);
+		_test_holes(1);
+		_test_hole_length();
+		_test_nack();
+		_test_reset();
+		_test_jitter();
+		_test_overlap();
+		
+		for(seed = 1; seed <= _CHAOS_SEEDS; seed++)
+		{
+			_test_chaos(seed);
+		}
+	}
+	
+	fprintf(_log, "%s\n", _failed ? "FAILED" : "PASSED");
+	fclose(_log);
+	
+	return(_failed);
+}
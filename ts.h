@@ -16,6 +16,13 @@
 #define TS_HEADER_SYNC 0x47
 
 #define TS_NULL_PID 0x1FFF
+#define TS_PID_COUNT 0x2000
+
+/* Sets of PIDs, held as a bitmap of TS_PIDS_LEN bytes */
+#define TS_PIDS_LEN (TS_PID_COUNT / 8)
+#define TS_PIDS_SET(set, pid) ((set)[(pid) >> 3] |= 1 << ((pid) & 7))
+#define TS_PIDS_CLEAR(set, pid) ((set)[(pid) >> 3] &= ~(1 << ((pid) & 7)))
+#define TS_PIDS_TEST(set, pid) (((set)[(pid) >> 3] >> ((pid) & 7)) & 1)
 
 typedef struct {
 	
@@ -0,0 +1,317 @@
+/* uring.c/h - Minimal io_uring wrapper using the raw system calls       */
+/*=======================================================================*/
+/* Copyright (C)2026 The tsmerge contributors                            */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+/* The kernel and this process share the ring indexes */
+#define _load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define _store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static int _setup(unsigned entries, struct io_uring_params *p)
+{
+	return(syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int _enter(int fd, unsigned submit, unsigned wait, unsigned flags, void *arg, size_t len)
+{
+	return(syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, len));
+}
+
+static int _register(int fd, unsigned opcode, void *arg, unsigned args)
+{
+	return(syscall(__NR_io_uring_register, fd, opcode, arg, args));
+}
+
+int uring_init(uring_t *u, unsigned entries)
+{
+	struct io_uring_params p;
+	unsigned *array;
+	unsigned i;
+	
+	/* Returns 0 on success, or -1 if io_uring is not available */
+	
+	memset(u, 0, sizeof(uring_t));
+	memset(&p, 0, sizeof(p));
+	
+	u->fd = _setup(entries, &p);
+	if(u->fd < 0)
+	{
+		perror("io_uring_setup");
+		return(-1);
+	}
+	
+	u->features = p.features;
+	
+	/* Waiting with a timeout needs IORING_FEAT_EXT_ARG (5.11) */
+	if((p.features & IORING_FEAT_EXT_ARG) == 0)
+	{
+		fprintf(stderr, "io_uring is too old (no IORING_FEAT_EXT_ARG)\n");
+		close(u->fd);
+		return(-1);
+	}
+	
+	u->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	
+	/* Map the rings. Newer kernels map both with one call */
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if(u->cq_ring_len > u->sq_ring_len) u->sq_ring_len = u->cq_ring_len;
+		u->cq_ring_len = u->sq_ring_len;
+	}
+	
+	u->sq_ring = mmap(NULL, u->sq_ring_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	
+	if(u->sq_ring == MAP_FAILED)
+	{
+		perror("mmap");
+		close(u->fd);
+		return(-1);
+	}
+	
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		u->cq_ring = u->sq_ring;
+	}
+	else
+	{
+		u->cq_ring = mmap(NULL, u->cq_ring_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		
+		if(u->cq_ring == MAP_FAILED)
+		{
+			perror("mmap");
+			munmap(u->sq_ring, u->sq_ring_len);
+			close(u->fd);
+			return(-1);
+		}
+	}
+	
+	u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	
+	if(u->sqes == MAP_FAILED)
+	{
+		perror("mmap");
+		if(u->cq_ring != u->sq_ring) munmap(u->cq_ring, u->cq_ring_len);
+		munmap(u->sq_ring, u->sq_ring_len);
+		close(u->fd);
+		return(-1);
+	}
+	
+	u->sq_head = (unsigned *) ((uint8_t *) u->sq_ring + p.sq_off.head);
+	u->sq_tail = (unsigned *) ((uint8_t *) u->sq_ring + p.sq_off.tail);
+	u->sq_mask = *(unsigned *) ((uint8_t *) u->sq_ring + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	u->tail = *u->sq_tail;
+	
+	u->cq_head = (unsigned *) ((uint8_t *) u->cq_ring + p.cq_off.head);
+	u->cq_tail = (unsigned *) ((uint8_t *) u->cq_ring + p.cq_off.tail);
+	u->cq_mask = *(unsigned *) ((uint8_t *) u->cq_ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *) ((uint8_t *) u->cq_ring + p.cq_off.cqes);
+	
+	/* Submission entries are always used in order */
+	array = (unsigned *) ((uint8_t *) u->sq_ring + p.sq_off.array);
+	
+	for(i = 0; i < p.sq_entries; i++)
+	{
+		array[i] = i;
+	}
+	
+	return(0);
+}
+
+void uring_free(uring_t *u)
+{
+	munmap(u->sqes, u->sqes_len);
+	if(u->cq_ring != u->sq_ring) munmap(u->cq_ring, u->cq_ring_len);
+	munmap(u->sq_ring, u->sq_ring_len);
+	close(u->fd);
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t *u)
+{
+	struct io_uring_sqe *sqe;
+	
+	/* Returns a cleared submission entry. If the queue
+	 * is full, the pending entries are submitted first */
+	
+	if(u->tail - _load(u->sq_head) >= u->sq_entries)
+	{
+		if(uring_submit(u, -1) < 0) return(NULL);
+		if(u->tail - _load(u->sq_head) >= u->sq_entries) return(NULL);
+	}
+	
+	sqe = &u->sqes[u->tail & u->sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	u->tail++;
+	
+	return(sqe);
+}
+
+unsigned uring_sq_space(uring_t *u)
+{
+	/* Returns the number of free submission entries */
+	return(u->sq_entries - (u->tail - _load(u->sq_head)));
+}
+
+int uring_submit(uring_t *u, int timeout_ms)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned submit;
+	int r;
+	
+	/* Submit any pending entries and, if timeout_ms >= 0, wait up
+	 * to timeout_ms for a completion. Returns -1 on error */
+	
+	submit = u->tail - *u->sq_tail;
+	_store(u->sq_tail, u->tail);
+	
+	if(timeout_ms < 0)
+	{
+		if(submit == 0) return(0);
+		r = _enter(u->fd, submit, 0, 0, NULL, 0);
+	}
+	else
+	{
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+		
+		memset(&arg, 0, sizeof(arg));
+		arg.ts = (uint64_t) (uintptr_t) &ts;
+		
+		r = _enter(u->fd, submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	}
+	
+	if(r < 0 && errno != ETIME && errno != EINTR && errno != EBUSY)
+	{
+		perror("io_uring_enter");
+		return(-1);
+	}
+	
+	return(0);
+}
+
+struct io_uring_cqe *uring_peek_cqe(uring_t *u)
+{
+	unsigned head = *u->cq_head;
+	
+	/* Returns the next completion, or NULL if there are none */
+	
+	if(head == _load(u->cq_tail)) return(NULL);
+	
+	return(&u->cqes[head & u->cq_mask]);
+}
+
+void uring_cqe_seen(uring_t *u)
+{
+	_store(u->cq_head, *u->cq_head + 1);
+}
+
+int uring_register_buffers(uring_t *u, struct iovec *iov, int count)
+{
+	/* Register memory for use by fixed buffer operations. This can
+	 * fail if the memory lock limit (RLIMIT_MEMLOCK) is too low */
+	
+	if(_register(u->fd, IORING_REGISTER_BUFFERS, iov, count) < 0)
+	{
+		perror("io_uring_register");
+		return(-1);
+	}
+	
+	return(0);
+}
+
+int uring_init_bufs(uring_t *u, uring_bufs_t *b, uint16_t group, int count, int size)
+{
+	struct io_uring_buf_reg reg;
+	int i;
+	
+	/* Allocate and register a ring of count buffers of size bytes. The
+	 * count must be a power of 2. Returns 0 on success, -1 on error */
+	
+	memset(b, 0, sizeof(uring_bufs_t));
+	b->group = group;
+	b->count = count;
+	b->size = size;
+	
+	b->ring_len = count * sizeof(struct io_uring_buf);
+	b->ring = mmap(NULL, b->ring_len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	
+	if(b->ring == MAP_FAILED)
+	{
+		perror("mmap");
+		return(-1);
+	}
+	
+	b->data = mmap(NULL, (size_t) count * size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	
+	if(b->data == MAP_FAILED)
+	{
+		perror("mmap");
+		munmap(b->ring, b->ring_len);
+		return(-1);
+	}
+	
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t) (uintptr_t) b->ring;
+	reg.ring_entries = count;
+	reg.bgid = group;
+	
+	/* Provided buffer rings need 5.19 or later */
+	if(_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+	{
+		perror("io_uring_register");
+		munmap(b->data, (size_t) count * size);
+		munmap(b->ring, b->ring_len);
+		return(-1);
+	}
+	
+	/* Hand all the buffers to the kernel */
+	for(i = 0; i < count; i++)
+	{
+		uring_recycle_buf(b, i);
+	}
+	
+	return(0);
+}
+
+uint8_t *uring_buf(uring_bufs_t *b, int bid)
+{
+	return(b->data + (size_t) bid * b->size);
+}
+
+void uring_recycle_buf(uring_bufs_t *b, int bid)
+{
+	struct io_uring_buf *buf;
+	
+	/* Return a buffer to the kernel once its contents have been used */
+	
+	buf = &b->ring->bufs[b->tail & (b->count - 1)];
+	buf->addr = (uint64_t) (uintptr_t) uring_buf(b, bid);
+	buf->len = b->size;
+	buf->bid = bid;
+	
+	b->tail++;
+	_store(&b->ring->tail, b->tail);
+}
+
@@ -0,0 +1,73 @@
+/* uring.c/h - Minimal io_uring wrapper using the raw system calls       */
+/*=======================================================================*/
+/* Copyright (C)2026 The tsmerge contributors                            */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+
+#ifndef _URING_H
+#define _URING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+typedef struct {
+	
+	int fd;
+	unsigned features;
+	
+	/* Submission queue. Entries are added at tail and
+	 * handed to the kernel by uring_submit() */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned tail;
+	struct io_uring_sqe *sqes;
+	
+	/* Completion queue */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	
+	/* Mapped rings */
+	void *sq_ring;
+	size_t sq_ring_len;
+	void *cq_ring;
+	size_t cq_ring_len;
+	size_t sqes_len;
+	
+} uring_t;
+
+/* A ring of buffers provided to the kernel for multishot receives */
+typedef struct {
+	
+	uint16_t group;
+	int count;
+	int size;
+	uint8_t *data;
+	
+	struct io_uring_buf_ring *ring;
+	size_t ring_len;
+	uint16_t tail;
+	
+} uring_bufs_t;
+
+extern int uring_init(uring_t *u, unsigned entries);
+extern void uring_free(uring_t *u);
+extern struct io_uring_sqe *uring_get_sqe(uring_t *u);
+extern unsigned uring_sq_space(uring_t *u);
+extern int uring_submit(uring_t *u, int timeout_ms);
+extern struct io_uring_cqe *uring_peek_cqe(uring_t *u);
+extern void uring_cqe_seen(uring_t *u);
+extern int uring_register_buffers(uring_t *u, struct iovec *iov, int count);
+extern int uring_init_bufs(uring_t *u, uring_bufs_t *b, uint16_t group, int count, int size);
+extern uint8_t *uring_buf(uring_bufs_t *b, int bid);
+extern void uring_recycle_buf(uring_bufs_t *b, int bid);
+
+#endif
+